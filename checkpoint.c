@@ -0,0 +1,201 @@
+/*
+ * COLO background daemon state checkpoint
+ *
+ * Copyright (c) Lukas Straub <lukasstraub2@web.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib-2.0/glib.h>
+#include <json-glib-1.0/json-glib/json-glib.h>
+
+#include "checkpoint.h"
+#include "util.h"
+#include "json_util.h"
+
+#define CHECKPOINT_FORMAT 1
+
+static void checkpoint_append_node(GString *out, const gchar *name,
+                                   JsonNode *node) {
+    g_string_append_printf(out, ", \"%s\": ", name);
+    if (node) {
+        gchar *str = json_to_string(node, FALSE);
+        g_string_append(out, str);
+        g_free(str);
+    } else {
+        g_string_append(out, "null");
+    }
+}
+
+gchar *checkpoint_serialize(const ColodCheckpoint *checkpoint) {
+    GString *out = g_string_new(NULL);
+
+    g_string_append_printf(out, "{\"format\": %u, \"state\": ",
+                           CHECKPOINT_FORMAT);
+    json_append_string(out, checkpoint->state);
+    g_string_append_printf(out, ", \"primary\": %s, \"replication\": %s,"
+                           " \"failed\": %s, \"peer-failover\": %s,"
+                           " \"peer-failed\": %s, \"yellow\": %s,"
+                           " \"peer-yellow\": %s, \"peer\": ",
+                           bool_to_json(checkpoint->primary),
+                           bool_to_json(checkpoint->replication),
+                           bool_to_json(checkpoint->failed),
+                           bool_to_json(checkpoint->peer_failover),
+                           bool_to_json(checkpoint->peer_failed),
+                           bool_to_json(checkpoint->yellow),
+                           bool_to_json(checkpoint->peer_yellow));
+    json_append_string(out, checkpoint->peer);
+    checkpoint_append_node(out, "migration-start",
+                           checkpoint->migration_start);
+    checkpoint_append_node(out, "migration-switchover",
+                           checkpoint->migration_switchover);
+    checkpoint_append_node(out, "failover-primary",
+                           checkpoint->failover_primary);
+    checkpoint_append_node(out, "failover-secondary",
+                           checkpoint->failover_secondary);
+    checkpoint_append_node(out, "yank-instances",
+                           checkpoint->yank_instances);
+    g_string_append(out, "}\n");
+
+    return g_string_free(out, FALSE);
+}
+
+int checkpoint_write(const gchar *path, const gchar *serialized,
+                     GError **errp) {
+    if (!g_file_set_contents(path, serialized, -1, errp)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static gboolean checkpoint_get_bool(JsonNode *root, const gchar *member,
+                                    gboolean *ret) {
+    JsonNode *node = get_member_node(root, member);
+
+    if (!node || !JSON_NODE_HOLDS_VALUE(node)
+            || json_node_get_value_type(node) != G_TYPE_BOOLEAN) {
+        return FALSE;
+    }
+
+    *ret = json_node_get_boolean(node);
+    return TRUE;
+}
+
+static gboolean checkpoint_get_str(JsonNode *root, const gchar *member,
+                                   gchar **ret) {
+    JsonNode *node = get_member_node(root, member);
+
+    if (!node || !JSON_NODE_HOLDS_VALUE(node)
+            || json_node_get_value_type(node) != G_TYPE_STRING) {
+        return FALSE;
+    }
+
+    *ret = g_strdup(json_node_get_string(node));
+    return TRUE;
+}
+
+static gboolean checkpoint_get_array(JsonNode *root, const gchar *member,
+                                     gboolean nullable, JsonNode **ret) {
+    JsonNode *node = get_member_node(root, member);
+
+    if (node && nullable && JSON_NODE_HOLDS_NULL(node)) {
+        *ret = NULL;
+        return TRUE;
+    }
+
+    if (!node || !JSON_NODE_HOLDS_ARRAY(node)) {
+        return FALSE;
+    }
+
+    *ret = json_node_ref(node);
+    return TRUE;
+}
+
+ColodCheckpoint *checkpoint_load(const gchar *path, GError **errp) {
+    GError *local_errp = NULL;
+    ColodCheckpoint *checkpoint;
+    gchar *contents;
+    JsonNode *root, *format;
+
+    if (!g_file_get_contents(path, &contents, NULL, &local_errp)) {
+        if (g_error_matches(local_errp, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+            g_error_free(local_errp);
+            return NULL;
+        }
+        g_propagate_error(errp, local_errp);
+        return NULL;
+    }
+
+    root = json_from_string(contents, &local_errp);
+    g_free(contents);
+    if (!root) {
+        if (local_errp) {
+            g_propagate_error(errp, local_errp);
+        } else {
+            colod_error_set(errp, "Checkpoint %s is empty", path);
+        }
+        return NULL;
+    }
+
+    if (!JSON_NODE_HOLDS_OBJECT(root)
+            || !(format = get_member_node(root, "format"))
+            || !JSON_NODE_HOLDS_VALUE(format)
+            || json_node_get_value_type(format) != G_TYPE_INT64
+            || json_node_get_int(format) != CHECKPOINT_FORMAT) {
+        colod_error_set(errp, "Checkpoint %s has an unknown format", path);
+        json_node_unref(root);
+        return NULL;
+    }
+
+    checkpoint = g_new0(ColodCheckpoint, 1);
+    if (!checkpoint_get_str(root, "state", &checkpoint->state)
+            || !checkpoint_get_bool(root, "primary", &checkpoint->primary)
+            || !checkpoint_get_bool(root, "replication",
+                                    &checkpoint->replication)
+            || !checkpoint_get_bool(root, "failed", &checkpoint->failed)
+            || !checkpoint_get_bool(root, "peer-failover",
+                                    &checkpoint->peer_failover)
+            || !checkpoint_get_bool(root, "peer-failed",
+                                    &checkpoint->peer_failed)
+            || !checkpoint_get_bool(root, "yellow", &checkpoint->yellow)
+            || !checkpoint_get_bool(root, "peer-yellow",
+                                    &checkpoint->peer_yellow)
+            || !checkpoint_get_str(root, "peer", &checkpoint->peer)
+            || !checkpoint_get_array(root, "migration-start", FALSE,
+                                     &checkpoint->migration_start)
+            || !checkpoint_get_array(root, "migration-switchover", FALSE,
+                                     &checkpoint->migration_switchover)
+            || !checkpoint_get_array(root, "failover-primary", FALSE,
+                                     &checkpoint->failover_primary)
+            || !checkpoint_get_array(root, "failover-secondary", FALSE,
+                                     &checkpoint->failover_secondary)
+            || !checkpoint_get_array(root, "yank-instances", TRUE,
+                                     &checkpoint->yank_instances)) {
+        colod_error_set(errp, "Checkpoint %s is invalid", path);
+        checkpoint_free(checkpoint);
+        json_node_unref(root);
+        return NULL;
+    }
+
+    json_node_unref(root);
+    return checkpoint;
+}
+
+void checkpoint_free(ColodCheckpoint *checkpoint) {
+    JsonNode *nodes[] = {
+        checkpoint->migration_start, checkpoint->migration_switchover,
+        checkpoint->failover_primary, checkpoint->failover_secondary,
+        checkpoint->yank_instances
+    };
+
+    for (guint i = 0; i < G_N_ELEMENTS(nodes); i++) {
+        if (nodes[i]) {
+            json_node_unref(nodes[i]);
+        }
+    }
+    g_free(checkpoint->state);
+    g_free(checkpoint->peer);
+    g_free(checkpoint);
+}
@@ -0,0 +1,45 @@
+/*
+ * COLO background daemon state checkpoint
+ *
+ * Copyright (c) Lukas Straub <lukasstraub2@web.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <glib-2.0/glib.h>
+#include <json-glib-1.0/json-glib/json-glib.h>
+
+/*
+ * The state of the main coroutine and the configuration given by the
+ * management client, written to base_dir so a restarted daemon can carry
+ * on where the old one stopped.
+ */
+typedef struct ColodCheckpoint {
+    gchar *state;
+    gboolean primary, replication;
+    gboolean failed, peer_failover, peer_failed;
+    gboolean yellow, peer_yellow;
+    gchar *peer;
+    JsonNode *migration_start, *migration_switchover;
+    JsonNode *failover_primary, *failover_secondary;
+    // NULL if never set
+    JsonNode *yank_instances;
+} ColodCheckpoint;
+
+/*
+ * Members of a checkpoint returned by checkpoint_load() are owned by it,
+ * one built for checkpoint_serialize() may borrow them.
+ */
+gchar *checkpoint_serialize(const ColodCheckpoint *checkpoint);
+// Atomically replaces the file at path
+int checkpoint_write(const gchar *path, const gchar *serialized,
+                     GError **errp);
+// Returns NULL without setting errp if there is no checkpoint at path
+ColodCheckpoint *checkpoint_load(const gchar *path, GError **errp);
+void checkpoint_free(ColodCheckpoint *checkpoint);
+
+#endif // CHECKPOINT_H
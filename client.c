@@ -9,6 +9,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <syslog.h>
 #include <sys/socket.h>
@@ -23,15 +24,43 @@
 #include "qmp.h"
 #include "main_coroutine.h"
 #include "coroutine_stack.h"
+#include "cpg.h"
+#include "store.h"
+#include "store_replica.h"
 
 
 typedef struct ColodClient {
     struct Coroutine coroutine;
     QLIST_ENTRY(ColodClient) next;
     const ColodContext *ctx;
+    ColodClientListener *listener;
+    guint id;
+    gint64 connected;
     GIOChannel *channel;
-    JsonNode **store;
+    ColodStore *store;
+    GHashTable *commands;
+    // Requests being served by their own coroutine
+    guint inflight;
+    // The reader waits for inflight requests to complete
+    gboolean reader_waiting;
+    // Replies are written whole, one request at a time
+    CoroutineLock write_lock;
     gboolean stopped_qemu;
+    // Changes not yet written to a subscribed client
+    gboolean subscribed;
+    GQueue stream;
+    guint stream_dropped;
+    guint stream_source_id;
+    // Passthrough requests waiting for their turn on the qmp channel
+    GQueue passthrough;
+    gboolean active;
+    gsize deficit;
+    // Token bucket for --client_rate_limit
+    guint tokens;
+    gint64 tokens_time;
+    // Counters for query-clients
+    guint64 requests, passthrough_requests, errors, throttled;
+    guint64 bytes_in, bytes_out;
     gboolean quit;
     gboolean busy;
 } ColodClient;
@@ -42,44 +71,189 @@ struct ColodClientListener {
     const ColodContext *ctx;
     guint listen_source_id;
     struct ColodClientHead head;
-    JsonNode *store;
+    ColodStore *store;
+    // NULL unless --store_replicate
+    ColodStoreReplica *replica;
+    GHashTable *commands;
+    // Idle ClientRequests for reuse
+    GQueue request_pool;
+    guint client_count, next_id;
+    guint64 rejected;
+    // Clients with queued passthrough requests in deficit round robin order
+    GQueue active;
+    /*
+     * qmp serves one command at a time, so there is a single passthrough
+     * slot shared by all clients. Deficit round robin only decides whose
+     * request gets it next.
+     */
+    gboolean passthrough_busy;
+    guint throttle_source_id;
 };
 
-static ColodQmpResult *create_reply(const gchar *member) {
-    ColodQmpResult *result;
+/*
+ * A request of a client, served by its own coroutine. Requests tagged with
+ * an "id" are pipelined and their replies are written as they complete,
+ * requests without one are served in order.
+ */
+typedef struct ClientRequest {
+    struct Coroutine coroutine;
+    ColodClient *client;
+    ColodQmpResult *request;
+    GString *reply;
+    // Set by client_schedule() when it is the turn of a passthrough request
+    gboolean granted;
+} ClientRequest;
+
+// Maximum number of idle requests kept in the pool
+#define CLIENT_REQUEST_POOL_MAX 32
+
+// Bytes of passthrough requests a client may send per round
+#define CLIENT_DRR_QUANTUM 4096
+
+typedef enum ClientArgType {
+    ARG_STRING,
+    ARG_ARRAY,
+    ARG_OBJECT,
+    ARG_ANY
+} ClientArgType;
+
+typedef struct ClientArg {
+    const gchar *name;
+    ClientArgType type;
+} ClientArg;
+
+// Allowed states
+#define COMMAND_PRIMARY (1 << 0)
+#define COMMAND_SECONDARY (1 << 1)
+#define COMMAND_ANY (COMMAND_PRIMARY | COMMAND_SECONDARY)
+
+typedef struct ClientCommand {
+    const gchar *name;
+    // Handlers write the reply to reply and return -1 on error
+    int (*handler)(ColodClient *client, ColodQmpResult *request,
+                   GString *reply);
+    // Set instead of handler for commands that may yield
+    int (*handler_co)(Coroutine *coroutine, ColodClient *client,
+                      ColodQmpResult *request, GString *reply);
+    // Required members of the request, terminated by { NULL }
+    const ClientArg *args;
+    guint allowed;
+} ClientCommand;
+
+typedef struct ClientCommandEntry {
+    const ClientCommand *command;
+    guint64 calls;
+    guint64 errors;
+    gint64 total_us;
+    gint64 max_us;
+} ClientCommandEntry;
+
+// Maximum number of changes queued for a subscribed client
+#define CLIENT_STREAM_MAX 128
+
+static GString *reply_begin(GString *reply) {
+    g_string_assign(reply, "{\"return\": ");
+    return reply;
+}
 
-    gchar *reply = g_strdup_printf("{\"return\": %s}\n", member);
-    result = qmp_parse_result(reply, strlen(reply), NULL);
-    assert(result);
+static void reply_end(GString *reply) {
+    g_string_append(reply, "}\n");
+}
 
-    return result;
+static int reply_empty(GString *reply) {
+    reply_begin(reply);
+    g_string_append(reply, "{}");
+    reply_end(reply);
+    return 0;
 }
 
-static ColodQmpResult *create_error_reply(const gchar *message) {
-    ColodQmpResult *result;
+static int reply_error(GString *reply, const gchar *message) {
+    g_string_assign(reply, "{\"error\": ");
+    json_append_string(reply, message);
+    g_string_append(reply, "}\n");
+    return -1;
+}
 
-    gchar *reply = g_strdup_printf("{\"error\": \"%s\"}\n", message);
-    result = qmp_parse_result(reply, strlen(reply), NULL);
-    assert(result);
+// Tag the reply to an exec-colod request with the id of the request
+static void reply_add_id(GString *reply, ColodQmpResult *request) {
+    JsonNode *id = get_member_node(request->json_root, "id");
+    gchar *id_str;
 
-    return result;
+    if (!id) {
+        return;
+    }
+
+    // Every reply ends with "}\n"
+    assert(reply->len >= 2);
+    g_string_truncate(reply, reply->len - 2);
+    id_str = json_to_string(id, FALSE);
+    g_string_append_printf(reply, ", \"id\": %s}\n", id_str);
+    g_free(id_str);
 }
 
-#define handle_query_status_co(...) \
-    co_wrap(_handle_query_status_co(__VA_ARGS__))
-static ColodQmpResult *_handle_query_status_co(Coroutine *coroutine,
-                                               const ColodContext *ctx) {
+// Forward a reply from qemu unchanged
+static int reply_result(GString *reply, ColodQmpResult *result) {
+    gboolean error;
+
+    if (result->json_root) {
+        error = has_member(result->json_root, "error");
+    } else {
+        error = json_scan_member(result->line, result->len, "error",
+                                 NULL, NULL) == 1;
+    }
+
+    g_string_assign(reply, result->line);
+    return error ? -1 : 0;
+}
+
+// Compare two raw json values, ignoring how strings are quoted
+static gboolean json_value_equal(const gchar *a, gsize a_len,
+                                 const gchar *b, gsize b_len) {
+    if (a_len >= 2 && b_len >= 2 && (a[0] == '"' || a[0] == '\'')
+            && (b[0] == '"' || b[0] == '\'')) {
+        a++;
+        a_len -= 2;
+        b++;
+        b_len -= 2;
+    }
+
+    return a_len == b_len && !memcmp(a, b, a_len);
+}
+
+// A relayed reply has to carry the id of the request
+static gboolean reply_id_matches(ColodQmpResult *request,
+                                 ColodQmpResult *result) {
+    const gchar *id, *reply_id;
+    gsize id_len, reply_id_len;
+
+    if (json_scan_member(request->line, request->len, "id",
+                         &id, &id_len) != 1) {
+        return TRUE;
+    }
+    if (json_scan_member(result->line, result->len, "id",
+                         &reply_id, &reply_id_len) != 1) {
+        return FALSE;
+    }
+
+    return json_value_equal(id, id_len, reply_id, reply_id_len);
+}
+
+static int handle_query_status_co(Coroutine *coroutine, ColodClient *client,
+                                  G_GNUC_UNUSED ColodQmpResult *request,
+                                  GString *reply) {
+    const ColodContext *ctx = client->ctx;
     int ret;
-    ColodQmpResult *result;
     ColodState state;
+    ColodPeerState peer;
     gboolean failed = FALSE;
     GError *local_errp = NULL;
+    GString *out;
 
-    co_begin(ColodQmpResult*, NULL);
+    co_begin(int, 0);
 
     co_recurse(ret = colod_check_health_co(coroutine, ctx->main_coroutine, &local_errp));
     if (coroutine->yield) {
-        return NULL;
+        return 0;
     }
     if (ret < 0) {
         log_error(local_errp->message);
@@ -92,275 +266,848 @@ static ColodQmpResult *_handle_query_status_co(Coroutine *coroutine,
 
 
     colod_query_status(ctx->main_coroutine, &state);
-    gchar *reply;
-    reply = g_strdup_printf("{\"return\": "
-                            "{\"primary\": %s, \"replication\": %s,"
-                            " \"failed\": %s, \"peer-failover\": %s,"
-                            " \"peer-failed\": %s}}\n",
-                            bool_to_json(state.primary),
-                            bool_to_json(state.replication),
-                            bool_to_json(failed || state.failed),
-                            bool_to_json(state.peer_failover),
-                            bool_to_json(state.peer_failed));
-
-    result = qmp_parse_result(reply, strlen(reply), NULL);
-    assert(result);
-    return result;
-}
-
-static ColodQmpResult *handle_query_store(ColodClient *client) {
-    ColodQmpResult *result;
-    gchar *store_str;
-    JsonNode *store = *client->store;
+    colod_query_peer_state(ctx->main_coroutine, &peer);
+
+    YellowStatus yellow;
+    colod_query_yellow(ctx->main_coroutine, &yellow);
+
+    out = reply_begin(reply);
+    g_string_append(out, "{\"state\": ");
+    json_append_string(out, state.state);
+    g_string_append_printf(out, ", \"primary\": %s, \"replication\": %s,"
+                           " \"failed\": %s, \"peer-failover\": %s,"
+                           " \"peer-failed\": %s, \"yellow\": %s,"
+                           " \"link-score\": %u, \"links\": [",
+                           bool_to_json(state.primary),
+                           bool_to_json(state.replication),
+                           bool_to_json(failed || state.failed),
+                           bool_to_json(state.peer_failover),
+                           bool_to_json(state.peer_failed),
+                           bool_to_json(state.yellow),
+                           yellow.score);
+
+    for (guint i = 0; i < yellow.link_count; i++) {
+        const YellowLink *link = &yellow.links[i];
+        g_string_append_printf(out, "%s{\"interface\": ", i ? ", " : "");
+        json_append_string(out, link->ifname);
+        g_string_append_printf(out, ", \"role\": \"%s\", \"weight\": %u,"
+                               " \"up\": %s, \"degraded\": %s,"
+                               " \"flaps\": %u}",
+                               yellow_link_role_str(link->role),
+                               link->weight, bool_to_json(link->up),
+                               bool_to_json(link->degraded), link->flaps);
+    }
 
-    if (store) {
-        store_str = json_to_string(store, FALSE);
+    g_string_append_printf(out, "], \"flap-penalty\": %u,"
+                           " \"flap-suppressed\": %s,"
+                           " \"netlink\": {\"overruns\": %" G_GUINT64_FORMAT ","
+                           " \"resyncs\": %" G_GUINT64_FORMAT "},"
+                           " \"peer-status\": ",
+                           yellow.penalty, bool_to_json(yellow.suppressed),
+                           yellow.netlink.overruns, yellow.netlink.resyncs);
+
+    if (peer.valid) {
+        g_string_append(out, "{\"state\": ");
+        json_append_string(out, peer.state.state);
+        g_string_append_printf(out, ", \"version\": %u,"
+                               " \"primary\": %s, \"replication\": %s,"
+                               " \"failed\": %s, \"peer-failover\": %s,"
+                               " \"peer-failed\": %s, \"yellow\": %s}",
+                               peer.version,
+                               bool_to_json(peer.state.primary),
+                               bool_to_json(peer.state.replication),
+                               bool_to_json(peer.state.failed),
+                               bool_to_json(peer.state.peer_failover),
+                               bool_to_json(peer.state.peer_failed),
+                               bool_to_json(peer.state.yellow));
     } else {
-        store_str = g_strdup("{}");
+        g_string_append(out, "null");
     }
 
-    result = create_reply(store_str);
-    g_free(store_str);
-    return result;
+    g_string_append(out, "}");
+    reply_end(reply);
+    return 0;
 }
 
-static ColodQmpResult *handle_set_store(ColodQmpResult *request,
-                                        ColodClient *client) {
-    JsonNode *store;
+static int handle_query_store(ColodClient *client,
+                              G_GNUC_UNUSED ColodQmpResult *request,
+                              GString *reply) {
+    reply_begin(reply);
+    g_string_append(reply, store_serialized(client->store));
+    reply_end(reply);
+
+    return 0;
+}
+
+static int handle_get_store(ColodClient *client,
+                            G_GNUC_UNUSED ColodQmpResult *request,
+                            GString *reply) {
+    reply_begin(reply);
+    g_string_append_printf(reply, "{\"version\": %" G_GUINT64_FORMAT ","
+                           " \"store\": %s}", store_version(client->store),
+                           store_serialized(client->store));
+    reply_end(reply);
+
+    return 0;
+}
 
-    if (!has_member(request->json_root, "store")) {
-        return create_error_reply("Member 'store' missing");
+static int handle_get_store_key(ColodClient *client,
+                                ColodQmpResult *request,
+                                GString *reply) {
+    const gchar *key = get_member_str(request->json_root, "key");
+    JsonNode *value = store_get(client->store, key);
+
+    reply_begin(reply);
+    g_string_append_printf(reply, "{\"version\": %" G_GUINT64_FORMAT ","
+                           " \"value\": ", store_version(client->store));
+    if (value) {
+        gchar *value_str = json_to_string(value, FALSE);
+        g_string_append(reply, value_str);
+        g_free(value_str);
+    } else {
+        g_string_append(reply, "null");
     }
+    g_string_append(reply, "}");
+    reply_end(reply);
+
+    return 0;
+}
 
-    store = get_member_node(request->json_root, "store");
+// The optional "if-version" member for compare-and-set, -1 if missing
+static int store_if_version(ColodQmpResult *request, gint64 *if_version,
+                            GString *reply) {
+    JsonNode *node;
 
-    if (*client->store) {
-        json_node_unref(*client->store);
+    *if_version = -1;
+    if (!has_member(request->json_root, "if-version")) {
+        return 0;
     }
-    *client->store = json_node_ref(store);
 
-    return create_reply("{}");
+    node = get_member_node(request->json_root, "if-version");
+    if (!JSON_NODE_HOLDS_VALUE(node)
+            || json_node_get_value_type(node) != G_TYPE_INT64
+            || json_node_get_int(node) < 0) {
+        return reply_error(reply, "Member 'if-version' must be a non-negative "
+                                  "integer");
+    }
+
+    *if_version = json_node_get_int(node);
+    return 0;
 }
 
-static ColodQmpResult *handle_quit(const ColodContext *ctx) {
-    colod_quit(ctx->main_coroutine);
+static int reply_store_change(GString *reply, ColodStore *store, int ret,
+                              GError *local_errp) {
+    if (ret < 0) {
+        ret = reply_error(reply, local_errp->message);
+        g_error_free(local_errp);
+        return ret;
+    }
 
-    return create_reply("{}");
+    reply_begin(reply);
+    g_string_append_printf(reply, "{\"version\": %" G_GUINT64_FORMAT "}",
+                           store_version(store));
+    reply_end(reply);
+    return 0;
 }
 
-static ColodQmpResult *handle_autoquit(const ColodContext *ctx) {
-    colod_autoquit(ctx->main_coroutine);
+static int handle_set_store(ColodClient *client,
+                            ColodQmpResult *request,
+                            GString *reply) {
+    JsonNode *store = get_member_node(request->json_root, "store");
+    GError *local_errp = NULL;
+    gint64 if_version;
+    int ret;
 
-    return create_reply("{}");
+    if (store_if_version(request, &if_version, reply) < 0) {
+        return -1;
+    }
+
+    ret = store_set(client->store, store, if_version, &local_errp);
+    return reply_store_change(reply, client->store, ret, local_errp);
 }
 
-static ColodQmpResult *handle_start_migration(const ColodContext *ctx) {
+static int handle_set_store_key(ColodClient *client,
+                                ColodQmpResult *request,
+                                GString *reply) {
+    const gchar *key = get_member_str(request->json_root, "key");
+    JsonNode *value = get_member_node(request->json_root, "value");
+    GError *local_errp = NULL;
+    gint64 if_version;
     int ret;
 
-    ret = colod_start_migration(ctx->main_coroutine);
-    if (ret < 0) {
-        return create_error_reply("Pending actions");
+    if (store_if_version(request, &if_version, reply) < 0) {
+        return -1;
     }
 
-    return create_reply("{}");
+    ret = store_set_key(client->store, key, value, if_version, &local_errp);
+    return reply_store_change(reply, client->store, ret, local_errp);
 }
 
-static JsonNode *get_commands(ColodQmpResult *request, GError **errp) {
-    JsonNode *commands;
+static int handle_patch_store(ColodClient *client,
+                              ColodQmpResult *request,
+                              GString *reply) {
+    JsonNode *patch = get_member_node(request->json_root, "patch");
+    GError *local_errp = NULL;
+    gint64 if_version;
+    int ret;
 
-    if (!has_member(request->json_root, "commands")) {
-        colod_error_set(errp, "Member 'commands' missing");
-        return NULL;
+    if (store_if_version(request, &if_version, reply) < 0) {
+        return -1;
     }
 
-    commands = get_member_node(request->json_root, "commands");
-    if (!JSON_NODE_HOLDS_ARRAY(commands)) {
-        colod_error_set(errp, "Member 'commands' must be an array");
-        return NULL;
+    ret = store_patch(client->store, patch, if_version, &local_errp);
+    return reply_store_change(reply, client->store, ret, local_errp);
+}
+
+static int check_replica(ColodClient *client, GString *reply) {
+    if (!client->listener->replica) {
+        return reply_error(reply, "Store replication is disabled");
     }
 
-    assert(commands);
-    return commands;
+    return 0;
 }
 
-static ColodQmpResult *handle_set_migration_start(ColodQmpResult *request,
-                                                  const ColodContext *ctx) {
-    GError *local_errp = NULL;
-    ColodQmpResult *reply;
+static int handle_query_replicated_store(ColodClient *client,
+                                         G_GNUC_UNUSED ColodQmpResult *request,
+                                         GString *reply) {
+    ColodStoreReplica *replica = client->listener->replica;
 
-    JsonNode *commands = get_commands(request, &local_errp);
-    if (!commands) {
-        reply = create_error_reply(local_errp->message);
-        g_error_free(local_errp);
-        return reply;
+    if (check_replica(client, reply) < 0) {
+        return -1;
     }
 
-    qmp_commands_set_migration_start(ctx->commands, commands);
+    reply_begin(reply);
+    g_string_append(reply, store_replica_serialized(replica));
+    reply_end(reply);
 
-    return create_reply("{}");
+    return 0;
 }
 
-static ColodQmpResult *handle_set_migration_switchover(ColodQmpResult *request,
-                                                       const ColodContext *ctx) {
-    GError *local_errp = NULL;
-    ColodQmpResult *reply;
-
-    JsonNode *commands = get_commands(request, &local_errp);
-    if (!commands) {
-        reply = create_error_reply(local_errp->message);
-        g_error_free(local_errp);
-        return reply;
+static int handle_get_replicated_store_key(ColodClient *client,
+                                           ColodQmpResult *request,
+                                           GString *reply) {
+    const gchar *key = get_member_str(request->json_root, "key");
+    JsonNode *value;
+    JsonObject *version;
+    JsonObject *result;
+    JsonNode *node;
+    gchar *result_str;
+
+    if (check_replica(client, reply) < 0) {
+        return -1;
     }
 
-    qmp_commands_set_migration_switchover(ctx->commands, commands);
+    value = store_replica_get(client->listener->replica, key, &version);
+    result = json_object_new();
+    if (value) {
+        json_object_set_member(result, "value", json_node_copy(value));
+    } else {
+        json_object_set_null_member(result, "value");
+    }
+    json_object_set_object_member(result, "version",
+                                  version ? json_object_ref(version)
+                                          : json_object_new());
+    node = json_node_alloc();
+    json_node_init_object(node, result);
+    json_object_unref(result);
+    result_str = json_to_string(node, FALSE);
+    json_node_unref(node);
+
+    reply_begin(reply);
+    g_string_append(reply, result_str);
+    reply_end(reply);
+    g_free(result_str);
 
-    return create_reply("{}");
+    return 0;
 }
 
-static ColodQmpResult *handle_set_primary_failover(ColodQmpResult *request,
-                                                   const ColodContext *ctx) {
+#define client_write_replica_co(...) \
+    co_wrap(_client_write_replica_co(__VA_ARGS__))
+static int _client_write_replica_co(Coroutine *coroutine, ColodClient *client,
+                                    JsonNode *changes, gboolean merge,
+                                    GString *reply) {
+    int ret;
     GError *local_errp = NULL;
-    ColodQmpResult *reply;
 
-    JsonNode *commands = get_commands(request, &local_errp);
-    if (!commands) {
-        reply = create_error_reply(local_errp->message);
+    ret = _store_replica_write_co(coroutine, client->listener->replica,
+                                  changes, merge, &local_errp);
+    if (coroutine->yield) {
+        return 0;
+    }
+    if (ret < 0) {
+        ret = reply_error(reply, local_errp->message);
         g_error_free(local_errp);
-        return reply;
+        return ret;
     }
 
-    qmp_commands_set_failover_primary(ctx->commands, commands);
-
-    return create_reply("{}");
+    return reply_empty(reply);
 }
 
-static ColodQmpResult *handle_set_secondary_failover(ColodQmpResult *request,
-                                                     const ColodContext *ctx) {
-    GError *local_errp = NULL;
-    ColodQmpResult *reply;
+static int handle_set_replicated_store_key_co(Coroutine *coroutine,
+                                              ColodClient *client,
+                                              ColodQmpResult *request,
+                                              GString *reply) {
+    struct {
+        JsonNode *changes;
+    } *co;
+    JsonObject *changes;
+    const gchar *key;
+    int ret;
 
-    JsonNode *commands = get_commands(request, &local_errp);
-    if (!commands) {
-        reply = create_error_reply(local_errp->message);
-        g_error_free(local_errp);
-        return reply;
+    co_frame(co, sizeof(*co));
+    co_begin(int, -1);
+
+    if (check_replica(client, reply) < 0) {
+        return -1;
     }
 
-    qmp_commands_set_failover_secondary(ctx->commands, commands);
+    key = get_member_str(request->json_root, "key");
+    changes = json_object_new();
+    json_object_set_member(changes, key,
+                           json_node_copy(get_member_node(request->json_root,
+                                                          "value")));
+    CO changes = json_node_alloc();
+    json_node_init_object(CO changes, changes);
+    json_object_unref(changes);
 
-    return create_reply("{}");
-}
+    co_recurse(ret = client_write_replica_co(coroutine, client, CO changes,
+                                             FALSE, reply));
+    json_node_unref(CO changes);
 
-static ColodQmpResult *handle_set_yank(ColodQmpResult *request,
-                                       const ColodContext *ctx) {
-    JsonNode *instances;
+    co_end;
+
+    return ret;
+}
 
-    if (!has_member(request->json_root, "instances")) {
-        return create_error_reply("Member 'instances' missing");
+static int handle_patch_replicated_store_co(Coroutine *coroutine,
+                                            ColodClient *client,
+                                            ColodQmpResult *request,
+                                            GString *reply) {
+    if (check_replica(client, reply) < 0) {
+        return -1;
     }
 
-    instances = get_member_node(request->json_root, "instances");
-    if (!JSON_NODE_HOLDS_ARRAY(instances)) {
-        return create_error_reply("Member 'instances' must be an array");
+    return _client_write_replica_co(coroutine, client,
+                                    get_member_node(request->json_root,
+                                                    "patch"),
+                                    TRUE, reply);
+}
+
+static int handle_quit(ColodClient *client,
+                       G_GNUC_UNUSED ColodQmpResult *request,
+                       GString *reply) {
+    const ColodContext *ctx = client->ctx;
+    colod_quit(ctx->main_coroutine);
+
+    return reply_empty(reply);
+}
+
+static int handle_autoquit(ColodClient *client,
+                           G_GNUC_UNUSED ColodQmpResult *request,
+                           GString *reply) {
+    const ColodContext *ctx = client->ctx;
+    colod_autoquit(ctx->main_coroutine);
+
+    return reply_empty(reply);
+}
+
+static int handle_start_migration(ColodClient *client,
+                                  G_GNUC_UNUSED ColodQmpResult *request,
+                                  GString *reply) {
+    const ColodContext *ctx = client->ctx;
+    int ret;
+
+    ret = colod_start_migration(ctx->main_coroutine);
+    if (ret < 0) {
+        return reply_error(reply, "Pending actions");
     }
 
-    qmp_set_yank_instances(ctx->qmp, instances);
+    return reply_empty(reply);
+}
+
+static int handle_set_migration_start(ColodClient *client,
+                                      ColodQmpResult *request,
+                                      GString *reply) {
+    JsonNode *commands = get_member_node(request->json_root, "commands");
+
+    qmp_commands_set_migration_start(client->ctx->commands, commands);
 
-    return create_reply("{}");
+    return reply_empty(reply);
 }
 
-#define handle_yank_co(...) \
-    co_wrap(_handle_yank_co(__VA_ARGS__))
-static ColodQmpResult *_handle_yank_co(Coroutine *coroutine,
-                                       const ColodContext *ctx) {
-    ColodQmpResult *result;
+static int handle_set_migration_switchover(ColodClient *client,
+                                           ColodQmpResult *request,
+                                           GString *reply) {
+    JsonNode *commands = get_member_node(request->json_root, "commands");
+
+    qmp_commands_set_migration_switchover(client->ctx->commands, commands);
+
+    return reply_empty(reply);
+}
+
+static int handle_set_primary_failover(ColodClient *client,
+                                       ColodQmpResult *request,
+                                       GString *reply) {
+    JsonNode *commands = get_member_node(request->json_root, "commands");
+
+    qmp_commands_set_failover_primary(client->ctx->commands, commands);
+
+    return reply_empty(reply);
+}
+
+static int handle_set_secondary_failover(ColodClient *client,
+                                         ColodQmpResult *request,
+                                         GString *reply) {
+    JsonNode *commands = get_member_node(request->json_root, "commands");
+
+    qmp_commands_set_failover_secondary(client->ctx->commands, commands);
+
+    return reply_empty(reply);
+}
+
+static int handle_set_yank(ColodClient *client,
+                           ColodQmpResult *request,
+                           GString *reply) {
+    JsonNode *instances = get_member_node(request->json_root, "instances");
+
+    qmp_set_yank_instances(client->ctx->qmp, instances);
+
+    return reply_empty(reply);
+}
+
+static int handle_yank_co(Coroutine *coroutine,
+                          ColodClient *client,
+                          G_GNUC_UNUSED ColodQmpResult *request,
+                          GString *reply) {
     int ret;
     GError *local_errp = NULL;
 
-    ret = _colod_yank_co(coroutine, ctx->main_coroutine, &local_errp);
+    ret = _colod_yank_co(coroutine, client->ctx->main_coroutine, &local_errp);
     if (coroutine->yield) {
-        return NULL;
+        return 0;
     }
     if (ret < 0) {
-        result = create_error_reply(local_errp->message);
+        ret = reply_error(reply, local_errp->message);
         g_error_free(local_errp);
-        return result;
+        return ret;
     }
 
-    return create_reply("{}");
+    return reply_empty(reply);
 }
 
-#define handle_stop_co(...) \
-    co_wrap(_handle_stop_co(__VA_ARGS__))
-static ColodQmpResult *_handle_stop_co(Coroutine *coroutine,
-                                       ColodClient *client) {
+static int handle_stop_co(Coroutine *coroutine,
+                          ColodClient *client,
+                          G_GNUC_UNUSED ColodQmpResult *request,
+                          GString *reply) {
     ColodQmpResult *result;
     GError *local_errp = NULL;
+    int ret;
 
     result = _colod_execute_co(coroutine, client->ctx->main_coroutine, &local_errp,
                                "{'execute': 'stop'}\n");
     if (coroutine->yield) {
-        return NULL;
+        return 0;
     }
     if (!result) {
-        result = create_error_reply(local_errp->message);
+        ret = reply_error(reply, local_errp->message);
         g_error_free(local_errp);
-        return result;
+        return ret;
     }
 
     client->stopped_qemu = TRUE;
-    return result;
+    ret = reply_result(reply, result);
+    qmp_result_free(result);
+    return ret;
 }
 
-#define handle_cont_co(...) \
-    co_wrap(_handle_cont_co(__VA_ARGS__))
-static ColodQmpResult *_handle_cont_co(Coroutine *coroutine,
-                                       ColodClient *client) {
+static int handle_cont_co(Coroutine *coroutine,
+                          ColodClient *client,
+                          G_GNUC_UNUSED ColodQmpResult *request,
+                          GString *reply) {
     ColodQmpResult *result;
     GError *local_errp = NULL;
+    int ret;
 
     result = _colod_execute_co(coroutine, client->ctx->main_coroutine, &local_errp,
                                "{'execute': 'cont'}\n");
     if (coroutine->yield) {
-        return NULL;
+        return 0;
     }
     if (!result) {
-        result = create_error_reply(local_errp->message);
+        ret = reply_error(reply, local_errp->message);
         g_error_free(local_errp);
-        return result;
+        return ret;
     }
 
     client->stopped_qemu = FALSE;
-    return result;
+    ret = reply_result(reply, result);
+    qmp_result_free(result);
+    return ret;
+}
+
+static int handle_set_peer(ColodClient *client,
+                           ColodQmpResult *request,
+                           GString *reply) {
+    const gchar *peer = get_member_str(request->json_root, "peer");
+
+    colod_set_peer(client->ctx->main_coroutine, peer);
+
+    return reply_empty(reply);
+}
+
+static int handle_clear_peer(ColodClient *client,
+                             G_GNUC_UNUSED ColodQmpResult *request,
+                             GString *reply) {
+    colod_clear_peer(client->ctx->main_coroutine);
+
+    return reply_empty(reply);
+}
+
+static int handle_query_peer(ColodClient *client,
+                             G_GNUC_UNUSED ColodQmpResult *request,
+                             GString *reply) {
+    const ColodContext *ctx = client->ctx;
+    HeartbeatStats stats;
+    GString *out;
+
+    out = reply_begin(reply);
+    g_string_append(out, "{\"peer\": ");
+    json_append_string(out, colod_get_peer(ctx->main_coroutine));
+
+    colod_query_heartbeat(ctx->main_coroutine, &stats);
+    if (stats.enabled) {
+        g_string_append_printf(out, ", \"heartbeat\": "
+                               "{\"peer-seen\": %s, \"peer-late\": %s,"
+                               " \"missed\": %u, \"samples\": %" G_GUINT64_FORMAT ","
+                               " \"rtt-us\": %" G_GINT64_FORMAT ","
+                               " \"srtt-us\": %" G_GINT64_FORMAT ","
+                               " \"jitter-us\": %" G_GINT64_FORMAT "}",
+                               bool_to_json(stats.peer_seen),
+                               bool_to_json(stats.peer_late),
+                               stats.missed, stats.samples, stats.rtt,
+                               stats.srtt, stats.jitter);
+    }
+
+    g_string_append(out, "}");
+    reply_end(reply);
+    return 0;
 }
 
-static ColodQmpResult *handle_set_peer(ColodQmpResult *request,
-                                       const ColodContext *ctx) {
-    const gchar *peer;
+static int handle_query_membership(ColodClient *client,
+                                   G_GNUC_UNUSED ColodQmpResult *request,
+                                   GString *reply) {
+    const CpgMembership *membership = colod_cpg_membership(client->ctx->cpg);
+    reply_begin(reply);
+    g_string_append_printf(reply, "{\"local-nodeid\": %u,"
+                           " \"ring-id\": {\"nodeid\": %u, \"seq\": %" G_GUINT64_FORMAT "},"
+                           " \"members\": [",
+                           membership->local_nodeid, membership->ring_nodeid,
+                           (guint64) membership->ring_seq);
+
+    for (guint i = 0; i < membership->member_count; i++) {
+        const CpgMember *member = &membership->members[i];
+        g_string_append_printf(reply, "%s{\"nodeid\": %u, \"pid\": %u,"
+                               " \"joined\": %" G_GINT64_FORMAT "}",
+                               (i ? ", " : ""), member->nodeid, member->pid,
+                               member->joined);
+    }
 
-    if (!has_member(request->json_root, "peer")) {
-        return create_error_reply("Member 'peer' missing");
+    g_string_append(reply, "], \"history\": [");
+
+    // Oldest entry first
+    guint start = (membership->history_pos + CPG_HISTORY_MAX
+                   - membership->history_count) % CPG_HISTORY_MAX;
+    for (guint i = 0; i < membership->history_count; i++) {
+        const CpgHistoryEntry *entry;
+        entry = &membership->history[(start + i) % CPG_HISTORY_MAX];
+        g_string_append_printf(reply, "%s{\"time\": %" G_GINT64_FORMAT ","
+                               " \"event\": \"%s\", \"nodeid\": %u,"
+                               " \"pid\": %u, \"reason\": %u}",
+                               (i ? ", " : ""), entry->time,
+                               (entry->joined ? "join" : "leave"),
+                               entry->nodeid, entry->pid, entry->reason);
     }
 
-    peer = get_member_str(request->json_root, "peer");
-    colod_set_peer(ctx->main_coroutine, peer);
+    g_string_append(reply, "]}");
+    reply_end(reply);
+    return 0;
+}
+
+static gboolean colod_client_co(gpointer data);
+static void client_change_cb(gpointer data, const gchar *line) {
+    ColodClient *client = data;
 
-    return create_reply("{}");
+    // Drop the oldest changes of slow clients, the gap is reported later
+    if (g_queue_get_length(&client->stream) >= CLIENT_STREAM_MAX) {
+        g_free(g_queue_pop_head(&client->stream));
+        client->stream_dropped++;
+    }
+    g_queue_push_tail(&client->stream, g_strdup(line));
+
+    if (client->stream_source_id) {
+        g_source_remove(client->stream_source_id);
+        client->stream_source_id = 0;
+        g_idle_add(colod_client_co, client);
+    }
 }
 
-static ColodQmpResult *handle_query_peer(const ColodContext *ctx) {
-    ColodQmpResult *result;
-    gchar *reply;
-    reply = g_strdup_printf("{\"return\": "
-                            "{\"peer\": \"%s\"}}\n",
-                            colod_get_peer(ctx->main_coroutine));
+static int handle_subscribe(ColodClient *client,
+                            G_GNUC_UNUSED ColodQmpResult *request,
+                            GString *reply) {
+    ColodState state;
+    GString *out;
+
+    if (client->subscribed) {
+        return reply_error(reply, "Already subscribed");
+    }
+
+    client->subscribed = TRUE;
+    colod_add_notify_change(client->ctx->main_coroutine, client_change_cb,
+                            client);
+
+    colod_query_status(client->ctx->main_coroutine, &state);
+    out = reply_begin(reply);
+    g_string_append_printf(out, "{\"state\": \"%s\", \"yellow\": %s}",
+                           state.state, bool_to_json(state.yellow));
+    reply_end(reply);
+    return 0;
+}
+
+static int handle_query_commands(ColodClient *client,
+                                 ColodQmpResult *request, GString *reply);
+
+static int handle_query_clients(ColodClient *client,
+                                G_GNUC_UNUSED ColodQmpResult *request,
+                                GString *reply) {
+    ColodClientListener *listener = client->listener;
+    gint64 now = g_get_monotonic_time();
+    ColodClient *entry;
+    gboolean first = TRUE;
+
+    reply_begin(reply);
+    g_string_append_printf(reply, "{\"rejected\": %" G_GUINT64_FORMAT ","
+                           " \"clients\": [", listener->rejected);
+    QLIST_FOREACH(entry, &listener->head, next) {
+        g_string_append_printf(reply, "%s{\"id\": %u, \"self\": %s,"
+                               " \"connected-ms\": %" G_GINT64_FORMAT ","
+                               " \"subscribed\": %s, \"inflight\": %u,"
+                               " \"queued\": %u,"
+                               " \"requests\": %" G_GUINT64_FORMAT ","
+                               " \"passthrough\": %" G_GUINT64_FORMAT ","
+                               " \"errors\": %" G_GUINT64_FORMAT ","
+                               " \"throttled\": %" G_GUINT64_FORMAT ","
+                               " \"bytes-in\": %" G_GUINT64_FORMAT ","
+                               " \"bytes-out\": %" G_GUINT64_FORMAT "}",
+                               (first ? "" : ", "), entry->id,
+                               bool_to_json(entry == client),
+                               (now - entry->connected) / 1000,
+                               bool_to_json(entry->subscribed), entry->inflight,
+                               g_queue_get_length(&entry->passthrough),
+                               entry->requests, entry->passthrough_requests,
+                               entry->errors, entry->throttled,
+                               entry->bytes_in, entry->bytes_out);
+        first = FALSE;
+    }
+    g_string_append(reply, "]}");
+    reply_end(reply);
+    return 0;
+}
+
+static const ClientArg args_store[] = {
+    { "store", ARG_OBJECT },
+    { NULL }
+};
+
+static const ClientArg args_store_key[] = {
+    { "key", ARG_STRING },
+    { NULL }
+};
+
+static const ClientArg args_store_key_value[] = {
+    { "key", ARG_STRING },
+    { "value", ARG_ANY },
+    { NULL }
+};
+
+static const ClientArg args_store_patch[] = {
+    { "patch", ARG_OBJECT },
+    { NULL }
+};
+
+static const ClientArg args_commands[] = {
+    { "commands", ARG_ARRAY },
+    { NULL }
+};
+
+static const ClientArg args_instances[] = {
+    { "instances", ARG_ARRAY },
+    { NULL }
+};
+
+static const ClientArg args_peer[] = {
+    { "peer", ARG_STRING },
+    { NULL }
+};
+
+static const ClientCommand client_commands[] = {
+    { "query-status", NULL, handle_query_status_co, NULL, COMMAND_ANY },
+    { "query-store", handle_query_store, NULL, NULL, COMMAND_ANY },
+    { "set-store", handle_set_store, NULL, args_store, COMMAND_ANY },
+    { "get-store", handle_get_store, NULL, NULL, COMMAND_ANY },
+    { "get-store-key", handle_get_store_key, NULL, args_store_key,
+      COMMAND_ANY },
+    { "set-store-key", handle_set_store_key, NULL, args_store_key_value,
+      COMMAND_ANY },
+    { "patch-store", handle_patch_store, NULL, args_store_patch,
+      COMMAND_ANY },
+    { "query-replicated-store", handle_query_replicated_store, NULL, NULL,
+      COMMAND_ANY },
+    { "get-replicated-store-key", handle_get_replicated_store_key, NULL,
+      args_store_key, COMMAND_ANY },
+    { "set-replicated-store-key", NULL, handle_set_replicated_store_key_co,
+      args_store_key_value, COMMAND_ANY },
+    { "patch-replicated-store", NULL, handle_patch_replicated_store_co,
+      args_store_patch, COMMAND_ANY },
+    { "quit", handle_quit, NULL, NULL, COMMAND_ANY },
+    { "autoquit", handle_autoquit, NULL, NULL, COMMAND_ANY },
+    { "set-migration-start", handle_set_migration_start, NULL,
+      args_commands, COMMAND_ANY },
+    { "set-migration-switchover", handle_set_migration_switchover, NULL,
+      args_commands, COMMAND_ANY },
+    { "start-migration", handle_start_migration, NULL, NULL,
+      COMMAND_PRIMARY },
+    { "set-primary-failover", handle_set_primary_failover, NULL,
+      args_commands, COMMAND_ANY },
+    { "set-secondary-failover", handle_set_secondary_failover, NULL,
+      args_commands, COMMAND_ANY },
+    { "set-yank", handle_set_yank, NULL, args_instances, COMMAND_ANY },
+    { "yank", NULL, handle_yank_co, NULL, COMMAND_ANY },
+    { "stop", NULL, handle_stop_co, NULL, COMMAND_ANY },
+    { "cont", NULL, handle_cont_co, NULL, COMMAND_ANY },
+    { "set-peer", handle_set_peer, NULL, args_peer, COMMAND_ANY },
+    { "query-peer", handle_query_peer, NULL, NULL, COMMAND_ANY },
+    { "query-membership", handle_query_membership, NULL, NULL, COMMAND_ANY },
+    { "clear-peer", handle_clear_peer, NULL, NULL, COMMAND_ANY },
+    { "query-commands", handle_query_commands, NULL, NULL, COMMAND_ANY },
+    { "subscribe", handle_subscribe, NULL, NULL, COMMAND_ANY },
+    { "query-clients", handle_query_clients, NULL, NULL, COMMAND_ANY },
+    { NULL }
+};
+
+static int handle_query_commands(ColodClient *client,
+                                G_GNUC_UNUSED ColodQmpResult *request,
+                                GString *reply) {
+    reply_begin(reply);
+    g_string_append(reply, "{");
+    for (guint i = 0; client_commands[i].name; i++) {
+        const ClientCommandEntry *entry;
+        entry = g_hash_table_lookup(client->commands, client_commands[i].name);
+        assert(entry);
+
+        g_string_append_printf(reply, "%s\"%s\": {\"calls\": %" G_GUINT64_FORMAT ","
+                               " \"errors\": %" G_GUINT64_FORMAT ","
+                               " \"avg-us\": %" G_GINT64_FORMAT ","
+                               " \"max-us\": %" G_GINT64_FORMAT "}",
+                               (i ? ", " : ""), entry->command->name,
+                               entry->calls, entry->errors,
+                               (entry->calls ? entry->total_us / (gint64) entry->calls : 0),
+                               entry->max_us);
+    }
+    g_string_append(reply, "}");
+    reply_end(reply);
+    return 0;
+}
+
+static GHashTable *client_commands_new(void) {
+    GHashTable *table;
+
+    table = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, g_free);
+    for (guint i = 0; client_commands[i].name; i++) {
+        ClientCommandEntry *entry = g_new0(ClientCommandEntry, 1);
+        entry->command = &client_commands[i];
+        g_hash_table_insert(table, (gpointer) entry->command->name, entry);
+    }
+
+    return table;
+}
+
+static int client_command_check(ColodClient *client,
+                                const ClientCommand *command,
+                                ColodQmpResult *request, GString *reply) {
+    int ret;
+
+    for (const ClientArg *arg = command->args; arg && arg->name; arg++) {
+        JsonNode *node;
+        gchar *message;
+
+        if (!has_member(request->json_root, arg->name)) {
+            message = g_strdup_printf("Member '%s' missing", arg->name);
+            goto error;
+        }
+
+        node = get_member_node(request->json_root, arg->name);
+        if (arg->type == ARG_ARRAY && !JSON_NODE_HOLDS_ARRAY(node)) {
+            message = g_strdup_printf("Member '%s' must be an array",
+                                      arg->name);
+            goto error;
+        } else if (arg->type == ARG_OBJECT && !JSON_NODE_HOLDS_OBJECT(node)) {
+            message = g_strdup_printf("Member '%s' must be an object",
+                                      arg->name);
+            goto error;
+        } else if (arg->type == ARG_STRING
+                   && (!JSON_NODE_HOLDS_VALUE(node)
+                       || json_node_get_value_type(node) != G_TYPE_STRING)) {
+            message = g_strdup_printf("Member '%s' must be a string",
+                                      arg->name);
+            goto error;
+        }
+        continue;
+
+error:
+        ret = reply_error(reply, message);
+        g_free(message);
+        return ret;
+    }
+
+    if (command->allowed != COMMAND_ANY) {
+        ColodState state;
+        guint current;
+
+        colod_query_status(client->ctx->main_coroutine, &state);
+        current = state.primary ? COMMAND_PRIMARY : COMMAND_SECONDARY;
+        if (!(command->allowed & current)) {
+            return reply_error(reply, state.primary ?
+                               "Command not allowed on primary" :
+                               "Command not allowed on secondary");
+        }
+    }
+
+    return 0;
+}
+
+static void client_command_account(ClientCommandEntry *entry, gint64 start,
+                                   int ret) {
+    gint64 duration = g_get_monotonic_time() - start;
 
-    result = qmp_parse_result(reply, strlen(reply), NULL);
-    assert(result);
-    return result;
+    entry->calls++;
+    if (ret < 0) {
+        entry->errors++;
+    }
+    entry->total_us += duration;
+    entry->max_us = MAX(entry->max_us, duration);
 }
 
 static void client_free(ColodClient *client) {
+    assert(g_queue_is_empty(&client->passthrough));
+    if (client->active) {
+        g_queue_remove(&client->listener->active, client);
+    }
+    client->listener->client_count--;
+    if (client->subscribed) {
+        colod_del_notify_change(client->ctx->main_coroutine, client_change_cb,
+                                client);
+    }
+    g_queue_clear_full(&client->stream, g_free);
     QLIST_REMOVE(client, next);
     g_io_channel_unref(client->channel);
     g_free(client);
@@ -387,12 +1134,457 @@ static gboolean colod_client_co_wrap(G_GNUC_UNUSED GIOChannel *channel,
     return colod_client_co(data);
 }
 
+// Read and discard everything the client sends while subscribed
+static int client_stream_drain(ColodClient *client, GError **errp) {
+    gchar buf[256];
+    gsize len;
+    GIOStatus ret;
+
+    do {
+        ret = g_io_channel_read_chars(client->channel, buf, sizeof(buf), &len,
+                                      errp);
+    } while (ret == G_IO_STATUS_NORMAL);
+
+    if (ret == G_IO_STATUS_EOF) {
+        g_set_error(errp, COLOD_ERROR, COLOD_ERROR_EOF, "Channel got EOF");
+        return -1;
+    } else if (ret == G_IO_STATUS_ERROR) {
+        return -1;
+    }
+
+    return 0;
+}
+
+#define client_stream_co(...) \
+    co_wrap(_client_stream_co(__VA_ARGS__))
+static int _client_stream_co(Coroutine *coroutine, ColodClient *client,
+                             GError **errp) {
+    struct {
+        gchar *line;
+    } *co;
+    int ret;
+
+    co_frame(co, sizeof(*co));
+    co_begin(int, -1);
+
+    while (!client->quit) {
+        if (g_queue_is_empty(&client->stream) && !client->stream_dropped) {
+            // Woken by client_change_cb() or when the client sends something
+            client->busy = FALSE;
+            client->stream_source_id = g_io_add_watch(client->channel,
+                                                      G_IO_IN | G_IO_HUP,
+                                                      colod_client_co_wrap,
+                                                      client);
+            co_yield_int(G_SOURCE_REMOVE);
+            client->stream_source_id = 0;
+            client->busy = TRUE;
+            if (client->quit) {
+                break;
+            }
+
+            ret = client_stream_drain(client, errp);
+            if (ret < 0) {
+                return -1;
+            }
+            continue;
+        }
+
+        if (client->stream_dropped) {
+            CO line = g_strdup_printf("{\"event\": \"COLOD_GAP\","
+                                      " \"data\": {\"dropped\": %u}}\n",
+                                      client->stream_dropped);
+            client->stream_dropped = 0;
+        } else {
+            CO line = g_queue_pop_head(&client->stream);
+        }
+
+        co_recurse(ret = colod_channel_write_timeout_co(coroutine, client->channel,
+                                                        CO line, strlen(CO line),
+                                                        1000, errp));
+        g_free(CO line);
+        if (ret < 0) {
+            return -1;
+        }
+    }
+
+    co_end;
+
+    return 0;
+}
+
+static gboolean client_request_co(gpointer data);
+
+// Take a token from the bucket of the client, if rate limited
+static gboolean client_rate_take(ColodClient *client) {
+    guint rate = client->ctx->client_rate_limit;
+    gint64 now, refill;
+
+    if (!rate) {
+        return TRUE;
+    }
+
+    now = g_get_monotonic_time();
+    refill = (now - client->tokens_time) * rate / G_USEC_PER_SEC;
+    if (refill >= rate - client->tokens) {
+        client->tokens = rate;
+        client->tokens_time = now;
+    } else if (refill) {
+        // Keep the time not converted into a whole token
+        client->tokens += refill;
+        client->tokens_time += refill * G_USEC_PER_SEC / rate;
+    }
+
+    if (!client->tokens) {
+        return FALSE;
+    }
+    client->tokens--;
+    return TRUE;
+}
+
+static void client_schedule(ColodClientListener *listener);
+static gboolean client_schedule_throttled(gpointer data) {
+    ColodClientListener *listener = data;
+
+    listener->throttle_source_id = 0;
+    client_schedule(listener);
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * Hand the qmp channel to the next passthrough request. Clients are served
+ * in deficit round robin order, so a client sending many or large requests
+ * can't starve the others. Only one passthrough request is in flight at a
+ * time, the main coroutine gets the channel in between.
+ */
+static void client_schedule(ColodClientListener *listener) {
+    ColodClient *client;
+    ClientRequest *req;
+    guint throttled = 0;
+
+    if (listener->passthrough_busy) {
+        return;
+    }
+
+    while ((client = g_queue_peek_head(&listener->active))) {
+        if (g_queue_is_empty(&client->passthrough)) {
+            g_queue_pop_head(&listener->active);
+            client->active = FALSE;
+            client->deficit = 0;
+            throttled = 0;
+            continue;
+        }
+
+        if (throttled == g_queue_get_length(&listener->active)) {
+            // Every active client is over its rate limit
+            if (!listener->throttle_source_id) {
+                guint interval = MAX(1, 1000 / client->ctx->client_rate_limit);
+                listener->throttle_source_id =
+                        g_timeout_add(interval, client_schedule_throttled,
+                                      listener);
+            }
+            return;
+        }
+
+        req = g_queue_peek_head(&client->passthrough);
+        if (req->request->len > client->deficit) {
+            client->deficit += CLIENT_DRR_QUANTUM;
+            throttled = 0;
+            g_queue_push_tail(&listener->active,
+                              g_queue_pop_head(&listener->active));
+            continue;
+        }
+
+        if (!client_rate_take(client)) {
+            client->throttled++;
+            throttled++;
+            g_queue_push_tail(&listener->active,
+                              g_queue_pop_head(&listener->active));
+            continue;
+        }
+
+        client->deficit -= req->request->len;
+        g_queue_pop_head(&client->passthrough);
+        client->passthrough_requests++;
+        listener->passthrough_busy = TRUE;
+        req->granted = TRUE;
+        g_idle_add(client_request_co, req);
+        return;
+    }
+}
+
+#define client_passthrough_wait_co(...) \
+    co_wrap(_client_passthrough_wait_co(__VA_ARGS__))
+static int _client_passthrough_wait_co(Coroutine *coroutine,
+                                       ClientRequest *req) {
+    ColodClient *client = req->client;
+
+    co_begin(int, -1);
+
+    g_queue_push_tail(&client->passthrough, req);
+    if (!client->active) {
+        client->active = TRUE;
+        g_queue_push_tail(&client->listener->active, client);
+    }
+    client_schedule(client->listener);
+
+    // Woken by client_schedule(), even if it granted the request right away
+    do {
+        co_yield_int(G_SOURCE_REMOVE);
+    } while (!req->granted);
+
+    co_end;
+
+    return 0;
+}
+
+static void client_passthrough_done(ColodClientListener *listener) {
+    assert(listener->passthrough_busy);
+    listener->passthrough_busy = FALSE;
+    client_schedule(listener);
+}
+
+#define client_dispatch_co(...) \
+    co_wrap(_client_dispatch_co(__VA_ARGS__))
+static int _client_dispatch_co(Coroutine *coroutine, ClientRequest *req) {
+    ColodClient *client = req->client;
+    ColodQmpResult *request = req->request;
+    GString *reply = req->reply;
+    struct {
+        ColodQmpResult *result;
+        ClientCommandEntry *entry;
+        gint64 start;
+    } *co;
+    int ret;
+    GError *local_errp = NULL;
+
+    co_frame(co, sizeof(*co));
+    co_begin(int, -1);
+
+    if (request->json_root && has_member(request->json_root, "exec-colod")) {
+        const gchar *command = get_member_str(request->json_root,
+                                              "exec-colod");
+        if (!command) {
+            ret = reply_error(reply, "Could not get exec-colod member");
+        } else if (!(CO entry = g_hash_table_lookup(client->commands,
+                                                    command))) {
+            ret = reply_error(reply, "Unknown command");
+        } else if ((ret = client_command_check(client, CO entry->command,
+                                               request, reply)) == 0) {
+            CO start = g_get_monotonic_time();
+            if (CO entry->command->handler_co) {
+                co_recurse(ret = co_wrap(CO entry->command->handler_co(
+                                         coroutine, client, request, reply)));
+            } else {
+                ret = CO entry->command->handler(client, request, reply);
+            }
+            client_command_account(CO entry, CO start, ret);
+        }
+
+        // qemu echoes the id of passthrough commands itself
+        reply_add_id(reply, request);
+    } else {
+        co_recurse(client_passthrough_wait_co(coroutine, req));
+        co_recurse(CO result = colod_relay_co(coroutine,
+                                              client->ctx->main_coroutine,
+                                              &local_errp, request->line));
+        client_passthrough_done(client->listener);
+        if (!CO result) {
+            ret = reply_error(reply, local_errp->message);
+            g_error_free(local_errp);
+        } else if (!reply_id_matches(request, CO result)) {
+            ret = reply_error(reply, "qmp reply id does not match");
+            qmp_result_free(CO result);
+        } else {
+            ret = reply_result(reply, CO result);
+            qmp_result_free(CO result);
+        }
+    }
+
+    co_end;
+
+    return ret;
+}
+
+static ClientRequest *client_request_get(ColodClient *client,
+                                         ColodQmpResult *request);
+static void client_request_put(ClientRequest *req);
+
+static void client_request_done(ClientRequest *req) {
+    ColodClient *client = req->client;
+
+    assert(client->inflight);
+    client->inflight--;
+    if (client->reader_waiting) {
+        client->reader_waiting = FALSE;
+        g_idle_add(colod_client_co, client);
+    }
+
+    if (client->quit && !client->inflight && !client->busy) {
+        colod_shutdown_channel(client->channel);
+    }
+
+    client_request_put(req);
+}
+
+static gboolean _client_request_co(Coroutine *coroutine);
+static gboolean client_request_co(gpointer data) {
+    ClientRequest *req = data;
+    Coroutine *coroutine = &req->coroutine;
+    gboolean ret;
+
+    co_enter(coroutine, ret = _client_request_co(coroutine));
+    if (coroutine->yield) {
+        return GPOINTER_TO_INT(coroutine->yield_value);
+    }
+
+    colod_assert_remove_one_source(coroutine);
+    client_request_done(req);
+    return ret;
+}
+static gboolean client_request_co_wrap(G_GNUC_UNUSED GIOChannel *channel,
+                                       G_GNUC_UNUSED GIOCondition revents,
+                                       gpointer data) {
+    return client_request_co(data);
+}
+
+static gboolean _client_request_co(Coroutine *coroutine) {
+    ClientRequest *req = (ClientRequest *) coroutine;
+    ColodClient *client = req->client;
+    int ret;
+    GError *local_errp = NULL;
+
+    co_begin(gboolean, G_SOURCE_CONTINUE);
+
+    co_recurse(ret = client_dispatch_co(coroutine, req));
+    if (ret < 0) {
+        client->errors++;
+    }
+
+    colod_trace("client: %s", req->reply->str);
+    colod_lock_co(client->write_lock);
+    co_recurse(ret = colod_channel_write_timeout_co(coroutine, client->channel,
+                                                    req->reply->str,
+                                                    req->reply->len, 1000,
+                                                    &local_errp));
+    colod_unlock_co(client->write_lock);
+    if (ret < 0) {
+        if (!g_error_matches(local_errp, COLOD_ERROR, COLOD_ERROR_EOF)) {
+            colod_syslog(LOG_WARNING, "Client connection broke: %s",
+                         local_errp->message);
+        }
+        g_error_free(local_errp);
+        // Let the reader notice
+        colod_shutdown_channel(client->channel);
+    } else {
+        client->bytes_out += req->reply->len;
+    }
+
+    co_end;
+
+    return G_SOURCE_REMOVE;
+}
+
+static ClientRequest *client_request_get(ColodClient *client,
+                                         ColodQmpResult *request) {
+    ClientRequest *req;
+    Coroutine *coroutine;
+
+    req = g_queue_pop_head(&client->listener->request_pool);
+    if (req) {
+        memset(&req->coroutine, 0, sizeof(req->coroutine));
+    } else {
+        req = g_new0(ClientRequest, 1);
+        req->reply = g_string_sized_new(1024);
+    }
+
+    coroutine = &req->coroutine;
+    coroutine->cb.plain = client_request_co;
+    coroutine->cb.iofunc = client_request_co_wrap;
+    req->client = client;
+    req->request = request;
+    req->granted = FALSE;
+    return req;
+}
+
+static void client_request_free(gpointer data) {
+    ClientRequest *req = data;
+
+    g_string_free(req->reply, TRUE);
+    g_free(req);
+}
+
+static void client_request_put(ClientRequest *req) {
+    GQueue *pool = &req->client->listener->request_pool;
+
+    qmp_result_free(req->request);
+    req->request = NULL;
+    req->client = NULL;
+
+    if (g_queue_get_length(pool) >= CLIENT_REQUEST_POOL_MAX) {
+        client_request_free(req);
+    } else {
+        g_queue_push_head(pool, req);
+    }
+}
+
+// Wait until at most max requests are inflight
+#define client_wait_co(...) \
+    co_wrap(_client_wait_co(__VA_ARGS__))
+static int _client_wait_co(Coroutine *coroutine, ColodClient *client,
+                           guint max) {
+    co_begin(int, -1);
+
+    while (client->inflight > max) {
+        // Woken by client_request_done()
+        client->reader_waiting = TRUE;
+        co_yield_int(G_SOURCE_REMOVE);
+    }
+
+    co_end;
+
+    return 0;
+}
+
+/*
+ * Only exec-colod requests are parsed. Everything else is relayed to qemu
+ * as is, after checking that it is a single json object so qemu is not
+ * left waiting for the rest of it. Malformed requests are parsed too, to
+ * report the error.
+ */
+static ColodQmpResult *client_parse_request(gchar *line, gsize len,
+                                            GError **errp) {
+    ColodQmpResult *request;
+
+    if (json_scan_member(line, len, "exec-colod", NULL, NULL) != 0) {
+        return qmp_parse_result(line, len, errp);
+    }
+
+    request = g_new0(ColodQmpResult, 1);
+    request->line = line;
+    request->len = len;
+    return request;
+}
+
+// Requests without an id are answered in order, subscribe switches the
+// connection to streaming once its reply is written
+static gboolean client_request_serial(ColodQmpResult *request) {
+    if (!request->json_root) {
+        return json_scan_member(request->line, request->len, "id",
+                                NULL, NULL) != 1;
+    }
+
+    return !has_member(request->json_root, "id")
+           || !g_strcmp0(get_member_str(request->json_root, "exec-colod"),
+                         "subscribe");
+}
+
 static gboolean _colod_client_co(Coroutine *coroutine) {
     ColodClient *client = (ColodClient *) coroutine;
     struct {
         gchar *line;
         gsize len;
         ColodQmpResult *request, *result;
+        gboolean serial;
     } *co;
     int ret;
     GError *local_errp = NULL;
@@ -415,87 +1607,37 @@ static gboolean _colod_client_co(Coroutine *coroutine) {
 
         client->busy = TRUE;
 
-        CO request = qmp_parse_result(CO line, CO len, &local_errp);
+        CO request = client_parse_request(CO line, CO len, &local_errp);
         if (!CO request) {
             goto error_client;
         }
 
         colod_trace("client: %s", CO request->line);
-        if (has_member(CO request->json_root, "exec-colod")) {
-            const gchar *command = get_member_str(CO request->json_root,
-                                                  "exec-colod");
-            if (!command) {
-                CO result = create_error_reply("Could not get exec-colod "
-                                               "member");
-            } else if (!strcmp(command, "query-status")) {
-                co_recurse(CO result = handle_query_status_co(coroutine, client->ctx));
-            } else if (!strcmp(command, "query-store")) {
-                CO result = handle_query_store(client);
-            } else if (!strcmp(command, "set-store")) {
-                CO result = handle_set_store(CO request, client);
-            } else if (!strcmp(command, "quit")) {
-                CO result = handle_quit(client->ctx);
-            } else if (!strcmp(command, "autoquit")) {
-                CO result = handle_autoquit(client->ctx);
-            } else if (!strcmp(command, "set-migration-start")) {
-                CO result = handle_set_migration_start(CO request,
-                                                       client->ctx);
-            } else if (!strcmp(command, "set-migration-switchover")) {
-                CO result = handle_set_migration_switchover(CO request,
-                                                            client->ctx);
-            } else if (!strcmp(command, "start-migration")) {
-                CO result = handle_start_migration(client->ctx);
-            } else if (!strcmp(command, "set-primary-failover")) {
-                CO result = handle_set_primary_failover(CO request,
-                                                        client->ctx);
-            } else if (!strcmp(command, "set-secondary-failover")) {
-                CO result = handle_set_secondary_failover(CO request,
-                                                          client->ctx);
-            } else if (!strcmp(command, "set-yank")) {
-                CO result = handle_set_yank(CO request, client->ctx);
-            } else if (!strcmp(command, "yank")) {
-                co_recurse(CO result = handle_yank_co(coroutine, client->ctx));
-            } else if (!strcmp(command, "stop")) {
-                co_recurse(CO result = handle_stop_co(coroutine, client));
-            } else if (!strcmp(command, "cont")) {
-                co_recurse(CO result = handle_cont_co(coroutine, client));
-            } else if (!strcmp(command, "set-peer")) {
-                CO result = handle_set_peer(CO request, client->ctx);
-            } else if (!strcmp(command, "query-peer")) {
-                CO result = handle_query_peer(client->ctx);
-            } else if (!strcmp(command, "clear-peer")) {
-                colod_clear_peer(client->ctx->main_coroutine);
-                CO result = create_reply("{}");
-            } else {
-                CO result = create_error_reply("Unknown command");
-            }
-        } else {
-            co_recurse(CO result = colod_execute_nocheck_co(coroutine,
-                                                            client->ctx->main_coroutine,
-                                                            &local_errp,
-                                                            CO request->line));
-            if (!CO result) {
-                CO result = create_error_reply(local_errp->message);
-                g_error_free(local_errp);
-                local_errp = NULL;
+        client->requests++;
+        client->bytes_in += CO len;
+
+        CO serial = client_request_serial(CO request);
+        co_recurse(client_wait_co(coroutine, client,
+                                  CO serial ? 0 :
+                                  MAX(1, client->ctx->client_max_inflight) - 1));
+
+        client->inflight++;
+        g_idle_add(client_request_co, client_request_get(client, CO request));
+
+        if (CO serial) {
+            co_recurse(client_wait_co(coroutine, client, 0));
+
+            if (client->subscribed) {
+                co_recurse(ret = client_stream_co(coroutine, client,
+                                                  &local_errp));
+                if (ret < 0) {
+                    goto error_client;
+                }
             }
         }
-
-        qmp_result_free(CO request);
-
-        colod_trace("client: %s", CO result->line);
-        co_recurse(ret = colod_channel_write_timeout_co(coroutine, client->channel,
-                                                        CO result->line,
-                                                        CO result->len, 1000,
-                                                        &local_errp));
-        if (ret < 0) {
-            qmp_result_free(CO result);
-            goto error_client;
-        }
-
-        qmp_result_free(CO result);
     }
 
+    co_recurse(client_wait_co(coroutine, client, 0));
     return G_SOURCE_REMOVE;
 
 error_client:
@@ -505,6 +1647,8 @@ error_client:
         g_error_free(local_errp);
     }
 
+    co_recurse(client_wait_co(coroutine, client, 0));
+
     if (client->stopped_qemu) {
         co_recurse(CO result = colod_execute_co(coroutine, client->ctx->main_coroutine,
                                                 &local_errp,
@@ -537,9 +1681,16 @@ static int client_new(ColodClientListener *listener, int fd, GError **errp) {
     coroutine->cb.plain = colod_client_co;
     coroutine->cb.iofunc = colod_client_co_wrap;
     client->ctx = listener->ctx;
+    client->listener = listener;
+    client->id = listener->next_id++;
+    client->connected = g_get_monotonic_time();
+    client->tokens = listener->ctx->client_rate_limit;
+    client->tokens_time = client->connected;
     client->channel = channel;
-    client->store = &listener->store;
+    client->store = listener->store;
+    client->commands = listener->commands;
     QLIST_INSERT_HEAD(&listener->head, client, next);
+    listener->client_count++;
 
     g_io_add_watch(channel, G_IO_IN | G_IO_HUP, colod_client_co_wrap, client);
     return 0;
@@ -550,6 +1701,7 @@ static gboolean client_listener_new_client(G_GNUC_UNUSED int fd,
                                            gpointer data) {
     ColodClientListener *listener = (ColodClientListener *) data;
     GError *errp = NULL;
+    guint max_clients;
 
     while (TRUE) {
         int clientfd = accept(listener->socket, NULL, NULL);
@@ -565,6 +1717,18 @@ static gboolean client_listener_new_client(G_GNUC_UNUSED int fd,
             break;
         }
 
+        max_clients = listener->ctx->client_max;
+        if (max_clients && listener->client_count >= max_clients) {
+            static const gchar busy[] = "{\"error\": \"Too many clients\"}\n";
+
+            listener->rejected++;
+            colod_syslog(LOG_WARNING, "Rejecting client, already %u clients",
+                         listener->client_count);
+            send(clientfd, busy, sizeof(busy) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+            close(clientfd);
+            continue;
+        }
+
         if (client_new(listener, clientfd, &errp) < 0) {
             colod_syslog(LOG_WARNING, "Failed to create new client: %s",
                          errp->message);
@@ -587,7 +1751,7 @@ void client_listener_free(ColodClientListener *listener) {
 
     QLIST_FOREACH(entry, &listener->head, next) {
         entry->quit = TRUE;
-        if (!entry->busy) {
+        if (!entry->busy && !entry->inflight) {
             colod_shutdown_channel(entry->channel);
         }
     }
@@ -596,15 +1760,43 @@ void client_listener_free(ColodClientListener *listener) {
         g_main_context_iteration(g_main_context_default(), TRUE);
     }
 
+    assert(g_queue_is_empty(&listener->active));
+    if (listener->throttle_source_id) {
+        g_source_remove(listener->throttle_source_id);
+    }
+    g_queue_clear_full(&listener->request_pool, client_request_free);
+    g_hash_table_unref(listener->commands);
+    store_free(listener->store);
+    if (listener->replica) {
+        store_replica_free(listener->replica);
+    }
     g_free(listener);
 }
 
 ColodClientListener *client_listener_new(int socket, const ColodContext *ctx) {
     ColodClientListener *listener;
+    g_autofree gchar *path = NULL;
+    GError *local_errp = NULL;
 
     listener = g_new0(ColodClientListener, 1);
     listener->socket = socket;
     listener->ctx = ctx;
+    listener->commands = client_commands_new();
+
+    if (ctx->base_dir && *ctx->base_dir) {
+        path = g_build_filename(ctx->base_dir, "store.json", NULL);
+    }
+    listener->store = store_new(path);
+    if (store_load(listener->store, &local_errp) < 0) {
+        colod_syslog(LOG_WARNING, "Starting with an empty store: %s",
+                     local_errp->message);
+        g_error_free(local_errp);
+    }
+
+    if (ctx->store_replicate) {
+        listener->replica = store_replica_new(ctx->cpg);
+    }
+
     listener->listen_source_id = g_unix_fd_add(socket, G_IO_IN,
                                                client_listener_new_client,
                                                listener);
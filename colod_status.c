@@ -0,0 +1,114 @@
+/*
+ * Read the status page of a running colod
+ *
+ * Copyright (c) Lukas Straub <lukasstraub2@web.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+
+#include <glib-2.0/glib.h>
+
+#include "status_page.h"
+#include "util.h"
+#include "json_util.h"
+
+static void print_flags(GString *out, const gchar *prefix, uint32_t flags) {
+    g_string_append_printf(out, "\"%sprimary\": %s, \"%sreplication\": %s,"
+                           " \"%sfailed\": %s, \"%speer-failover\": %s,"
+                           " \"%speer-failed\": %s, \"%syellow\": %s",
+                           prefix, bool_to_json(flags & STATUS_PAGE_PRIMARY),
+                           prefix,
+                           bool_to_json(flags & STATUS_PAGE_REPLICATION),
+                           prefix, bool_to_json(flags & STATUS_PAGE_FAILED),
+                           prefix,
+                           bool_to_json(flags & STATUS_PAGE_PEER_FAILOVER),
+                           prefix,
+                           bool_to_json(flags & STATUS_PAGE_PEER_FAILED),
+                           prefix, bool_to_json(flags & STATUS_PAGE_YELLOW));
+}
+
+static gchar *status_to_json(const StatusPageData *data) {
+    GString *out = g_string_new(NULL);
+
+    g_string_append_printf(out, "{\"updated\": %" PRId64 ", \"pid\": %" PRId32
+                           ", \"quit\": %s, \"state\": ", data->updated,
+                           data->pid,
+                           bool_to_json(data->flags & STATUS_PAGE_QUIT));
+    json_append_string(out, data->state_name);
+    g_string_append(out, ", ");
+    print_flags(out, "", data->flags);
+    g_string_append_printf(out, ", \"peer-yellow\": %s",
+                           bool_to_json(data->flags & STATUS_PAGE_PEER_YELLOW));
+
+    if (data->peer_valid) {
+        g_string_append_printf(out, ", \"peer-version\": %" PRIu32
+                               ", \"peer-state\": ", data->peer_version);
+        json_append_string(out, data->peer_state_name);
+        g_string_append(out, ", ");
+        print_flags(out, "peer-state-", data->peer_flags);
+    }
+
+    g_string_append_printf(out, ", \"yellow-score\": %" PRIu32
+                           ", \"yellow-penalty\": %" PRIu32
+                           ", \"yellow-suppressed\": %s"
+                           ", \"transitions\": %" PRIu64
+                           ", \"failovers\": %" PRIu64
+                           ", \"heartbeat-missed\": %" PRIu64
+                           ", \"heartbeat-samples\": %" PRIu64
+                           ", \"heartbeat-srtt\": %" PRId64,
+                           data->yellow_score, data->yellow_penalty,
+                           bool_to_json(data->yellow_suppressed),
+                           data->transitions, data->failovers,
+                           data->heartbeat_missed, data->heartbeat_samples,
+                           data->heartbeat_srtt);
+
+    if (data->failover_start) {
+        g_string_append_printf(out, ", \"failover-start\": %" PRId64
+                               ", \"failover-end\": %" PRId64
+                               ", \"failover-duration\": %" PRId64
+                               ", \"failover-result\": ",
+                               data->failover_start, data->failover_end,
+                               data->failover_duration);
+        json_append_string(out, data->failover_result);
+    }
+
+    g_string_append(out, "}\n");
+    return g_string_free(out, FALSE);
+}
+
+int main(int argc, char **argv) {
+    GError *errp = NULL;
+    const StatusPage *page;
+    StatusPageData data;
+    gchar *json;
+
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <base directory>/status.page\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    page = status_page_map(argv[1], &errp);
+    if (!page) {
+        fprintf(stderr, "%s\n", errp->message);
+        g_error_free(errp);
+        return EXIT_FAILURE;
+    }
+
+    if (status_page_read(page, &data) < 0) {
+        fprintf(stderr, "Failed to read a consistent status from %s\n",
+                argv[1]);
+        status_page_unmap(page);
+        return EXIT_FAILURE;
+    }
+    status_page_unmap(page);
+
+    json = status_to_json(&data);
+    fputs(json, stdout);
+    g_free(json);
+    return EXIT_SUCCESS;
+}
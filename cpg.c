@@ -7,6 +7,12 @@
  * See the COPYING file in the top-level directory.
  */
 
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
 #include <glib-2.0/glib.h>
 #include <glib-2.0/glib-unix.h>
 
@@ -17,15 +23,76 @@
 #include "daemon.h"
 #include "main_coroutine.h"
 
+#define CPG_BATCH_MAX 16
+
+/*
+ * Every cpg message consists of one or more records. A record is a 32 bit
+ * header in network byte order with the message number in the lower and the
+ * payload length in the upper 16 bits, followed by the payload padded to 4
+ * bytes.
+ */
+#define CPG_RECORD_MESSAGE(header) ((header) & 0xffff)
+#define CPG_RECORD_LEN(header) ((header) >> 16)
+#define CPG_RECORD_PAD(len) (((len) + 3) & ~3)
+
 struct Cpg {
     cpg_handle_t handle;
     guint source_id;
     ColodContext *ctx;
     ColodCallbackHead callbacks;
+    ColodCallbackHead payload_callbacks;
     guint retransmit_source_id;
     gboolean retransmit[MESSAGE_MAX];
+
+    /*
+     * With --cpg_batch, messages sent during one main loop iteration are
+     * collected here and multicast as a single cpg message with one record
+     * per message. Otherwise every record is sent on its own, a record
+     * without payload is then the same on the wire as the messages of
+     * daemons that don't know about records.
+     */
+    gboolean batching;
+    uint32_t batch[CPG_BATCH_MAX];
+    guint8 *batch_payload[CPG_BATCH_MAX];
+    guint batch_len;
+    guint flush_source_id;
+
+    CpgMembership membership;
+    gboolean left_node_down;
+
+    /*
+     * With --cpg_thread, cpg_dispatch runs on its own thread. Its
+     * callbacks only copy the events into the queue and wake the main
+     * loop through the eventfd, all processing happens on the main loop.
+     */
+    gboolean threaded;
+    GThread *thread;
+    int cpg_fd, wake_fd, stop_fd;
+    guint wake_source_id;
+    ColodSpscQueue queue;
+    guint budget;
+    // Set before the dispatch thread is stopped
+    gint stopping;
 };
 
+typedef enum CpgEventType {
+    CPG_EVENT_DELIVER,
+    CPG_EVENT_CONFCHG,
+    CPG_EVENT_TOTEM_CONFCHG,
+    CPG_EVENT_ERROR
+} CpgEventType;
+
+typedef struct CpgEvent {
+    CpgEventType type;
+    uint32_t nodeid;
+    void *msg;
+    size_t msg_len;
+    struct cpg_address *member_list, *left_list, *joined_list;
+    size_t member_list_entries, left_list_entries, joined_list_entries;
+    struct cpg_ring_id ring_id;
+    cs_error_t err;
+} CpgEvent;
+
 void colod_cpg_add_notify(Cpg *this, CpgCallback _func, gpointer user_data) {
     ColodCallbackFunc func = (ColodCallbackFunc) _func;
     colod_callback_add(&this->callbacks, func, user_data);
@@ -36,6 +103,28 @@ void colod_cpg_del_notify(Cpg *this, CpgCallback _func, gpointer user_data) {
     colod_callback_del(&this->callbacks, func, user_data);
 }
 
+void colod_cpg_add_payload_notify(Cpg *this, CpgPayloadCallback _func,
+                                  gpointer user_data) {
+    ColodCallbackFunc func = (ColodCallbackFunc) _func;
+    colod_callback_add(&this->payload_callbacks, func, user_data);
+}
+
+void colod_cpg_del_payload_notify(Cpg *this, CpgPayloadCallback _func,
+                                  gpointer user_data) {
+    ColodCallbackFunc func = (ColodCallbackFunc) _func;
+    colod_callback_del(&this->payload_callbacks, func, user_data);
+}
+
+static void notify_payload(Cpg *this, ColodMessage message,
+                           gboolean message_from_this_node,
+                           const void *payload, size_t len) {
+    ColodCallback *entry, *next_entry;
+    QLIST_FOREACH_SAFE(entry, &this->payload_callbacks, next, next_entry) {
+        CpgPayloadCallback func = (CpgPayloadCallback) entry->func;
+        func(entry->user_data, message, message_from_this_node, payload, len);
+    }
+}
+
 static void notify(Cpg *this, ColodMessage message,
                    gboolean message_from_this_node,
                    gboolean peer_left_group) {
@@ -70,6 +159,222 @@ static gboolean colod_cpg_retransmit_cb(gpointer data) {
     return G_SOURCE_REMOVE;
 }
 
+static void cpg_process_deliver(Cpg *cpg, uint32_t nodeid, const void *msg,
+                                size_t msg_len) {
+    uint32_t header;
+    uint32_t myid = cpg->membership.local_nodeid;
+    size_t off = 0;
+
+    if (!msg_len || msg_len % sizeof(header)) {
+        log_error_fmt("cpg: Got message of invalid length %zu", msg_len);
+        return;
+    }
+
+    while (off < msg_len) {
+        guint message, len;
+        const guint8 *payload;
+
+        memcpy(&header, (guint8 *) msg + off, sizeof(header));
+        header = ntohl(header);
+        off += sizeof(header);
+
+        message = CPG_RECORD_MESSAGE(header);
+        len = CPG_RECORD_LEN(header);
+        payload = (guint8 *) msg + off;
+        if (CPG_RECORD_PAD(len) > msg_len - off) {
+            log_error_fmt("cpg: Got truncated record of length %u", len);
+            return;
+        }
+        off += CPG_RECORD_PAD(len);
+
+        if (message >= MESSAGE_MAX) {
+            log_error_fmt("cpg: Got invalid message %u", message);
+            continue;
+        }
+
+        if (len) {
+            notify_payload(cpg, message, nodeid == myid, payload, len);
+            continue;
+        }
+
+        if (nodeid == myid) {
+            cpg->retransmit[message] = FALSE;
+        }
+
+        notify(cpg, message, nodeid == myid, FALSE);
+    }
+}
+
+const CpgMembership *colod_cpg_membership(Cpg *cpg) {
+    return &cpg->membership;
+}
+
+gboolean colod_cpg_left_node_down(Cpg *cpg) {
+    return cpg->left_node_down;
+}
+
+static void membership_history_add(CpgMembership *membership, gint64 now,
+                                   gboolean joined,
+                                   const struct cpg_address *address) {
+    CpgHistoryEntry *entry = &membership->history[membership->history_pos];
+
+    entry->time = now;
+    entry->joined = joined;
+    entry->nodeid = address->nodeid;
+    entry->pid = address->pid;
+    entry->reason = address->reason;
+
+    membership->history_pos = (membership->history_pos + 1) % CPG_HISTORY_MAX;
+    if (membership->history_count < CPG_HISTORY_MAX) {
+        membership->history_count++;
+    }
+}
+
+static gint64 membership_join_time(CpgMembership *membership,
+                                   const struct cpg_address *address,
+                                   gint64 now) {
+    for (guint i = 0; i < membership->member_count; i++) {
+        CpgMember *member = &membership->members[i];
+        if (member->nodeid == address->nodeid && member->pid == address->pid) {
+            return member->joined;
+        }
+    }
+
+    return now;
+}
+
+static void membership_update(CpgMembership *membership,
+                              const struct cpg_address *member_list,
+                              size_t member_list_entries,
+                              const struct cpg_address *left_list,
+                              size_t left_list_entries,
+                              const struct cpg_address *joined_list,
+                              size_t joined_list_entries) {
+    CpgMember members[CPG_MEMBERS_MAX];
+    guint count = MIN(member_list_entries, CPG_MEMBERS_MAX);
+    gint64 now = g_get_real_time();
+
+    for (guint i = 0; i < count; i++) {
+        members[i].nodeid = member_list[i].nodeid;
+        members[i].pid = member_list[i].pid;
+        members[i].joined = membership_join_time(membership, &member_list[i],
+                                                 now);
+    }
+    memcpy(membership->members, members, count * sizeof(members[0]));
+    membership->member_count = count;
+
+    for (size_t i = 0; i < left_list_entries; i++) {
+        membership_history_add(membership, now, FALSE, &left_list[i]);
+    }
+    for (size_t i = 0; i < joined_list_entries; i++) {
+        membership_history_add(membership, now, TRUE, &joined_list[i]);
+    }
+}
+
+static void cpg_process_confchg(Cpg *cpg,
+                                const struct cpg_address *member_list,
+                                size_t member_list_entries,
+                                const struct cpg_address *left_list,
+                                size_t left_list_entries,
+                                const struct cpg_address *joined_list,
+                                size_t joined_list_entries) {
+    membership_update(&cpg->membership, member_list, member_list_entries,
+                      left_list, left_list_entries,
+                      joined_list, joined_list_entries);
+
+    if (left_list_entries) {
+        cpg->left_node_down = FALSE;
+        for (size_t i = 0; i < left_list_entries; i++) {
+            if (left_list[i].reason == CPG_REASON_NODEDOWN) {
+                cpg->left_node_down = TRUE;
+            }
+        }
+
+        colod_cpg_retransmit(cpg);
+        notify(cpg, MESSAGE_NONE, FALSE, TRUE);
+    }
+}
+
+static void cpg_process_totem_confchg(Cpg *cpg, struct cpg_ring_id ring_id) {
+    cpg->membership.ring_nodeid = ring_id.nodeid;
+    cpg->membership.ring_seq = ring_id.seq;
+}
+
+/*
+ * Without corosync we can't coordinate with the peer anymore, so give up
+ * instead of carrying on alone.
+ */
+static void cpg_dispatch_failed(Cpg *cpg, cs_error_t err) {
+    log_error_fmt("cpg: Failed to dispatch: %s", cs_strerror(err));
+
+    if (cpg->ctx->main_coroutine) {
+        colod_cpg_failed(cpg->ctx->main_coroutine);
+    }
+}
+
+static void cpg_event_free(CpgEvent *event) {
+    g_free(event->msg);
+    g_free(event->member_list);
+    g_free(event->left_list);
+    g_free(event->joined_list);
+    g_free(event);
+}
+
+static void cpg_event_process(Cpg *cpg, CpgEvent *event) {
+    switch (event->type) {
+        case CPG_EVENT_DELIVER:
+            cpg_process_deliver(cpg, event->nodeid, event->msg,
+                                event->msg_len);
+        break;
+
+        case CPG_EVENT_CONFCHG:
+            cpg_process_confchg(cpg, event->member_list,
+                                event->member_list_entries,
+                                event->left_list, event->left_list_entries,
+                                event->joined_list,
+                                event->joined_list_entries);
+        break;
+
+        case CPG_EVENT_TOTEM_CONFCHG:
+            cpg_process_totem_confchg(cpg, event->ring_id);
+        break;
+
+        case CPG_EVENT_ERROR:
+            cpg_dispatch_failed(cpg, event->err);
+        break;
+    }
+}
+
+static void cpg_wake(Cpg *cpg) {
+    uint64_t one = 1;
+
+    if (write(cpg->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+        log_error_fmt("cpg: Failed to wake main loop: %s", g_strerror(errno));
+    }
+}
+
+// Called on the dispatch thread
+static void cpg_event_push(Cpg *cpg, CpgEvent *event) {
+    while (!colod_spsc_push(&cpg->queue, event)) {
+        // The main loop may be waiting for us to stop
+        if (g_atomic_int_get(&cpg->stopping)) {
+            cpg_event_free(event);
+            return;
+        }
+
+        // Main loop is behind, apply backpressure to corosync
+        g_usleep(1000);
+    }
+
+    cpg_wake(cpg);
+}
+
+static void *cpg_memdup(const void *data, size_t len) {
+    void *ret = g_malloc(len ? len : 1);
+    memcpy(ret, data, len);
+    return ret;
+}
+
 static void colod_cpg_deliver(cpg_handle_t handle,
                               G_GNUC_UNUSED const struct cpg_name *group_name,
                               uint32_t nodeid,
@@ -77,61 +382,237 @@ static void colod_cpg_deliver(cpg_handle_t handle,
                               void *msg,
                               size_t msg_len) {
     Cpg *cpg;
-    uint32_t conv;
-    uint32_t myid;
+    CpgEvent *event;
 
     cpg_context_get(handle, (void**) &cpg);
-    cpg_local_get(handle, &myid);
 
-    if (msg_len != sizeof(conv)) {
-        log_error_fmt("cpg: Got message of invalid length %zu", msg_len);
+    if (!cpg->threaded) {
+        cpg_process_deliver(cpg, nodeid, msg, msg_len);
         return;
     }
-    conv = ntohl((*(uint32_t*)msg));
-
-    if (nodeid == myid) {
-        cpg->retransmit[conv] = FALSE;
-    }
 
-    notify(cpg, conv, nodeid == myid, FALSE);
+    event = g_new0(CpgEvent, 1);
+    event->type = CPG_EVENT_DELIVER;
+    event->nodeid = nodeid;
+    event->msg = cpg_memdup(msg, msg_len);
+    event->msg_len = msg_len;
+    cpg_event_push(cpg, event);
 }
 
 static void colod_cpg_confchg(cpg_handle_t handle,
     G_GNUC_UNUSED const struct cpg_name *group_name,
-    G_GNUC_UNUSED const struct cpg_address *member_list,
-    G_GNUC_UNUSED size_t member_list_entries,
-    G_GNUC_UNUSED const struct cpg_address *left_list,
+    const struct cpg_address *member_list,
+    size_t member_list_entries,
+    const struct cpg_address *left_list,
     size_t left_list_entries,
-    G_GNUC_UNUSED const struct cpg_address *joined_list,
-    G_GNUC_UNUSED size_t joined_list_entries) {
+    const struct cpg_address *joined_list,
+    size_t joined_list_entries) {
     Cpg *cpg;
+    CpgEvent *event;
 
     cpg_context_get(handle, (void**) &cpg);
 
-    if (left_list_entries) {
-        colod_cpg_retransmit(cpg);
-        notify(cpg, MESSAGE_NONE, FALSE, TRUE);
+    if (!cpg->threaded) {
+        cpg_process_confchg(cpg, member_list, member_list_entries,
+                            left_list, left_list_entries,
+                            joined_list, joined_list_entries);
+        return;
     }
+
+    event = g_new0(CpgEvent, 1);
+    event->type = CPG_EVENT_CONFCHG;
+    event->member_list = cpg_memdup(member_list,
+                                    member_list_entries * sizeof(*member_list));
+    event->member_list_entries = member_list_entries;
+    event->left_list = cpg_memdup(left_list,
+                                  left_list_entries * sizeof(*left_list));
+    event->left_list_entries = left_list_entries;
+    event->joined_list = cpg_memdup(joined_list,
+                                    joined_list_entries * sizeof(*joined_list));
+    event->joined_list_entries = joined_list_entries;
+    cpg_event_push(cpg, event);
 }
 
-static void colod_cpg_totem_confchg(G_GNUC_UNUSED cpg_handle_t handle,
-                                    G_GNUC_UNUSED struct cpg_ring_id ring_id,
+static void colod_cpg_totem_confchg(cpg_handle_t handle,
+                                    struct cpg_ring_id ring_id,
                                     G_GNUC_UNUSED uint32_t member_list_entries,
                                     G_GNUC_UNUSED const uint32_t *member_list) {
+    Cpg *cpg;
+    CpgEvent *event;
+
+    cpg_context_get(handle, (void**) &cpg);
 
+    if (!cpg->threaded) {
+        cpg_process_totem_confchg(cpg, ring_id);
+        return;
+    }
+
+    event = g_new0(CpgEvent, 1);
+    event->type = CPG_EVENT_TOTEM_CONFCHG;
+    event->ring_id = ring_id;
+    cpg_event_push(cpg, event);
 }
 
 static gboolean colod_cpg_readable(G_GNUC_UNUSED gint fd,
                                    G_GNUC_UNUSED GIOCondition events,
                                    gpointer data) {
     Cpg *cpg = data;
-    cpg_dispatch(cpg->handle, CS_DISPATCH_ALL);
+    cs_error_t err;
+
+    err = cpg_dispatch(cpg->handle, CS_DISPATCH_ALL);
+    if (err != CS_OK && err != CS_ERR_TRY_AGAIN) {
+        cpg->source_id = 0;
+        cpg_dispatch_failed(cpg, err);
+        return G_SOURCE_REMOVE;
+    }
+
     return G_SOURCE_CONTINUE;
 }
 
+static gpointer colod_cpg_thread(gpointer data) {
+    Cpg *cpg = data;
+    struct pollfd fds[2] = {
+        { .fd = cpg->cpg_fd, .events = POLLIN },
+        { .fd = cpg->stop_fd, .events = POLLIN }
+    };
+
+    CpgEvent *event;
+    cs_error_t err;
+
+    while (TRUE) {
+        int ret = poll(fds, 2, -1);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            log_error_fmt("cpg: poll() failed: %s", g_strerror(errno));
+            err = CS_ERR_LIBRARY;
+            break;
+        }
+
+        if (fds[1].revents) {
+            return NULL;
+        }
+
+        if (fds[0].revents) {
+            err = cpg_dispatch(cpg->handle, CS_DISPATCH_ALL);
+            if (err != CS_OK && err != CS_ERR_TRY_AGAIN) {
+                break;
+            }
+        }
+    }
+
+    // Let the main loop handle it like a failed dispatch on the main loop
+    event = g_new0(CpgEvent, 1);
+    event->type = CPG_EVENT_ERROR;
+    event->err = err;
+    cpg_event_push(cpg, event);
+    return NULL;
+}
+
+static gboolean colod_cpg_queue_readable(G_GNUC_UNUSED gint fd,
+                                         G_GNUC_UNUSED GIOCondition events,
+                                         gpointer data) {
+    Cpg *cpg = data;
+    uint64_t count;
+
+    if (read(cpg->wake_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        log_error_fmt("cpg: Failed to read eventfd: %s", g_strerror(errno));
+    }
+
+    for (guint i = 0; i < cpg->budget; i++) {
+        CpgEvent *event = colod_spsc_pop(&cpg->queue);
+        if (!event) {
+            return G_SOURCE_CONTINUE;
+        }
+
+        cpg_event_process(cpg, event);
+        cpg_event_free(event);
+    }
+
+    // Budget exhausted, let other sources run before continuing
+    cpg_wake(cpg);
+    return G_SOURCE_CONTINUE;
+}
+
+static void colod_cpg_flush(Cpg *cpg) {
+    struct iovec vec[2*CPG_BATCH_MAX];
+    guint count = 0;
+
+    if (!cpg->batch_len) {
+        return;
+    }
+
+    for (guint i = 0; i < cpg->batch_len; i++) {
+        guint len = CPG_RECORD_LEN(ntohl(cpg->batch[i]));
+
+        vec[count].iov_len = sizeof(cpg->batch[i]);
+        vec[count].iov_base = &cpg->batch[i];
+        count++;
+
+        if (len) {
+            vec[count].iov_len = CPG_RECORD_PAD(len);
+            vec[count].iov_base = cpg->batch_payload[i];
+            count++;
+        }
+    }
+    cpg_mcast_joined(cpg->handle, CPG_TYPE_AGREED, vec, count);
+
+    for (guint i = 0; i < cpg->batch_len; i++) {
+        g_free(cpg->batch_payload[i]);
+        cpg->batch_payload[i] = NULL;
+    }
+    cpg->batch_len = 0;
+}
+
+static gboolean colod_cpg_flush_cb(gpointer data) {
+    Cpg *cpg = data;
+
+    cpg->flush_source_id = 0;
+    colod_cpg_flush(cpg);
+    return G_SOURCE_REMOVE;
+}
+
+static void colod_cpg_queue(Cpg *cpg, uint32_t message, const void *payload,
+                            size_t len) {
+    uint32_t header = htonl(message | len << 16);
+
+    assert(message < MESSAGE_MAX);
+    assert(len <= CPG_PAYLOAD_MAX);
+
+    if (!len && cpg->batch_len && cpg->batch[cpg->batch_len -1] == header) {
+        return;
+    }
+
+    if (cpg->batch_len == CPG_BATCH_MAX) {
+        colod_cpg_flush(cpg);
+    }
+    cpg->batch[cpg->batch_len] = header;
+    if (len) {
+        cpg->batch_payload[cpg->batch_len] = g_malloc0(CPG_RECORD_PAD(len));
+        memcpy(cpg->batch_payload[cpg->batch_len], payload, len);
+    }
+    cpg->batch_len++;
+
+    if (!cpg->batching) {
+        colod_cpg_flush(cpg);
+        return;
+    }
+
+    /*
+     * Sources added while dispatching are only dispatched in the next
+     * iteration, so this flushes everything sent during this iteration
+     * before any other source runs.
+     */
+    if (!cpg->flush_source_id) {
+        cpg->flush_source_id = g_idle_add_full(G_PRIORITY_HIGH,
+                                               colod_cpg_flush_cb, cpg, NULL);
+        g_source_set_name_by_id(cpg->flush_source_id, "cpg flush batch");
+    }
+}
+
 void colod_cpg_send(Cpg *cpg, uint32_t message) {
-    struct iovec vec;
-    uint32_t conv = htonl(message);
+    assert(message < MESSAGE_MAX);
 
     cpg->retransmit[message] = TRUE;
     if (!cpg->retransmit_source_id) {
@@ -139,9 +620,14 @@ void colod_cpg_send(Cpg *cpg, uint32_t message) {
                                                   cpg);
     }
 
-    vec.iov_len = sizeof(conv);
-    vec.iov_base = &conv;
-    cpg_mcast_joined(cpg->handle, CPG_TYPE_AGREED, &vec, 1);
+    colod_cpg_queue(cpg, message, NULL, 0);
+}
+
+void colod_cpg_send_payload(Cpg *cpg, uint32_t message, const void *payload,
+                            size_t len) {
+    assert(len);
+
+    colod_cpg_queue(cpg, message, payload, len);
 }
 
 cpg_model_v1_data_t cpg_data = {
@@ -149,7 +635,7 @@ cpg_model_v1_data_t cpg_data = {
     colod_cpg_deliver,
     colod_cpg_confchg,
     colod_cpg_totem_confchg,
-    0
+    CPG_MODEL_V1_DELIVER_INITIAL_TOTEM_CONF
 };
 
 Cpg *colod_open_cpg(ColodContext *ctx, GError **errp) {
@@ -166,6 +652,7 @@ Cpg *colod_open_cpg(ColodContext *ctx, GError **errp) {
 
     cpg = g_new0(Cpg, 1);
     cpg->ctx = ctx;
+    cpg->batching = ctx->cpg_batch;
 
     ret = cpg_model_initialize(&cpg->handle, CPG_MODEL_V1,
                                (cpg_model_data_t*) &cpg_data, cpg);
@@ -175,6 +662,15 @@ Cpg *colod_open_cpg(ColodContext *ctx, GError **errp) {
         return NULL;
     }
 
+    ret = cpg_local_get(cpg->handle, &cpg->membership.local_nodeid);
+    if (ret != CS_OK) {
+        colod_error_set(errp, "Failed to get local nodeid: %s",
+                        cs_strerror(ret));
+        cpg_finalize(cpg->handle);
+        g_free(cpg);
+        return NULL;
+    }
+
     ret = cpg_join(cpg->handle, &name);
     if (ret != CS_OK) {
         colod_error_set(errp, "Failed to join cpg group: %s", cs_strerror(ret));
@@ -197,15 +693,76 @@ Cpg *cpg_new(Cpg *cpg, GError **errp) {
         return NULL;
     }
 
-    cpg->source_id = g_unix_fd_add(fd, G_IO_IN | G_IO_HUP, colod_cpg_readable, cpg);
+    if (!cpg->ctx->cpg_thread) {
+        cpg->source_id = g_unix_fd_add(fd, G_IO_IN | G_IO_HUP,
+                                       colod_cpg_readable, cpg);
+        return cpg;
+    }
+
+    cpg->cpg_fd = fd;
+    cpg->budget = MAX(cpg->ctx->cpg_dispatch_budget, 1);
+    colod_spsc_init(&cpg->queue, 256);
+
+    cpg->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (cpg->wake_fd < 0) {
+        colod_error_set(errp, "Failed to create eventfd: %s",
+                        g_strerror(errno));
+        colod_spsc_destroy(&cpg->queue);
+        return NULL;
+    }
+
+    cpg->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (cpg->stop_fd < 0) {
+        colod_error_set(errp, "Failed to create eventfd: %s",
+                        g_strerror(errno));
+        close(cpg->wake_fd);
+        colod_spsc_destroy(&cpg->queue);
+        return NULL;
+    }
+
+    cpg->wake_source_id = g_unix_fd_add(cpg->wake_fd, G_IO_IN,
+                                        colod_cpg_queue_readable, cpg);
+    cpg->threaded = TRUE;
+    cpg->thread = g_thread_new("cpg dispatch", colod_cpg_thread, cpg);
     return cpg;
 }
 
+static void cpg_stop_thread(Cpg *cpg) {
+    uint64_t one = 1;
+    CpgEvent *event;
+
+    g_atomic_int_set(&cpg->stopping, TRUE);
+    if (write(cpg->stop_fd, &one, sizeof(one)) < 0) {
+        log_error_fmt("cpg: Failed to stop dispatch thread: %s",
+                      g_strerror(errno));
+    }
+    g_thread_join(cpg->thread);
+
+    while ((event = colod_spsc_pop(&cpg->queue))) {
+        cpg_event_free(event);
+    }
+    colod_spsc_destroy(&cpg->queue);
+
+    g_source_remove(cpg->wake_source_id);
+    close(cpg->wake_fd);
+    close(cpg->stop_fd);
+}
+
 void cpg_free(Cpg *cpg) {
+    if (cpg->thread) {
+        cpg_stop_thread(cpg);
+    }
     colod_callback_clear(&cpg->callbacks);
+    colod_callback_clear(&cpg->payload_callbacks);
+    if (cpg->flush_source_id) {
+        g_source_remove(cpg->flush_source_id);
+    }
+    colod_cpg_flush(cpg);
     if (cpg->retransmit_source_id) {
         g_source_remove(cpg->retransmit_source_id);
     }
-    g_source_remove(cpg->source_id);
+    if (cpg->source_id) {
+        g_source_remove(cpg->source_id);
+    }
     g_free(cpg);
 }
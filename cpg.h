@@ -10,21 +10,70 @@ typedef enum ColodMessage {
     MESSAGE_HELLO,
     MESSAGE_YELLOW,
     MESSAGE_UNYELLOW,
+    MESSAGE_HEARTBEAT,
+    MESSAGE_HEARTBEAT_REPLY,
+    MESSAGE_SNAPSHOT,
+    MESSAGE_STORE,
     MESSAGE_MAX
 } ColodMessage;
 
+#define CPG_PAYLOAD_MAX 0xffff
+
+#define CPG_MEMBERS_MAX 32
+#define CPG_HISTORY_MAX 32
+
+typedef struct CpgMember {
+    uint32_t nodeid, pid;
+    gint64 joined;
+} CpgMember;
+
+typedef struct CpgHistoryEntry {
+    gint64 time;
+    gboolean joined;
+    uint32_t nodeid, pid, reason;
+} CpgHistoryEntry;
+
+typedef struct CpgMembership {
+    uint32_t local_nodeid;
+    uint32_t ring_nodeid;
+    uint64_t ring_seq;
+    guint member_count;
+    CpgMember members[CPG_MEMBERS_MAX];
+    // Ring buffer of the last membership changes
+    guint history_count, history_pos;
+    CpgHistoryEntry history[CPG_HISTORY_MAX];
+} CpgMembership;
+
 typedef void (*CpgCallback)(gpointer user_data, ColodMessage message,
                             gboolean message_from_this_node,
                             gboolean peer_left_group);
+typedef void (*CpgPayloadCallback)(gpointer user_data, ColodMessage message,
+                                   gboolean message_from_this_node,
+                                   const void *payload, size_t len);
 
 void colod_cpg_add_notify(Cpg *this, CpgCallback _func, gpointer user_data);
 void colod_cpg_del_notify(Cpg *this, CpgCallback _func, gpointer user_data);
+void colod_cpg_add_payload_notify(Cpg *this, CpgPayloadCallback _func,
+                                  gpointer user_data);
+void colod_cpg_del_payload_notify(Cpg *this, CpgPayloadCallback _func,
+                                  gpointer user_data);
 
 void colod_cpg_stub_notify(Cpg *this, ColodMessage message,
                            gboolean message_from_this_node,
                            gboolean peer_left_group);
+void colod_cpg_stub_notify_payload(Cpg *this, ColodMessage message,
+                                   gboolean message_from_this_node,
+                                   const void *payload, size_t len);
+guint colod_cpg_stub_payloads_sent(Cpg *this);
+
+const CpgMembership *colod_cpg_membership(Cpg *cpg);
+// Whether a member that left in the last membership change went down with
+// its node, rather than just its process
+gboolean colod_cpg_left_node_down(Cpg *cpg);
 
 void colod_cpg_send(Cpg *cpg, uint32_t message);
+void colod_cpg_send_payload(Cpg *cpg, uint32_t message, const void *payload,
+                            size_t len);
 Cpg *colod_open_cpg(ColodContext *ctx, GError **errp);
 Cpg *cpg_new(Cpg *cpg, GError **errp);
 void cpg_free(Cpg *cpg);
@@ -0,0 +1,732 @@
+/*
+ * COLO background daemon local cpg broker
+ *
+ * Copyright (c) Lukas Straub <lukasstraub2@web.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+// For SOCK_CLOEXEC
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <glib-2.0/glib.h>
+#include <glib-2.0/glib-unix.h>
+
+#include "queue.h"
+#include "local_cpg.h"
+
+/*
+ * Stand-in for corosync so colod processes linked against local_cpg.o can
+ * be run against each other on one machine.
+ *
+ * All messages of a group are delivered to every member of the group
+ * (including the sender) in the same order. Membership changes are
+ * delivered in order with the messages, so messages sent before a member
+ * left are delivered before the leave notification.
+ *
+ * Every message and membership change is delayed by --latency plus a random
+ * amount up to --jitter milliseconds. Order within a group is kept, but
+ * messages of different groups may overtake each other.
+ *
+ * Control commands can be sent with --control:
+ *   latency <ms> [<jitter ms>]
+ *   partition <nodeid>[,<nodeid>...] [<nodeid>[,<nodeid>...] ...]
+ *   heal
+ * Each argument of partition puts the listed nodes into a partition of their
+ * own, unlisted nodes stay in the default partition. Nodes only see members
+ * and messages of their own partition. heal merges all partitions again.
+ */
+
+typedef struct Broker Broker;
+
+typedef struct BrokerClient {
+    QLIST_ENTRY(BrokerClient) next;
+    Broker *broker;
+    int fd;
+    guint source_id, out_source_id;
+    GQueue out;
+    uint32_t nodeid, pid;
+    gchar *group;
+    GArray *view;
+} BrokerClient;
+
+typedef struct BrokerEvent {
+    gint64 deliver_at;
+    // NULL for a membership change in all groups
+    gchar *group;
+    // NULL for a membership change
+    GBytes *msg;
+    uint32_t nodeid, pid;
+    guint partition;
+} BrokerEvent;
+
+struct Broker {
+    gchar *path;
+    int listen_fd;
+    QLIST_HEAD(, BrokerClient) clients;
+    GQueue events;
+    GHashTable *group_time;
+    GHashTable *partitions;
+    guint timer_id;
+    guint latency, jitter;
+    uint64_t ring_seq;
+};
+
+static void broker_client_free(BrokerClient *client);
+static void broker_schedule(Broker *broker);
+
+static guint broker_partition(Broker *broker, uint32_t nodeid) {
+    return GPOINTER_TO_UINT(g_hash_table_lookup(broker->partitions,
+                                                GUINT_TO_POINTER(nodeid)));
+}
+
+static gint64 broker_deliver_time(Broker *broker, const gchar *group) {
+    gint64 now = g_get_monotonic_time();
+    gint64 at = now + broker->latency * 1000;
+    GHashTableIter iter;
+    gpointer key, value;
+
+    if (broker->jitter) {
+        at += g_random_int_range(0, broker->jitter * 1000);
+    }
+
+    // Never deliver before an earlier event of the same group
+    g_hash_table_iter_init(&iter, broker->group_time);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        gint64 *last = value;
+        if (!group || !strcmp(key, group)) {
+            at = MAX(at, *last);
+        }
+    }
+
+    if (group) {
+        gint64 *last = g_hash_table_lookup(broker->group_time, group);
+        if (!last) {
+            last = g_new(gint64, 1);
+            g_hash_table_insert(broker->group_time, g_strdup(group), last);
+        }
+        *last = at;
+    } else {
+        g_hash_table_iter_init(&iter, broker->group_time);
+        while (g_hash_table_iter_next(&iter, &key, &value)) {
+            *((gint64 *) value) = at;
+        }
+    }
+
+    return at;
+}
+
+static gint broker_event_compare(gconstpointer a, gconstpointer b,
+                                 G_GNUC_UNUSED gpointer data) {
+    const BrokerEvent *queued = a, *event = b;
+    // Keep events with the same deliver time in fifo order
+    return queued->deliver_at <= event->deliver_at ? -1 : 1;
+}
+
+static void broker_event_add(Broker *broker, const gchar *group, GBytes *msg,
+                             uint32_t nodeid, uint32_t pid) {
+    BrokerEvent *event = g_new0(BrokerEvent, 1);
+
+    event->deliver_at = broker_deliver_time(broker, group);
+    event->group = g_strdup(group);
+    event->msg = msg;
+    event->nodeid = nodeid;
+    event->pid = pid;
+    event->partition = broker_partition(broker, nodeid);
+
+    g_queue_insert_sorted(&broker->events, event, broker_event_compare, NULL);
+    broker_schedule(broker);
+}
+
+static void broker_event_free(BrokerEvent *event) {
+    g_free(event->group);
+    if (event->msg) {
+        g_bytes_unref(event->msg);
+    }
+    g_free(event);
+}
+
+static void broker_client_flush(BrokerClient *client) {
+    while (!g_queue_is_empty(&client->out)) {
+        GBytes *frame = g_queue_peek_head(&client->out);
+        gsize len;
+        const void *data = g_bytes_get_data(frame, &len);
+        ssize_t ret;
+
+        ret = send(client->fd, data, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        } else if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return;
+        } else if (ret < 0) {
+            // The reader notices the hangup and frees the client
+            fprintf(stderr, "cpg_broker: Failed to send to node %u: %s\n",
+                    client->nodeid, g_strerror(errno));
+        }
+
+        g_bytes_unref(g_queue_pop_head(&client->out));
+    }
+}
+
+static gboolean broker_client_writable(G_GNUC_UNUSED gint fd,
+                                       G_GNUC_UNUSED GIOCondition events,
+                                       gpointer data) {
+    BrokerClient *client = data;
+
+    broker_client_flush(client);
+    if (g_queue_is_empty(&client->out)) {
+        client->out_source_id = 0;
+        return G_SOURCE_REMOVE;
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+static void broker_client_send(BrokerClient *client, uint32_t type,
+                               uint32_t nodeid, uint32_t pid,
+                               const void *payload, size_t len) {
+    LocalCpgHeader header = {
+        .type = type,
+        .nodeid = nodeid,
+        .pid = pid,
+        .len = len
+    };
+    guint8 *frame = g_malloc(sizeof(header) + len);
+
+    memcpy(frame, &header, sizeof(header));
+    memcpy(frame + sizeof(header), payload, len);
+    g_queue_push_tail(&client->out,
+                      g_bytes_new_take(frame, sizeof(header) + len));
+
+    broker_client_flush(client);
+    if (!g_queue_is_empty(&client->out) && !client->out_source_id) {
+        client->out_source_id = g_unix_fd_add(client->fd, G_IO_OUT,
+                                              broker_client_writable, client);
+    }
+}
+
+static gboolean broker_view_contains(GArray *view, uint32_t nodeid,
+                                     uint32_t pid) {
+    for (guint i = 0; i < view->len; i++) {
+        LocalCpgAddress *address = &g_array_index(view, LocalCpgAddress, i);
+        if (address->nodeid == nodeid && address->pid == pid) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+static gboolean broker_connected(Broker *broker, const gchar *group,
+                                 uint32_t nodeid, uint32_t pid) {
+    BrokerClient *client;
+
+    QLIST_FOREACH(client, &broker->clients, next) {
+        if (client->group && !strcmp(client->group, group)
+                && client->nodeid == nodeid && client->pid == pid) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+static gint broker_address_compare(gconstpointer a, gconstpointer b) {
+    const LocalCpgAddress *x = a, *y = b;
+
+    if (x->nodeid != y->nodeid) {
+        return x->nodeid < y->nodeid ? -1 : 1;
+    }
+    return x->pid < y->pid ? -1 : (x->pid > y->pid);
+}
+
+static GArray *broker_visible(Broker *broker, BrokerClient *client) {
+    GArray *view = g_array_new(FALSE, FALSE, sizeof(LocalCpgAddress));
+    guint partition = broker_partition(broker, client->nodeid);
+    BrokerClient *entry;
+
+    QLIST_FOREACH(entry, &broker->clients, next) {
+        if (entry->group && !strcmp(entry->group, client->group)
+                && broker_partition(broker, entry->nodeid) == partition) {
+            LocalCpgAddress address = {
+                .nodeid = entry->nodeid,
+                .pid = entry->pid,
+                .reason = LOCAL_CPG_REASON_JOIN
+            };
+            g_array_append_val(view, address);
+        }
+    }
+    g_array_sort(view, broker_address_compare);
+
+    return view;
+}
+
+static void broker_update_view(Broker *broker, BrokerClient *client) {
+    GArray *view = broker_visible(broker, client);
+    GArray *left = g_array_new(FALSE, FALSE, sizeof(LocalCpgAddress));
+    GArray *joined = g_array_new(FALSE, FALSE, sizeof(LocalCpgAddress));
+    LocalCpgConfchg confchg;
+    LocalCpgTotem totem = { 0 };
+    GByteArray *payload;
+
+    for (guint i = 0; i < client->view->len; i++) {
+        LocalCpgAddress address = g_array_index(client->view,
+                                                LocalCpgAddress, i);
+        if (!broker_view_contains(view, address.nodeid, address.pid)) {
+            if (broker_connected(broker, client->group, address.nodeid,
+                                 address.pid)) {
+                address.reason = LOCAL_CPG_REASON_NODEDOWN;
+            } else {
+                address.reason = LOCAL_CPG_REASON_PROCDOWN;
+            }
+            g_array_append_val(left, address);
+        }
+    }
+    for (guint i = 0; i < view->len; i++) {
+        LocalCpgAddress *address = &g_array_index(view, LocalCpgAddress, i);
+        if (!broker_view_contains(client->view, address->nodeid,
+                                  address->pid)) {
+            g_array_append_val(joined, *address);
+        }
+    }
+
+    if (!left->len && !joined->len) {
+        goto out;
+    }
+
+    if (view->len) {
+        totem.nodeid = g_array_index(view, LocalCpgAddress, 0).nodeid;
+    }
+    totem.seq = broker->ring_seq;
+    broker_client_send(client, LOCAL_CPG_TOTEM, 0, 0, &totem, sizeof(totem));
+
+    confchg.member_entries = view->len;
+    confchg.left_entries = left->len;
+    confchg.joined_entries = joined->len;
+
+    payload = g_byte_array_new();
+    g_byte_array_append(payload, (guint8 *) &confchg, sizeof(confchg));
+    g_byte_array_append(payload, (guint8 *) view->data,
+                        view->len * sizeof(LocalCpgAddress));
+    g_byte_array_append(payload, (guint8 *) left->data,
+                        left->len * sizeof(LocalCpgAddress));
+    g_byte_array_append(payload, (guint8 *) joined->data,
+                        joined->len * sizeof(LocalCpgAddress));
+    broker_client_send(client, LOCAL_CPG_CONFCHG, 0, 0,
+                       payload->data, payload->len);
+    g_byte_array_free(payload, TRUE);
+
+    g_array_free(client->view, TRUE);
+    client->view = view;
+    view = NULL;
+
+out:
+    if (view) {
+        g_array_free(view, TRUE);
+    }
+    g_array_free(left, TRUE);
+    g_array_free(joined, TRUE);
+}
+
+static void broker_deliver(Broker *broker, BrokerEvent *event) {
+    BrokerClient *client;
+
+    if (!event->msg) {
+        broker->ring_seq++;
+    }
+
+    QLIST_FOREACH(client, &broker->clients, next) {
+        const void *data;
+        gsize len;
+
+        if (!client->group
+                || (event->group && strcmp(client->group, event->group))) {
+            continue;
+        }
+
+        if (!event->msg) {
+            broker_update_view(broker, client);
+            continue;
+        }
+
+        if (broker_partition(broker, client->nodeid) != event->partition
+                || !broker_view_contains(client->view, event->nodeid,
+                                         event->pid)) {
+            continue;
+        }
+
+        data = g_bytes_get_data(event->msg, &len);
+        broker_client_send(client, LOCAL_CPG_DELIVER, event->nodeid,
+                           event->pid, data, len);
+    }
+}
+
+static gboolean broker_timer_cb(gpointer data) {
+    Broker *broker = data;
+    gint64 now = g_get_monotonic_time();
+
+    broker->timer_id = 0;
+
+    while (!g_queue_is_empty(&broker->events)) {
+        BrokerEvent *event = g_queue_peek_head(&broker->events);
+        if (event->deliver_at > now) {
+            break;
+        }
+
+        g_queue_pop_head(&broker->events);
+        broker_deliver(broker, event);
+        broker_event_free(event);
+    }
+
+    broker_schedule(broker);
+    return G_SOURCE_REMOVE;
+}
+
+static void broker_schedule(Broker *broker) {
+    BrokerEvent *event;
+    gint64 delay;
+
+    if (broker->timer_id) {
+        g_source_remove(broker->timer_id);
+        broker->timer_id = 0;
+    }
+
+    event = g_queue_peek_head(&broker->events);
+    if (!event) {
+        return;
+    }
+
+    delay = MAX(event->deliver_at - g_get_monotonic_time(), 0);
+    broker->timer_id = g_timeout_add((delay + 999) / 1000, broker_timer_cb,
+                                     broker);
+}
+
+static void broker_control(Broker *broker, const gchar *command) {
+    gchar **argv = g_strsplit_set(command, " \t\n", -1);
+    guint argc = 0;
+    gchar **args;
+
+    // Drop empty tokens from repeated whitespace
+    for (guint i = 0; argv[i]; i++) {
+        if (*argv[i]) {
+            argv[argc++] = argv[i];
+        } else {
+            g_free(argv[i]);
+        }
+    }
+    argv[argc] = NULL;
+
+    if (!argc) {
+        goto out;
+    }
+
+    if (!strcmp(argv[0], "latency") && (argc == 2 || argc == 3)) {
+        broker->latency = strtoul(argv[1], NULL, 10);
+        broker->jitter = argc == 3 ? strtoul(argv[2], NULL, 10) : 0;
+    } else if (!strcmp(argv[0], "partition")) {
+        g_hash_table_remove_all(broker->partitions);
+        for (guint i = 1; i < argc; i++) {
+            args = g_strsplit(argv[i], ",", -1);
+            for (guint j = 0; args[j]; j++) {
+                g_hash_table_insert(broker->partitions,
+                        GUINT_TO_POINTER(strtoul(args[j], NULL, 10)),
+                        GUINT_TO_POINTER(i));
+            }
+            g_strfreev(args);
+        }
+        broker_event_add(broker, NULL, NULL, 0, 0);
+    } else if (!strcmp(argv[0], "heal") && argc == 1) {
+        g_hash_table_remove_all(broker->partitions);
+        broker_event_add(broker, NULL, NULL, 0, 0);
+    } else {
+        fprintf(stderr, "cpg_broker: Invalid control command: %s\n", command);
+        goto out;
+    }
+
+    fprintf(stderr, "cpg_broker: %s\n", command);
+
+out:
+    g_strfreev(argv);
+}
+
+static void broker_client_frame(BrokerClient *client, LocalCpgHeader *header,
+                                const guint8 *payload) {
+    Broker *broker = client->broker;
+    gchar *command;
+
+    switch (header->type) {
+        case LOCAL_CPG_JOIN:
+            if (client->group) {
+                fprintf(stderr, "cpg_broker: Node %u joined twice\n",
+                        header->nodeid);
+                break;
+            }
+
+            client->nodeid = header->nodeid;
+            client->pid = header->pid;
+            client->group = g_strndup((const gchar *) payload, header->len);
+            broker_event_add(broker, client->group, NULL, 0, 0);
+        break;
+
+        case LOCAL_CPG_MCAST:
+            if (!client->group) {
+                break;
+            }
+
+            broker_event_add(broker, client->group,
+                             g_bytes_new(payload, header->len),
+                             client->nodeid, client->pid);
+        break;
+
+        case LOCAL_CPG_CONTROL:
+            command = g_strndup((const gchar *) payload, header->len);
+            broker_control(broker, command);
+            g_free(command);
+        break;
+
+        default:
+            fprintf(stderr, "cpg_broker: Got invalid frame type %u\n",
+                    header->type);
+        break;
+    }
+}
+
+static gboolean broker_client_readable(G_GNUC_UNUSED gint fd,
+                                       G_GNUC_UNUSED GIOCondition events,
+                                       gpointer data) {
+    BrokerClient *client = data;
+    LocalCpgHeader header;
+    guint8 *buf;
+    ssize_t size;
+
+    size = recv(client->fd, NULL, 0, MSG_PEEK | MSG_TRUNC | MSG_DONTWAIT);
+    if (size < 0 && (errno == EINTR || errno == EAGAIN)) {
+        return G_SOURCE_CONTINUE;
+    } else if (size <= 0) {
+        client->source_id = 0;
+        broker_client_free(client);
+        return G_SOURCE_REMOVE;
+    }
+
+    buf = g_malloc(size);
+    size = recv(client->fd, buf, size, MSG_DONTWAIT);
+    if (size < (ssize_t) sizeof(header)) {
+        g_free(buf);
+        return G_SOURCE_CONTINUE;
+    }
+
+    memcpy(&header, buf, sizeof(header));
+    if (header.len != size - sizeof(header)) {
+        fprintf(stderr, "cpg_broker: Got frame of invalid length\n");
+    } else {
+        broker_client_frame(client, &header, buf + sizeof(header));
+    }
+
+    g_free(buf);
+    return G_SOURCE_CONTINUE;
+}
+
+static void broker_client_free(BrokerClient *client) {
+    Broker *broker = client->broker;
+
+    QLIST_REMOVE(client, next);
+    if (client->group) {
+        broker_event_add(broker, client->group, NULL, 0, 0);
+    }
+
+    if (client->source_id) {
+        g_source_remove(client->source_id);
+    }
+    if (client->out_source_id) {
+        g_source_remove(client->out_source_id);
+    }
+    g_queue_clear_full(&client->out, (GDestroyNotify) g_bytes_unref);
+    close(client->fd);
+    g_array_free(client->view, TRUE);
+    g_free(client->group);
+    g_free(client);
+}
+
+static gboolean broker_accept(G_GNUC_UNUSED gint fd,
+                              G_GNUC_UNUSED GIOCondition events,
+                              gpointer data) {
+    Broker *broker = data;
+    BrokerClient *client;
+    int ret;
+
+    ret = accept4(broker->listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (ret < 0) {
+        fprintf(stderr, "cpg_broker: Failed to accept: %s\n",
+                g_strerror(errno));
+        return G_SOURCE_CONTINUE;
+    }
+
+    client = g_new0(BrokerClient, 1);
+    client->broker = broker;
+    client->fd = ret;
+    g_queue_init(&client->out);
+    client->view = g_array_new(FALSE, FALSE, sizeof(LocalCpgAddress));
+    client->source_id = g_unix_fd_add(client->fd, G_IO_IN | G_IO_HUP,
+                                      broker_client_readable, client);
+    QLIST_INSERT_HEAD(&broker->clients, client, next);
+
+    return G_SOURCE_CONTINUE;
+}
+
+static int broker_socket(const gchar *path, gboolean listening) {
+    struct sockaddr_un address = { 0 };
+    int fd, ret;
+
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "cpg_broker: Unix path too long\n");
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+    address.sun_family = AF_UNIX;
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(stderr, "cpg_broker: Failed to create socket: %s\n",
+                g_strerror(errno));
+        return -1;
+    }
+
+    if (listening) {
+        unlink(path);
+        ret = bind(fd, (const struct sockaddr *) &address, sizeof(address));
+        if (ret == 0) {
+            ret = listen(fd, 16);
+        }
+    } else {
+        ret = connect(fd, (const struct sockaddr *) &address,
+                      sizeof(address));
+    }
+    if (ret < 0) {
+        fprintf(stderr, "cpg_broker: Failed to %s socket: %s\n",
+                listening ? "listen on" : "connect", g_strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static int broker_send_control(const gchar *path, const gchar *command) {
+    LocalCpgHeader header = {
+        .type = LOCAL_CPG_CONTROL,
+        .len = strlen(command)
+    };
+    struct iovec vec[2] = {
+        { .iov_base = &header, .iov_len = sizeof(header) },
+        { .iov_base = (void *) command, .iov_len = header.len }
+    };
+    struct msghdr msg = { .msg_iov = vec, .msg_iovlen = 2 };
+    int fd;
+
+    fd = broker_socket(path, FALSE);
+    if (fd < 0) {
+        return EXIT_FAILURE;
+    }
+
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) < 0) {
+        fprintf(stderr, "cpg_broker: Failed to send control command: %s\n",
+                g_strerror(errno));
+        close(fd);
+        return EXIT_FAILURE;
+    }
+
+    close(fd);
+    return EXIT_SUCCESS;
+}
+
+static gboolean broker_quit(gpointer data) {
+    g_main_loop_quit(data);
+    return G_SOURCE_REMOVE;
+}
+
+int main(int argc, char **argv) {
+    GError *errp = NULL;
+    GOptionContext *context;
+    GMainLoop *mainloop;
+    Broker broker_struct = { 0 };
+    Broker *broker = &broker_struct;
+    gchar *control = NULL;
+    guint source_id;
+    GOptionEntry entries[] =
+    {
+        {"socket", 's', 0, G_OPTION_ARG_FILENAME, &broker->path, "The path of the broker socket", NULL},
+        {"latency", 'l', 0, G_OPTION_ARG_INT, &broker->latency, "Delivery latency in ms", NULL},
+        {"jitter", 'j', 0, G_OPTION_ARG_INT, &broker->jitter, "Maximum random additional latency in ms", NULL},
+        {"control", 'c', 0, G_OPTION_ARG_STRING, &control, "Send a control command to a running broker and exit", NULL},
+        {0}
+    };
+
+    context = g_option_context_new("- local cpg broker for colod");
+    g_option_context_set_help_enabled(context, TRUE);
+    g_option_context_add_main_entries(context, entries, 0);
+    if (!g_option_context_parse(context, &argc, &argv, &errp)) {
+        fprintf(stderr, "%s\n", errp->message);
+        g_error_free(errp);
+        g_option_context_free(context);
+        return EXIT_FAILURE;
+    }
+    g_option_context_free(context);
+
+    if (!broker->path) {
+        const gchar *path = g_getenv(LOCAL_CPG_SOCKET_ENV);
+        broker->path = g_strdup(path ? path : LOCAL_CPG_SOCKET);
+    }
+
+    if (control) {
+        return broker_send_control(broker->path, control);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    broker->listen_fd = broker_socket(broker->path, TRUE);
+    if (broker->listen_fd < 0) {
+        return EXIT_FAILURE;
+    }
+
+    QLIST_INIT(&broker->clients);
+    g_queue_init(&broker->events);
+    broker->group_time = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                               g_free, g_free);
+    broker->partitions = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+    mainloop = g_main_loop_new(g_main_context_default(), FALSE);
+    source_id = g_unix_fd_add(broker->listen_fd, G_IO_IN, broker_accept,
+                              broker);
+    g_unix_signal_add(SIGINT, broker_quit, mainloop);
+    g_unix_signal_add(SIGTERM, broker_quit, mainloop);
+
+    g_main_loop_run(mainloop);
+
+    g_source_remove(source_id);
+    while (!QLIST_EMPTY(&broker->clients)) {
+        broker_client_free(QLIST_FIRST(&broker->clients));
+    }
+    if (broker->timer_id) {
+        g_source_remove(broker->timer_id);
+    }
+    g_queue_clear_full(&broker->events, (GDestroyNotify) broker_event_free);
+    g_hash_table_unref(broker->group_time);
+    g_hash_table_unref(broker->partitions);
+    g_main_loop_unref(mainloop);
+
+    close(broker->listen_fd);
+    unlink(broker->path);
+    g_free(broker->path);
+    return EXIT_SUCCESS;
+}
@@ -38,6 +38,33 @@
 FILE *trace = NULL;
 gboolean do_syslog = FALSE;
 
+static int daemon_add_qmp_monitor(ColodContext *ctx, const gchar *spec,
+                                  GError **errp) {
+    const gchar *sep = strrchr(spec, ':');
+    g_autofree gchar *path = NULL;
+    QmpRole role;
+    int fd, ret;
+
+    if (!sep || sep == spec || qmp_role_from_str(sep + 1, &role) < 0) {
+        colod_error_set(errp, "Invalid qmp monitor \"%s\"", spec);
+        return -1;
+    }
+
+    path = g_strndup(spec, sep - spec);
+    fd = colod_unix_connect(path, errp);
+    if (fd < 0) {
+        return -1;
+    }
+
+    ret = qmp_add_monitor(ctx->qmp, fd, role, errp);
+    if (ret < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return 0;
+}
+
 void daemon_mainloop(ColodContext *mctx) {
     const ColodContext *ctx = mctx;
     GError *local_errp = NULL;
@@ -55,6 +82,16 @@ void daemon_mainloop(ColodContext *mctx) {
         exit(EXIT_FAILURE);
     }
 
+    for (guint i = 0; ctx->qmp_monitors && ctx->qmp_monitors[i]; i++) {
+        if (daemon_add_qmp_monitor(mctx, ctx->qmp_monitors[i],
+                                   &local_errp) < 0) {
+            colod_syslog(LOG_ERR, "Failed to add qmp monitor: %s",
+                         local_errp->message);
+            g_error_free(local_errp);
+            exit(EXIT_FAILURE);
+        }
+    }
+
     mctx->cpg = cpg_new(ctx->cpg, &local_errp);
     if (!ctx->cpg) {
         colod_syslog(LOG_ERR, "Failed to initialize cpg: %s",
@@ -78,10 +115,12 @@ void daemon_mainloop(ColodContext *mctx) {
     g_main_loop_unref(ctx->mainloop);
     mctx->mainloop = NULL;
 
+    // Clients may still use the main coroutine while shutting down
+    client_listener_free(ctx->listener);
     colod_main_free(ctx->main_coroutine);
+    mctx->main_coroutine = NULL;
     cpg_free(ctx->cpg);
     colo_watchdog_free(ctx->watchdog);
-    client_listener_free(ctx->listener);
     qmp_commands_free(ctx->commands);
     qmp_free(ctx->qmp);
 }
@@ -115,7 +154,7 @@ static int daemon_open_mngmt(ColodContext *ctx, GError **errp) {
         goto err;
     }
 
-    ret = listen(sockfd, 2);
+    ret = listen(sockfd, ctx->mngmt_backlog);
     if (ret < 0) {
         colod_error_set(errp, "Failed to listen management socket: %s",
                         g_strerror(errno));
@@ -209,17 +248,61 @@ static int daemon_parse_options(ColodContext *ctx, int *argc, char ***argv,
         {"base_directory", 'b', 0, G_OPTION_ARG_FILENAME, &ctx->base_dir, "The base directory to store logs and sockets", NULL},
         {"qmp_path", 'q', 0, G_OPTION_ARG_FILENAME, &ctx->qmp_path, "The path to the qmp socket", NULL},
         {"qmp_yank_path", 'y', 0, G_OPTION_ARG_FILENAME, &ctx->qmp_yank_path, "The path to the qmp socket used for yank", NULL},
+        {"qmp_monitor", 0, 0, G_OPTION_ARG_STRING_ARRAY, &ctx->qmp_monitors, "Additional qmp socket as <path>:<role>, role is critical, health or client. Can be given multiple times", NULL},
         {"timeout_low", 'l', 0, G_OPTION_ARG_INT, &ctx->qmp_timeout_low, "Low qmp timeout", NULL},
         {"timeout_high", 't', 0, G_OPTION_ARG_INT, &ctx->qmp_timeout_high, "High qmp timeout", NULL},
         {"watchdog_interval", 'a', 0, G_OPTION_ARG_INT, &ctx->watchdog_interval, "Watchdog interval (0 to disable)", NULL},
         {"primary", 'p', 0, G_OPTION_ARG_NONE, &ctx->primary_startup, "Startup in primary mode", NULL},
         {"trace", 0, 0, G_OPTION_ARG_NONE, &ctx->do_trace, "Enable tracing", NULL},
         {"monitor_interface", 'm', 0, G_OPTION_ARG_STRING, &ctx->monitor_interface, "The interface to monitor", NULL},
+        {"monitor_link", 0, 0, G_OPTION_ARG_STRING_ARRAY, &ctx->monitor_links, "Additional interface to monitor as <interface>[:<role>[:<weight>]], role is replication (weight 100) or client (weight 50). Can be given multiple times", NULL},
+        {"link_yellow_threshold", 0, 0, G_OPTION_ARG_INT, &ctx->link_yellow_threshold, "Go yellow when the weight of the links that are down reaches this percentage of the total weight", NULL},
+        {"link_unyellow_threshold", 0, 0, G_OPTION_ARG_INT, &ctx->link_unyellow_threshold, "Go unyellow when the weight of the links that are down drops below this percentage of the total weight", NULL},
+        {"link_stats_interval", 0, 0, G_OPTION_ARG_INT, &ctx->link_stats_interval, "Interval in ms to poll the statistics of monitored interfaces (0 to disable)", NULL},
+        {"link_max_errors", 0, 0, G_OPTION_ARG_INT, &ctx->link_max_errors, "Treat a link as down when it has more errors per stats interval (0 to disable)", NULL},
+        {"link_max_drops", 0, 0, G_OPTION_ARG_INT, &ctx->link_max_drops, "Treat a link as down when it drops more packets per stats interval (0 to disable)", NULL},
+        {"link_max_carrier_changes", 0, 0, G_OPTION_ARG_INT, &ctx->link_max_carrier_changes, "Treat a link as down when its carrier changes more often per stats interval (0 to disable)", NULL},
+        {"yellow_delay", 0, 0, G_OPTION_ARG_INT, &ctx->yellow_delay, "Time in ms a link state change needs to persist before telling the peer", NULL},
+        {"yellow_hold", 0, 0, G_OPTION_ARG_INT, &ctx->yellow_hold, "Time in ms to wait after telling the peer before acting on a link state change", NULL},
+        {"flap_penalty", 0, 0, G_OPTION_ARG_INT, &ctx->flap_penalty, "Penalty added for every link state change (0 to disable flap damping)", NULL},
+        {"flap_suppress", 0, 0, G_OPTION_ARG_INT, &ctx->flap_suppress, "Treat a flapping link as yellow while the penalty is above this", NULL},
+        {"flap_reuse", 0, 0, G_OPTION_ARG_INT, &ctx->flap_reuse, "Stop treating a flapping link as yellow once the penalty decayed below this", NULL},
+        {"flap_half_life", 0, 0, G_OPTION_ARG_INT, &ctx->flap_half_life, "Half-life of the flap penalty in ms", NULL},
+        {"heartbeat_interval", 0, 0, G_OPTION_ARG_INT, &ctx->heartbeat_interval, "Peer heartbeat interval in ms (0 to disable)", NULL},
+        {"heartbeat_miss_yellow", 0, 0, G_OPTION_ARG_INT, &ctx->heartbeat_miss_yellow, "Missed peer heartbeats until the peer is treated as yellow (0 to disable)", NULL},
+        {"heartbeat_miss_failover", 0, 0, G_OPTION_ARG_INT, &ctx->heartbeat_miss_failover, "Missed peer heartbeats until the peer is treated as failed (0 to disable)", NULL},
+        {"cpg_batch", 0, 0, G_OPTION_ARG_NONE, &ctx->cpg_batch, "Batch cpg messages sent within one main loop iteration. All peers need to support this", NULL},
+        {"cpg_thread", 0, 0, G_OPTION_ARG_NONE, &ctx->cpg_thread, "Dispatch cpg messages on a dedicated thread", NULL},
+        {"cpg_dispatch_budget", 0, 0, G_OPTION_ARG_INT, &ctx->cpg_dispatch_budget, "Maximum cpg events processed per main loop iteration with --cpg_thread", NULL},
+        {"health_cache_ttl", 0, 0, G_OPTION_ARG_INT, &ctx->health_cache_ttl, "Time in ms the result of a qemu health check is reused (0 to disable)", NULL},
+        {"qemu_reconcile_interval", 0, 0, G_OPTION_ARG_INT, &ctx->qemu_reconcile_interval, "Answer health checks from qemu events and query qemu only every this many ms. This delays noticing a hung qemu by up to that long (0, the default, to always query)", NULL},
+        {"mngmt_backlog", 0, 0, G_OPTION_ARG_INT, &ctx->mngmt_backlog, "Backlog of the management socket", NULL},
+        {"client_max", 0, 0, G_OPTION_ARG_INT, &ctx->client_max, "Maximum number of management clients (0 for no limit)", NULL},
+        {"client_max_inflight", 0, 0, G_OPTION_ARG_INT, &ctx->client_max_inflight, "Maximum number of requests tagged with an id a client may have in flight", NULL},
+        {"client_rate_limit", 0, 0, G_OPTION_ARG_INT, &ctx->client_rate_limit, "Maximum qmp passthrough requests per second per client (0 for no limit)", NULL},
+        {"store_replicate", 0, 0, G_OPTION_ARG_NONE, &ctx->store_replicate, "Replicate the replicated store namespace to the peer over cpg", NULL},
+        {"checkpoint_interval", 0, 0, G_OPTION_ARG_INT, &ctx->checkpoint_interval, "Interval in ms to checkpoint the daemon state to the base directory for warm restarts (0, the default, to disable)", NULL},
+        {"peer_restart_grace", 0, 0, G_OPTION_ARG_INT, &ctx->peer_restart_grace, "Time in ms to wait for the colod of the peer to come back before failing over while replicating, unless its node went down (0, the default, to fail over immediately)", NULL},
+        {"status_page", 0, 0, G_OPTION_ARG_NONE, &ctx->status_page, "Publish the daemon status in a shared memory page in the base directory", NULL},
         {0}
     };
 
     ctx->qmp_timeout_low = 600;
     ctx->qmp_timeout_high = 10000;
+    ctx->heartbeat_miss_yellow = 3;
+    ctx->heartbeat_miss_failover = 10;
+    ctx->cpg_dispatch_budget = 64;
+    ctx->link_yellow_threshold = 100;
+    ctx->link_unyellow_threshold = 100;
+    ctx->yellow_delay = 500;
+    ctx->yellow_hold = 1000;
+    ctx->flap_suppress = 3000;
+    ctx->flap_reuse = 1000;
+    ctx->flap_half_life = 15000;
+    ctx->health_cache_ttl = 200;
+    ctx->mngmt_backlog = 16;
+    ctx->client_max = 32;
+    ctx->client_max_inflight = 8;
 
     context = g_option_context_new("- qemu colo heartbeat daemon");
     g_option_context_set_help_enabled(context, TRUE);
@@ -238,6 +321,20 @@ static int daemon_parse_options(ColodContext *ctx, int *argc, char ***argv,
         return -1;
     }
 
+    if (!ctx->link_yellow_threshold || ctx->link_yellow_threshold > 100
+            || ctx->link_unyellow_threshold > ctx->link_yellow_threshold) {
+        g_set_error(errp, COLOD_ERROR, COLOD_ERROR_FATAL,
+                    "--link_yellow_threshold needs to be between 1 and 100 and --link_unyellow_threshold must not exceed it.");
+        return -1;
+    }
+
+    if (ctx->flap_penalty && (!ctx->flap_half_life || !ctx->flap_reuse
+            || ctx->flap_reuse >= ctx->flap_suppress)) {
+        g_set_error(errp, COLOD_ERROR, COLOD_ERROR_FATAL,
+                    "--flap_half_life and --flap_reuse must be non-zero and --flap_reuse must be below --flap_suppress.");
+        return -1;
+    }
+
     return 0;
 }
 
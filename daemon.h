@@ -24,10 +24,31 @@ typedef struct ColodContext {
     /* Parameters */
     gchar *node_name, *instance_name, *base_dir;
     gchar *qmp_path, *qmp_yank_path;
+    gchar **qmp_monitors;
     gchar *monitor_interface;
+    gchar **monitor_links;
+    guint link_yellow_threshold, link_unyellow_threshold;
+    guint link_stats_interval;
+    guint link_max_errors, link_max_drops, link_max_carrier_changes;
+    guint yellow_delay, yellow_hold;
+    guint flap_penalty, flap_suppress, flap_reuse, flap_half_life;
     gboolean daemonize;
     guint qmp_timeout_low, qmp_timeout_high;
     guint watchdog_interval;
+    guint health_cache_ttl;
+    guint qemu_reconcile_interval;
+    guint mngmt_backlog, client_max;
+    guint client_max_inflight;
+    guint client_rate_limit;
+    gboolean store_replicate;
+    guint checkpoint_interval;
+    guint peer_restart_grace;
+    gboolean status_page;
+    guint heartbeat_interval;
+    guint heartbeat_miss_yellow, heartbeat_miss_failover;
+    gboolean cpg_batch;
+    gboolean cpg_thread;
+    guint cpg_dispatch_budget;
     gboolean do_trace;
     gboolean primary_startup;
 
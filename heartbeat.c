@@ -0,0 +1,242 @@
+/*
+ * COLO background daemon peer heartbeat
+ *
+ * Copyright (c) Lukas Straub <lukasstraub2@web.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <arpa/inet.h>
+
+#include <glib-2.0/glib.h>
+
+#include "heartbeat.h"
+#include "daemon.h"
+#include "util.h"
+
+typedef struct HeartbeatPayload {
+    uint32_t nonce;
+    uint32_t seq;
+    uint32_t timestamp_hi, timestamp_lo;
+} HeartbeatPayload;
+
+struct ColodHeartbeat {
+    Cpg *cpg;
+    ColodCallbackHead callbacks;
+    guint interval;
+    guint miss_yellow, miss_failover;
+    guint source_id;
+
+    uint32_t nonce;
+    uint32_t seq;
+
+    gboolean peer_seen, peer_late, peer_dead;
+    // Heard the peer since the last timer tick
+    gboolean peer_heard;
+    gint64 last_tick;
+    guint missed;
+
+    guint64 samples;
+    gint64 rtt, srtt, jitter;
+};
+
+void heartbeat_add_notify(ColodHeartbeat *this, HeartbeatCallback _func,
+                          gpointer user_data) {
+    ColodCallbackFunc func = (ColodCallbackFunc) _func;
+    colod_callback_add(&this->callbacks, func, user_data);
+}
+
+void heartbeat_del_notify(ColodHeartbeat *this, HeartbeatCallback _func,
+                          gpointer user_data) {
+    ColodCallbackFunc func = (ColodCallbackFunc) _func;
+    colod_callback_del(&this->callbacks, func, user_data);
+}
+
+static void notify(ColodHeartbeat *this, ColodEvent event) {
+    ColodCallback *entry, *next_entry;
+    QLIST_FOREACH_SAFE(entry, &this->callbacks, next, next_entry) {
+        HeartbeatCallback func = (HeartbeatCallback) entry->func;
+        func(entry->user_data, event);
+    }
+}
+
+void heartbeat_query(ColodHeartbeat *this, HeartbeatStats *ret) {
+    ret->enabled = !!this->interval;
+    ret->peer_seen = this->peer_seen;
+    ret->peer_late = this->peer_late;
+    ret->missed = this->missed;
+    ret->samples = this->samples;
+    ret->rtt = this->rtt;
+    ret->srtt = this->srtt;
+    ret->jitter = this->jitter;
+}
+
+static void heartbeat_rtt_sample(ColodHeartbeat *this, gint64 rtt) {
+    this->rtt = rtt;
+
+    // Smoothed rtt and variation as in RFC 6298
+    if (!this->samples) {
+        this->srtt = rtt;
+        this->jitter = rtt / 2;
+    } else {
+        gint64 delta = ABS(this->srtt - rtt);
+        this->jitter = (3 * this->jitter + delta) / 4;
+        this->srtt = (7 * this->srtt + rtt) / 8;
+    }
+    this->samples++;
+}
+
+static void heartbeat_peer_alive(ColodHeartbeat *this) {
+    this->peer_seen = TRUE;
+    this->peer_dead = FALSE;
+    this->peer_heard = TRUE;
+    this->missed = 0;
+
+    if (this->peer_late) {
+        this->peer_late = FALSE;
+        notify(this, EVENT_UNYELLOW);
+    }
+}
+
+static void heartbeat_cpg_payload_cb(gpointer data, ColodMessage message,
+                                     gboolean message_from_this_node,
+                                     const void *payload, size_t len) {
+    ColodHeartbeat *this = data;
+    HeartbeatPayload hb;
+
+    if (message != MESSAGE_HEARTBEAT && message != MESSAGE_HEARTBEAT_REPLY) {
+        return;
+    }
+
+    if (message_from_this_node) {
+        return;
+    }
+
+    if (len != sizeof(hb)) {
+        log_error_fmt("Got heartbeat of invalid length %zu", len);
+        return;
+    }
+    memcpy(&hb, payload, sizeof(hb));
+
+    heartbeat_peer_alive(this);
+
+    if (message == MESSAGE_HEARTBEAT) {
+        colod_cpg_send_payload(this->cpg, MESSAGE_HEARTBEAT_REPLY, &hb,
+                               sizeof(hb));
+    } else if (ntohl(hb.nonce) == this->nonce) {
+        gint64 timestamp = (gint64) ntohl(hb.timestamp_hi) << 32
+                                | ntohl(hb.timestamp_lo);
+        heartbeat_rtt_sample(this, g_get_monotonic_time() - timestamp);
+    }
+}
+
+static void heartbeat_cpg_cb(gpointer data,
+                             G_GNUC_UNUSED ColodMessage message,
+                             G_GNUC_UNUSED gboolean message_from_this_node,
+                             gboolean peer_left_group) {
+    ColodHeartbeat *this = data;
+
+    if (!peer_left_group) {
+        return;
+    }
+
+    this->peer_seen = FALSE;
+    this->peer_dead = FALSE;
+    this->peer_heard = FALSE;
+    this->missed = 0;
+    if (this->peer_late) {
+        this->peer_late = FALSE;
+        notify(this, EVENT_UNYELLOW);
+    }
+}
+
+/*
+ * Misses are counted per timer tick and not from the time since the peer
+ * was last heard, so a stall of our own main loop doesn't look like the
+ * peer went silent. A tick that ran late isn't counted, the heartbeats of
+ * the peer may still be waiting to be dispatched.
+ */
+static void heartbeat_check_peer(ColodHeartbeat *this, gboolean late) {
+    if (!this->peer_seen || this->peer_dead) {
+        return;
+    }
+
+    if (this->peer_heard) {
+        this->peer_heard = FALSE;
+        return;
+    }
+
+    if (late) {
+        return;
+    }
+
+    this->missed++;
+
+    if (this->miss_failover && this->missed >= this->miss_failover) {
+        colod_syslog(LOG_ERR, "Peer missed %u heartbeats", this->missed);
+        this->peer_dead = TRUE;
+        notify(this, EVENT_FAILOVER_SYNC);
+    } else if (this->miss_yellow && this->missed >= this->miss_yellow
+               && !this->peer_late) {
+        colod_syslog(LOG_WARNING, "Peer missed %u heartbeats", this->missed);
+        this->peer_late = TRUE;
+        notify(this, EVENT_YELLOW);
+    }
+}
+
+static gboolean heartbeat_timer_cb(gpointer data) {
+    ColodHeartbeat *this = data;
+    HeartbeatPayload hb;
+    gint64 now = g_get_monotonic_time();
+    gboolean late;
+
+    late = this->last_tick
+           && now - this->last_tick > 2 * (gint64) this->interval * 1000;
+    this->last_tick = now;
+
+    hb.nonce = htonl(this->nonce);
+    hb.seq = htonl(this->seq++);
+    hb.timestamp_hi = htonl((guint64) now >> 32);
+    hb.timestamp_lo = htonl(now & 0xffffffff);
+    colod_cpg_send_payload(this->cpg, MESSAGE_HEARTBEAT, &hb, sizeof(hb));
+
+    heartbeat_check_peer(this, late);
+
+    return G_SOURCE_CONTINUE;
+}
+
+ColodHeartbeat *heartbeat_new(Cpg *cpg, guint interval, guint miss_yellow,
+                              guint miss_failover) {
+    ColodHeartbeat *this;
+
+    this = g_new0(ColodHeartbeat, 1);
+    this->cpg = cpg;
+    this->interval = interval;
+    this->miss_yellow = miss_yellow;
+    this->miss_failover = miss_failover;
+    this->nonce = g_random_int();
+
+    if (!interval) {
+        return this;
+    }
+
+    colod_cpg_add_notify(cpg, heartbeat_cpg_cb, this);
+    colod_cpg_add_payload_notify(cpg, heartbeat_cpg_payload_cb, this);
+    this->source_id = g_timeout_add(interval, heartbeat_timer_cb, this);
+    g_source_set_name_by_id(this->source_id, "heartbeat timer");
+
+    return this;
+}
+
+void heartbeat_free(ColodHeartbeat *this) {
+    colod_callback_clear(&this->callbacks);
+
+    if (this->interval) {
+        g_source_remove(this->source_id);
+        colod_cpg_del_payload_notify(this->cpg, heartbeat_cpg_payload_cb, this);
+        colod_cpg_del_notify(this->cpg, heartbeat_cpg_cb, this);
+    }
+
+    g_free(this);
+}
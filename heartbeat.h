@@ -0,0 +1,45 @@
+/*
+ * COLO background daemon peer heartbeat
+ *
+ * Copyright (c) Lukas Straub <lukasstraub2@web.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef HEARTBEAT_H
+#define HEARTBEAT_H
+
+#include <glib-2.0/glib.h>
+
+#include "cpg.h"
+#include "eventqueue.h"
+
+typedef struct ColodHeartbeat ColodHeartbeat;
+
+typedef struct HeartbeatStats {
+    gboolean enabled;
+    gboolean peer_seen, peer_late;
+    guint missed;
+    guint64 samples;
+    gint64 rtt, srtt, jitter;
+} HeartbeatStats;
+
+/*
+ * Called with EVENT_YELLOW when the peer missed heartbeats, EVENT_UNYELLOW
+ * when it is heard again and EVENT_FAILOVER_SYNC when it is considered dead.
+ */
+typedef void (*HeartbeatCallback)(gpointer user_data, ColodEvent event);
+
+void heartbeat_add_notify(ColodHeartbeat *this, HeartbeatCallback _func,
+                          gpointer user_data);
+void heartbeat_del_notify(ColodHeartbeat *this, HeartbeatCallback _func,
+                          gpointer user_data);
+
+void heartbeat_query(ColodHeartbeat *this, HeartbeatStats *ret);
+
+ColodHeartbeat *heartbeat_new(Cpg *cpg, guint interval, guint miss_yellow,
+                              guint miss_failover);
+void heartbeat_free(ColodHeartbeat *this);
+
+#endif // HEARTBEAT_H
@@ -8,6 +8,7 @@
  */
 
 #include <assert.h>
+#include <string.h>
 
 #include <glib-2.0/glib.h>
 #include <json-glib-1.0/json-glib/json-glib.h>
@@ -114,3 +115,177 @@ gboolean object_matches_match_array(JsonNode *node, JsonNode *match_array) {
 
     return FALSE;
 }
+
+void json_append_string(GString *out, const gchar *str) {
+    if (!str) {
+        g_string_append(out, "null");
+        return;
+    }
+
+    g_string_append_c(out, '"');
+    for (const gchar *c = str; *c; c++) {
+        switch (*c) {
+            case '"': g_string_append(out, "\\\""); break;
+            case '\\': g_string_append(out, "\\\\"); break;
+            case '\b': g_string_append(out, "\\b"); break;
+            case '\f': g_string_append(out, "\\f"); break;
+            case '\n': g_string_append(out, "\\n"); break;
+            case '\r': g_string_append(out, "\\r"); break;
+            case '\t': g_string_append(out, "\\t"); break;
+            default:
+                if ((guchar) *c < 0x20) {
+                    g_string_append_printf(out, "\\u%04x", (guchar) *c);
+                } else {
+                    g_string_append_c(out, *c);
+                }
+            break;
+        }
+    }
+    g_string_append_c(out, '"');
+}
+
+static gboolean json_is_space(gchar c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+// Returns the index after the closing quote of the string starting at i,
+// or 0 if it is not terminated. qmp accepts single quoted strings too.
+static gsize json_scan_string(const gchar *line, gsize len, gsize i) {
+    gchar quote = line[i++];
+
+    while (i < len) {
+        if (line[i] == '\\') {
+            i += 2;
+        } else if (line[i] == quote) {
+            return i + 1;
+        } else {
+            i++;
+        }
+    }
+
+    return 0;
+}
+
+typedef enum JsonScanState {
+    SCAN_KEY,
+    SCAN_COLON,
+    SCAN_VALUE,
+    SCAN_IN_VALUE,
+    SCAN_FOUND
+} JsonScanState;
+
+int json_scan_member(const gchar *line, gsize len, const gchar *member,
+                     const gchar **value, gsize *value_len) {
+    gsize member_len = strlen(member);
+    JsonScanState state = SCAN_KEY;
+    gboolean key = FALSE;
+    gint braces = 0, brackets = 0;
+    gsize i = 0, start = 0, end = 0, last = 0;
+
+    while (i < len && json_is_space(line[i])) {
+        i++;
+    }
+    if (i == len || line[i] != '{') {
+        return -1;
+    }
+
+    // Count braces and brackets like the json streamer of qemu does
+    for (; i < len; i++) {
+        gchar c = line[i];
+        gboolean top = braces == 1 && !brackets;
+
+        if (json_is_space(c)) {
+            continue;
+        }
+
+        if (state == SCAN_VALUE) {
+            start = i;
+            state = SCAN_IN_VALUE;
+        } else if (state == SCAN_IN_VALUE && top && (c == ',' || c == '}')) {
+            end = last + 1;
+            state = SCAN_FOUND;
+        }
+
+        switch (c) {
+            case '"':
+            case '\'': {
+                gsize next = json_scan_string(line, len, i);
+                if (!next) {
+                    return -1;
+                }
+
+                if (top && key) {
+                    key = FALSE;
+                    if (state == SCAN_KEY && next - i - 2 == member_len
+                            && !memcmp(line + i + 1, member, member_len)) {
+                        state = SCAN_COLON;
+                    }
+                }
+                i = next - 1;
+            }
+            break;
+
+            case ':':
+                if (top && state == SCAN_COLON) {
+                    state = SCAN_VALUE;
+                }
+            break;
+
+            case ',':
+                if (top) {
+                    key = TRUE;
+                }
+            break;
+
+            case '{':
+                braces++;
+                if (braces == 1 && !brackets) {
+                    key = TRUE;
+                }
+            break;
+
+            case '}':
+                braces--;
+            break;
+
+            case '[':
+                brackets++;
+            break;
+
+            case ']':
+                brackets--;
+            break;
+        }
+
+        last = i;
+        if (braces < 0 || brackets < 0) {
+            return -1;
+        }
+        if (!braces && !brackets) {
+            i++;
+            break;
+        }
+    }
+
+    if (braces || brackets) {
+        return -1;
+    }
+    while (i < len && json_is_space(line[i])) {
+        i++;
+    }
+    if (i != len) {
+        return -1;
+    }
+
+    if (state != SCAN_FOUND) {
+        return 0;
+    }
+
+    if (value) {
+        *value = line + start;
+    }
+    if (value_len) {
+        *value_len = end - start;
+    }
+    return 1;
+}
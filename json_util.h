@@ -15,4 +15,16 @@ gboolean object_matches(JsonNode *node, JsonNode *match);
 gboolean object_matches_json(JsonNode *node, const gchar *match);
 gboolean object_matches_match_array(JsonNode *node, JsonNode *match_array);
 
+// Append str as a quoted and escaped json string, or null
+void json_append_string(GString *out, const gchar *str);
+
+/*
+ * Look up a top-level member of the json object in line without building a
+ * DOM. Returns -1 if line doesn't hold exactly one object, 0 if the member
+ * is missing and 1 if found. The raw text of the value is returned in
+ * value and value_len, if not NULL.
+ */
+int json_scan_member(const gchar *line, gsize len, const gchar *member,
+                     const gchar **value, gsize *value_len);
+
 #endif // JSON_UTIL_H
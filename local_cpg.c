@@ -0,0 +1,350 @@
+/*
+ * COLO background daemon local cpg client
+ *
+ * Copyright (c) Lukas Straub <lukasstraub2@web.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+// For SOCK_CLOEXEC
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <glib-2.0/glib.h>
+
+#include <corosync/cpg.h>
+#include <corosync/corotypes.h>
+
+#include "local_cpg.h"
+
+/*
+ * Drop-in replacement for libcpg and libcorosync_common, talking to
+ * cpg_broker instead of corosync. Link this instead of -lcpg.
+ */
+
+typedef struct LocalCpg {
+    int fd;
+    void *context;
+    cpg_model_v1_data_t model;
+    uint32_t nodeid, pid;
+    struct cpg_name group;
+} LocalCpg;
+
+static LocalCpg *local_cpg_get(cpg_handle_t handle) {
+    return (LocalCpg *) (uintptr_t) handle;
+}
+
+static int local_cpg_connect(void) {
+    struct sockaddr_un address = { 0 };
+    const char *path = getenv(LOCAL_CPG_SOCKET_ENV);
+    int fd;
+
+    if (!path) {
+        path = LOCAL_CPG_SOCKET;
+    }
+
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(address.sun_path, path);
+    address.sun_family = AF_UNIX;
+
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    if (connect(fd, (const struct sockaddr *) &address, sizeof(address)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static cs_error_t local_cpg_send(LocalCpg *cpg, uint32_t type,
+                                 const struct iovec *iovec,
+                                 unsigned int iov_len) {
+    LocalCpgHeader header = {
+        .type = type,
+        .nodeid = cpg->nodeid,
+        .pid = cpg->pid
+    };
+    struct iovec vec[iov_len + 1];
+    struct msghdr msg = { 0 };
+    ssize_t ret;
+
+    vec[0].iov_base = &header;
+    vec[0].iov_len = sizeof(header);
+    for (unsigned int i = 0; i < iov_len; i++) {
+        vec[i + 1] = iovec[i];
+        header.len += iovec[i].iov_len;
+    }
+
+    if (sizeof(header) + header.len > LOCAL_CPG_FRAME_MAX) {
+        return CS_ERR_INVALID_PARAM;
+    }
+
+    msg.msg_iov = vec;
+    msg.msg_iovlen = iov_len + 1;
+
+    do {
+        ret = sendmsg(cpg->fd, &msg, MSG_NOSIGNAL);
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret < 0) {
+        return CS_ERR_LIBRARY;
+    }
+
+    return CS_OK;
+}
+
+static void local_cpg_addresses(struct cpg_address *out,
+                                const LocalCpgAddress *in, uint32_t entries) {
+    for (uint32_t i = 0; i < entries; i++) {
+        out[i].nodeid = in[i].nodeid;
+        out[i].pid = in[i].pid;
+        out[i].reason = in[i].reason;
+    }
+}
+
+static cs_error_t local_cpg_confchg(LocalCpg *cpg, const guint8 *payload,
+                                    size_t len) {
+    LocalCpgConfchg confchg;
+    const LocalCpgAddress *addresses;
+    struct cpg_address *member_list, *left_list, *joined_list;
+    size_t entries;
+
+    if (len < sizeof(confchg)) {
+        return CS_ERR_MESSAGE_ERROR;
+    }
+    memcpy(&confchg, payload, sizeof(confchg));
+
+    entries = (size_t) confchg.member_entries + confchg.left_entries
+              + confchg.joined_entries;
+    if (len != sizeof(confchg) + entries * sizeof(LocalCpgAddress)) {
+        return CS_ERR_MESSAGE_ERROR;
+    }
+    addresses = (const LocalCpgAddress *) (payload + sizeof(confchg));
+
+    member_list = g_new(struct cpg_address, entries + 1);
+    left_list = member_list + confchg.member_entries;
+    joined_list = left_list + confchg.left_entries;
+    local_cpg_addresses(member_list, addresses, entries);
+
+    cpg->model.cpg_confchg_fn((uintptr_t) cpg, &cpg->group,
+                              member_list, confchg.member_entries,
+                              left_list, confchg.left_entries,
+                              joined_list, confchg.joined_entries);
+
+    g_free(member_list);
+    return CS_OK;
+}
+
+static cs_error_t local_cpg_totem(LocalCpg *cpg, const guint8 *payload,
+                                  size_t len) {
+    LocalCpgTotem totem;
+    struct cpg_ring_id ring_id;
+
+    if (len != sizeof(totem)) {
+        return CS_ERR_MESSAGE_ERROR;
+    }
+    memcpy(&totem, payload, sizeof(totem));
+
+    if (!cpg->model.cpg_totem_confchg_fn) {
+        return CS_OK;
+    }
+
+    ring_id.nodeid = totem.nodeid;
+    ring_id.seq = totem.seq;
+    cpg->model.cpg_totem_confchg_fn((uintptr_t) cpg, ring_id, 0, NULL);
+    return CS_OK;
+}
+
+static cs_error_t local_cpg_dispatch_one(LocalCpg *cpg, gboolean block) {
+    LocalCpgHeader header;
+    guint8 *buf;
+    ssize_t size;
+    cs_error_t ret;
+    int flags = block ? 0 : MSG_DONTWAIT;
+
+    do {
+        size = recv(cpg->fd, NULL, 0, MSG_PEEK | MSG_TRUNC | flags);
+    } while (size < 0 && errno == EINTR);
+
+    if (size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return CS_ERR_TRY_AGAIN;
+    } else if (size <= 0) {
+        return CS_ERR_LIBRARY;
+    }
+
+    buf = g_malloc(size);
+    size = recv(cpg->fd, buf, size, 0);
+    if (size < (ssize_t) sizeof(header)) {
+        g_free(buf);
+        return CS_ERR_LIBRARY;
+    }
+
+    memcpy(&header, buf, sizeof(header));
+    if (header.len != size - sizeof(header)) {
+        g_free(buf);
+        return CS_ERR_MESSAGE_ERROR;
+    }
+
+    switch (header.type) {
+        case LOCAL_CPG_DELIVER:
+            cpg->model.cpg_deliver_fn((uintptr_t) cpg, &cpg->group,
+                                      header.nodeid, header.pid,
+                                      buf + sizeof(header), header.len);
+            ret = CS_OK;
+        break;
+
+        case LOCAL_CPG_CONFCHG:
+            ret = local_cpg_confchg(cpg, buf + sizeof(header), header.len);
+        break;
+
+        case LOCAL_CPG_TOTEM:
+            ret = local_cpg_totem(cpg, buf + sizeof(header), header.len);
+        break;
+
+        default:
+            ret = CS_ERR_MESSAGE_ERROR;
+        break;
+    }
+
+    g_free(buf);
+    return ret;
+}
+
+cs_error_t cpg_model_initialize(cpg_handle_t *handle, cpg_model_t model,
+                                cpg_model_data_t *model_data, void *context) {
+    LocalCpg *cpg;
+    const char *nodeid;
+
+    if (model != CPG_MODEL_V1 || !model_data) {
+        return CS_ERR_INVALID_PARAM;
+    }
+
+    cpg = g_new0(LocalCpg, 1);
+    cpg->context = context;
+    memcpy(&cpg->model, model_data, sizeof(cpg->model));
+    cpg->pid = getpid();
+
+    nodeid = getenv(LOCAL_CPG_NODEID_ENV);
+    cpg->nodeid = nodeid ? strtoul(nodeid, NULL, 10) : cpg->pid;
+
+    cpg->fd = local_cpg_connect();
+    if (cpg->fd < 0) {
+        g_free(cpg);
+        return CS_ERR_LIBRARY;
+    }
+
+    *handle = (uintptr_t) cpg;
+    return CS_OK;
+}
+
+cs_error_t cpg_finalize(cpg_handle_t handle) {
+    LocalCpg *cpg = local_cpg_get(handle);
+
+    close(cpg->fd);
+    g_free(cpg);
+    return CS_OK;
+}
+
+cs_error_t cpg_fd_get(cpg_handle_t handle, int *fd) {
+    *fd = local_cpg_get(handle)->fd;
+    return CS_OK;
+}
+
+cs_error_t cpg_context_get(cpg_handle_t handle, void **context) {
+    *context = local_cpg_get(handle)->context;
+    return CS_OK;
+}
+
+cs_error_t cpg_context_set(cpg_handle_t handle, void *context) {
+    local_cpg_get(handle)->context = context;
+    return CS_OK;
+}
+
+cs_error_t cpg_local_get(cpg_handle_t handle, unsigned int *local_nodeid) {
+    *local_nodeid = local_cpg_get(handle)->nodeid;
+    return CS_OK;
+}
+
+cs_error_t cpg_join(cpg_handle_t handle, const struct cpg_name *group) {
+    LocalCpg *cpg = local_cpg_get(handle);
+    struct iovec vec;
+
+    if (group->length > sizeof(group->value)) {
+        return CS_ERR_INVALID_PARAM;
+    }
+
+    cpg->group = *group;
+    vec.iov_base = (void *) group->value;
+    vec.iov_len = group->length;
+    return local_cpg_send(cpg, LOCAL_CPG_JOIN, &vec, 1);
+}
+
+cs_error_t cpg_mcast_joined(cpg_handle_t handle,
+                            G_GNUC_UNUSED cpg_guarantee_t guarantee,
+                            const struct iovec *iovec, unsigned int iov_len) {
+    // The broker always delivers in agreed order
+    return local_cpg_send(local_cpg_get(handle), LOCAL_CPG_MCAST,
+                          iovec, iov_len);
+}
+
+cs_error_t cpg_dispatch(cpg_handle_t handle,
+                        cs_dispatch_flags_t dispatch_types) {
+    LocalCpg *cpg = local_cpg_get(handle);
+    cs_error_t ret;
+
+    switch (dispatch_types) {
+        case CS_DISPATCH_ONE:
+            return local_cpg_dispatch_one(cpg, TRUE);
+
+        case CS_DISPATCH_ONE_NONBLOCKING:
+            ret = local_cpg_dispatch_one(cpg, FALSE);
+        break;
+
+        case CS_DISPATCH_BLOCKING:
+            do {
+                ret = local_cpg_dispatch_one(cpg, TRUE);
+            } while (ret == CS_OK);
+        break;
+
+        case CS_DISPATCH_ALL:
+        default:
+            do {
+                ret = local_cpg_dispatch_one(cpg, FALSE);
+            } while (ret == CS_OK);
+        break;
+    }
+
+    if (ret == CS_ERR_TRY_AGAIN) {
+        return CS_OK;
+    }
+    return ret;
+}
+
+const char *cs_strerror(cs_error_t err) {
+    switch (err) {
+        case CS_OK: return "success";
+        case CS_ERR_LIBRARY: return "CS_ERR_LIBRARY";
+        case CS_ERR_TRY_AGAIN: return "CS_ERR_TRY_AGAIN";
+        case CS_ERR_INVALID_PARAM: return "CS_ERR_INVALID_PARAM";
+        case CS_ERR_NO_MEMORY: return "CS_ERR_NO_MEMORY";
+        case CS_ERR_BAD_HANDLE: return "CS_ERR_BAD_HANDLE";
+        case CS_ERR_NOT_EXIST: return "CS_ERR_NOT_EXIST";
+        case CS_ERR_MESSAGE_ERROR: return "CS_ERR_MESSAGE_ERROR";
+        default: return "unknown error";
+    }
+}
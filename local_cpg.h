@@ -0,0 +1,73 @@
+/*
+ * COLO background daemon local cpg broker protocol
+ *
+ * Copyright (c) Lukas Straub <lukasstraub2@web.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef LOCAL_CPG_H
+#define LOCAL_CPG_H
+
+#include <stdint.h>
+
+/*
+ * local_cpg.c implements the subset of libcpg used by cpg.c on top of
+ * cpg_broker, so several colod processes on one machine can talk to each
+ * other without corosync. Client and broker exchange frames over a
+ * SOCK_SEQPACKET unix socket. Every frame is a LocalCpgHeader in host byte
+ * order followed by len bytes of payload.
+ */
+
+#define LOCAL_CPG_SOCKET "/tmp/colod_cpg.sock"
+#define LOCAL_CPG_SOCKET_ENV "COLOD_CPG_SOCKET"
+#define LOCAL_CPG_NODEID_ENV "COLOD_CPG_NODEID"
+#define LOCAL_CPG_FRAME_MAX (2*1024*1024)
+
+// Same values as CPG_REASON_* in corosync/cpg.h
+#define LOCAL_CPG_REASON_JOIN 1
+#define LOCAL_CPG_REASON_NODEDOWN 3
+#define LOCAL_CPG_REASON_PROCDOWN 5
+
+typedef enum LocalCpgFrame {
+    // Client to broker, payload is the group name
+    LOCAL_CPG_JOIN,
+    // Client to broker, payload is the message
+    LOCAL_CPG_MCAST,
+    // Client to broker, payload is a control command, see cpg_broker.c
+    LOCAL_CPG_CONTROL,
+    // Broker to client, payload is the message
+    LOCAL_CPG_DELIVER,
+    // Broker to client, payload is a LocalCpgConfchg and the address lists
+    LOCAL_CPG_CONFCHG,
+    // Broker to client, payload is a LocalCpgTotem
+    LOCAL_CPG_TOTEM
+} LocalCpgFrame;
+
+typedef struct LocalCpgHeader {
+    uint32_t type;
+    uint32_t nodeid;
+    uint32_t pid;
+    uint32_t len;
+} LocalCpgHeader;
+
+typedef struct LocalCpgAddress {
+    uint32_t nodeid;
+    uint32_t pid;
+    uint32_t reason;
+} LocalCpgAddress;
+
+typedef struct LocalCpgConfchg {
+    uint32_t member_entries;
+    uint32_t left_entries;
+    uint32_t joined_entries;
+} LocalCpgConfchg;
+
+typedef struct LocalCpgTotem {
+    uint32_t nodeid;
+    uint32_t pad;
+    uint64_t seq;
+} LocalCpgTotem;
+
+#endif // LOCAL_CPG_H
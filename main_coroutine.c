@@ -8,6 +8,8 @@
  */
 
 #include <stdlib.h>
+#include <arpa/inet.h>
+#include <unistd.h>
 
 #include <glib-2.0/glib.h>
 
@@ -22,6 +24,10 @@
 #include "eventqueue.h"
 #include "raise_timeout_coroutine.h"
 #include "yellow_coroutine.h"
+#include "heartbeat.h"
+#include "qemu_state.h"
+#include "checkpoint.h"
+#include "status_page.h"
 
 typedef enum MainState {
     STATE_SECONDARY_STARTUP,
@@ -36,9 +42,31 @@ typedef enum MainState {
     STATE_FAILED_PEER_FAILOVER,
     STATE_FAILED,
     STATE_QUIT,
-    STATE_AUTOQUIT
+    STATE_AUTOQUIT,
+    STATE_MAX
 } MainState;
 
+enum {
+    SNAPSHOT_PRIMARY = 1 << 0,
+    SNAPSHOT_REPLICATION = 1 << 1,
+    SNAPSHOT_FAILED = 1 << 2,
+    SNAPSHOT_PEER_FAILOVER = 1 << 3,
+    SNAPSHOT_PEER_FAILED = 1 << 4,
+    SNAPSHOT_YELLOW = 1 << 5
+};
+
+/*
+ * Compact view of our state that is multicast to the peer whenever it
+ * changes. The epoch is random per daemon start, so a restarted peer
+ * with a reset version counter is still accepted.
+ */
+typedef struct SnapshotPayload {
+    uint32_t epoch;
+    uint32_t version;
+    uint32_t state;
+    uint32_t flags;
+} SnapshotPayload;
+
 struct ColodMainCoroutine {
     Coroutine coroutine;
     gboolean quit;
@@ -48,18 +76,65 @@ struct ColodMainCoroutine {
     ColodQmpState *qmp;
     ColodRaiseCoroutine *raise_timeout_coroutine;
     YellowCoroutine *yellow_co;
+    ColodHeartbeat *heartbeat;
+    QemuState *qemu_state;
 
     MainState state;
     gboolean transitioning;
     gboolean failed, peer_failed;
-    gboolean yellow, peer_yellow;
+    gboolean yellow, peer_yellow, peer_late;
     gboolean qemu_quit;
     gboolean peer_failover;
     gboolean primary;
     gboolean replication;
     gchar *peer;
+
+    guint snapshot_source_id;
+    gboolean snapshot_sent;
+    SnapshotPayload snapshot;
+    ColodPeerState peer_state;
+    uint32_t peer_epoch;
+    // Waiting for a restarted peer, see --peer_restart_grace
+    guint peer_grace_source_id;
+
+    /*
+     * Result of the last qemu health check. Concurrent callers wait for
+     * the check in flight and then share its result.
+     */
+    gboolean health_inflight;
+    GQueue health_waiters;
+    guint health_generation, health_seq;
+    gboolean health_valid;
+    gint64 health_time;
+    int health_ret;
+    gboolean health_primary, health_replication;
+    gchar *health_error;
+
+    ColodCallbackHead subscribers;
+    MainState published_state;
+    gboolean published_yellow, published_peer_yellow;
+
+    // NULL unless --checkpoint_interval
+    gchar *checkpoint_path;
+    gchar *checkpoint_written;
+    guint checkpoint_source_id, checkpoint_timer_id;
+    // Checkpoint of the previous daemon, until it is reconciled
+    ColodCheckpoint *resume;
+    // Entered the state from a checkpoint instead of a transition
+    gboolean resumed;
+
+    // NULL unless --status_page
+    ColodStatusPage *status_page;
+    guint64 transitions, failovers;
+    // Wall clock and monotonic time the last failover started, in us
+    gint64 failover_start, failover_start_mono;
+    gint64 failover_end, failover_duration;
+    MainState failover_result;
 };
 
+// Time in ms a resuming daemon waits for the peer to send its snapshot
+#define MAIN_RESUME_PEER_TIMEOUT 2000
+
 #define colod_trace_source(data) \
     _colod_trace_source((data), __func__, __LINE__)
 static void _colod_trace_source(gpointer data, const gchar *func,
@@ -75,16 +150,389 @@ static void _colod_trace_source(gpointer data, const gchar *func,
                 func, line, found_name, current_name);
 }
 
+static const gchar *state_str(MainState state) {
+    switch (state) {
+        case STATE_SECONDARY_STARTUP: return "secondary-startup";
+        case STATE_SECONDARY_WAIT: return "secondary-wait";
+        case STATE_SECONDARY_COLO_RUNNING: return "secondary-colo-running";
+        case STATE_PRIMARY_STARTUP: return "primary-startup";
+        case STATE_PRIMARY_WAIT: return "primary-wait";
+        case STATE_PRIMARY_START_MIGRATION: return "primary-start-migration";
+        case STATE_PRIMARY_COLO_RUNNING: return "primary-colo-running";
+        case STATE_FAILOVER_SYNC: return "failover-sync";
+        case STATE_FAILOVER: return "failover";
+        case STATE_FAILED_PEER_FAILOVER: return "failed-peer-failover";
+        case STATE_FAILED: return "failed";
+        case STATE_QUIT: return "quit";
+        case STATE_AUTOQUIT: return "autoquit";
+        case STATE_MAX: break;
+    }
+    return "unknown";
+}
+
+static MainState state_from_str(const gchar *str) {
+    for (MainState state = 0; state < STATE_MAX; state++) {
+        if (!g_strcmp0(state_str(state), str)) {
+            return state;
+        }
+    }
+    return STATE_MAX;
+}
+
 void colod_query_status(ColodMainCoroutine *this, ColodState *ret) {
+    ret->state = state_str(this->state);
     ret->primary = this->primary;
     ret->replication = this->replication;
     ret->failed = this->failed;
     ret->peer_failover = this->peer_failover;
     ret->peer_failed = this->peer_failed;
+    ret->yellow = this->yellow;
+}
+
+void colod_query_peer_state(ColodMainCoroutine *this, ColodPeerState *ret) {
+    *ret = this->peer_state;
+}
+
+static void snapshot_build(ColodMainCoroutine *this, SnapshotPayload *ret) {
+    uint32_t flags = 0;
+
+    flags |= (this->primary ? SNAPSHOT_PRIMARY : 0);
+    flags |= (this->replication ? SNAPSHOT_REPLICATION : 0);
+    flags |= (this->failed ? SNAPSHOT_FAILED : 0);
+    flags |= (this->peer_failover ? SNAPSHOT_PEER_FAILOVER : 0);
+    flags |= (this->peer_failed ? SNAPSHOT_PEER_FAILED : 0);
+    flags |= (this->yellow ? SNAPSHOT_YELLOW : 0);
+
+    ret->epoch = this->snapshot.epoch;
+    ret->version = this->snapshot.version;
+    ret->state = htonl(this->state);
+    ret->flags = htonl(flags);
+}
+
+static gboolean snapshot_publish_cb(gpointer data) {
+    ColodMainCoroutine *this = data;
+    SnapshotPayload snapshot;
+
+    this->snapshot_source_id = 0;
+
+    snapshot_build(this, &snapshot);
+    if (this->snapshot_sent && !memcmp(&snapshot, &this->snapshot,
+                                       sizeof(snapshot))) {
+        return G_SOURCE_REMOVE;
+    }
+
+    snapshot.version = htonl(ntohl(snapshot.version) + 1);
+    this->snapshot = snapshot;
+    this->snapshot_sent = TRUE;
+    colod_cpg_send_payload(this->ctx->cpg, MESSAGE_SNAPSHOT, &snapshot,
+                           sizeof(snapshot));
+
+    return G_SOURCE_REMOVE;
+}
+
+void colod_add_notify_change(ColodMainCoroutine *this,
+                             ColodChangeCallback _func, gpointer user_data) {
+    ColodCallbackFunc func = (ColodCallbackFunc) _func;
+    colod_callback_add(&this->subscribers, func, user_data);
+}
+
+void colod_del_notify_change(ColodMainCoroutine *this,
+                             ColodChangeCallback _func, gpointer user_data) {
+    ColodCallbackFunc func = (ColodCallbackFunc) _func;
+    colod_callback_del(&this->subscribers, func, user_data);
+}
+
+/*
+ * Send a change to all subscribers, formatted like a qmp event. data must
+ * be a json object.
+ */
+static void colod_publish(ColodMainCoroutine *this, const gchar *event,
+                          const gchar *data) {
+    ColodCallback *entry, *next_entry;
+    gint64 now = g_get_real_time();
+    gchar *line;
+
+    if (QLIST_EMPTY(&this->subscribers)) {
+        return;
+    }
+
+    line = g_strdup_printf("{\"event\": \"%s\", \"data\": %s,"
+                           " \"timestamp\": {\"seconds\": %" G_GINT64_FORMAT ","
+                           " \"microseconds\": %" G_GINT64_FORMAT "}}\n",
+                           event, data, now / G_USEC_PER_SEC,
+                           now % G_USEC_PER_SEC);
+
+    QLIST_FOREACH_SAFE(entry, &this->subscribers, next, next_entry) {
+        ColodChangeCallback func = (ColodChangeCallback) entry->func;
+        func(entry->user_data, line);
+    }
+
+    g_free(line);
+}
+
+static gboolean colod_peer_yellow(ColodMainCoroutine *this);
+static void colod_publish_changes(ColodMainCoroutine *this) {
+    gboolean peer_yellow = colod_peer_yellow(this);
+    gchar *data;
+
+    if (this->state != this->published_state) {
+        this->published_state = this->state;
+        data = g_strdup_printf("{\"state\": \"%s\"}", state_str(this->state));
+        colod_publish(this, "COLOD_STATE", data);
+        g_free(data);
+    }
+
+    if (this->yellow != this->published_yellow
+            || peer_yellow != this->published_peer_yellow) {
+        this->published_yellow = this->yellow;
+        this->published_peer_yellow = peer_yellow;
+        data = g_strdup_printf("{\"yellow\": %s, \"peer-yellow\": %s}",
+                               bool_to_json(this->yellow),
+                               bool_to_json(peer_yellow));
+        colod_publish(this, "COLOD_YELLOW", data);
+        g_free(data);
+    }
+}
+
+static void checkpoint_save(ColodMainCoroutine *this) {
+    const QmpCommands *commands = this->ctx->commands;
+    ColodCheckpoint checkpoint = {
+        .state = (gchar *) state_str(this->state),
+        .primary = this->primary,
+        .replication = this->replication,
+        .failed = this->failed,
+        .peer_failover = this->peer_failover,
+        .peer_failed = this->peer_failed,
+        .yellow = this->yellow,
+        .peer_yellow = colod_peer_yellow(this),
+        .peer = this->peer,
+        .migration_start = commands->migration_start,
+        .migration_switchover = commands->migration_switchover,
+        .failover_primary = commands->failover_primary,
+        .failover_secondary = commands->failover_secondary,
+        .yank_instances = qmp_get_yank_instances(this->qmp)
+    };
+    GError *local_errp = NULL;
+    gchar *serialized;
+
+    // Keep the checkpoint of the previous daemon until we took over, and
+    // don't let a quitting daemon prevent the next one from resuming
+    if (this->resume || this->state == STATE_MAX
+            || this->state == STATE_QUIT) {
+        return;
+    }
+
+    serialized = checkpoint_serialize(&checkpoint);
+    if (!g_strcmp0(serialized, this->checkpoint_written)) {
+        g_free(serialized);
+        return;
+    }
+
+    if (checkpoint_write(this->checkpoint_path, serialized, &local_errp) < 0) {
+        log_error_fmt("Failed to write checkpoint: %s", local_errp->message);
+        g_error_free(local_errp);
+        g_free(serialized);
+        return;
+    }
+
+    g_free(this->checkpoint_written);
+    this->checkpoint_written = serialized;
+}
+
+static gboolean checkpoint_save_cb(gpointer data) {
+    ColodMainCoroutine *this = data;
+
+    this->checkpoint_source_id = 0;
+    checkpoint_save(this);
+    return G_SOURCE_REMOVE;
+}
+
+// Catches configuration changes by the management client
+static gboolean checkpoint_timer_cb(gpointer data) {
+    ColodMainCoroutine *this = data;
+
+    checkpoint_save(this);
+    return G_SOURCE_CONTINUE;
+}
+
+static void status_page_update(ColodMainCoroutine *this) {
+    const ColodPeerState *peer = &this->peer_state;
+    StatusPageData data = {0};
+
+    if (!this->status_page) {
+        return;
+    }
+
+    data.updated = g_get_real_time();
+    data.pid = getpid();
+    data.state = this->state;
+    data.flags |= (this->primary ? STATUS_PAGE_PRIMARY : 0);
+    data.flags |= (this->replication ? STATUS_PAGE_REPLICATION : 0);
+    data.flags |= (this->failed ? STATUS_PAGE_FAILED : 0);
+    data.flags |= (this->peer_failover ? STATUS_PAGE_PEER_FAILOVER : 0);
+    data.flags |= (this->peer_failed ? STATUS_PAGE_PEER_FAILED : 0);
+    data.flags |= (this->yellow ? STATUS_PAGE_YELLOW : 0);
+    data.flags |= (colod_peer_yellow(this) ? STATUS_PAGE_PEER_YELLOW : 0);
+    data.flags |= (this->quit ? STATUS_PAGE_QUIT : 0);
+    g_strlcpy(data.state_name, state_str(this->state),
+              sizeof(data.state_name));
+
+    if (peer->valid) {
+        data.peer_valid = 1;
+        data.peer_version = peer->version;
+        data.peer_flags |= (peer->state.primary ? STATUS_PAGE_PRIMARY : 0);
+        data.peer_flags |= (peer->state.replication
+                            ? STATUS_PAGE_REPLICATION : 0);
+        data.peer_flags |= (peer->state.failed ? STATUS_PAGE_FAILED : 0);
+        data.peer_flags |= (peer->state.peer_failover
+                            ? STATUS_PAGE_PEER_FAILOVER : 0);
+        data.peer_flags |= (peer->state.peer_failed
+                            ? STATUS_PAGE_PEER_FAILED : 0);
+        data.peer_flags |= (peer->state.yellow ? STATUS_PAGE_YELLOW : 0);
+        g_strlcpy(data.peer_state_name, peer->state.state,
+                  sizeof(data.peer_state_name));
+    }
+
+    // Gone already while the daemon shuts down
+    if (this->yellow_co) {
+        YellowStatus yellow;
+
+        yellow_query(this->yellow_co, &yellow);
+        data.yellow_score = yellow.score;
+        data.yellow_penalty = yellow.penalty;
+        data.yellow_suppressed = yellow.suppressed;
+    }
+    if (this->heartbeat) {
+        HeartbeatStats stats;
+
+        heartbeat_query(this->heartbeat, &stats);
+        data.heartbeat_missed = stats.missed;
+        data.heartbeat_samples = stats.samples;
+        data.heartbeat_srtt = stats.srtt;
+    }
+
+    data.failover_start = this->failover_start;
+    data.failover_end = this->failover_end;
+    data.failover_duration = this->failover_duration;
+    if (this->failover_end) {
+        g_strlcpy(data.failover_result, state_str(this->failover_result),
+                  sizeof(data.failover_result));
+    }
+
+    data.transitions = this->transitions;
+    data.failovers = this->failovers;
+
+    status_page_write(this->status_page, &data);
+}
+
+static gboolean state_is_failover(MainState state) {
+    return state == STATE_FAILOVER_SYNC || state == STATE_FAILOVER;
+}
+
+// Track the duration of failovers for the status page
+static void colod_account_transition(ColodMainCoroutine *this,
+                                     MainState old_state,
+                                     MainState new_state) {
+    this->transitions++;
+
+    if (state_is_failover(new_state) && !state_is_failover(old_state)) {
+        this->failover_start = g_get_real_time();
+        this->failover_start_mono = g_get_monotonic_time();
+        this->failover_end = 0;
+        this->failover_duration = 0;
+    } else if (state_is_failover(old_state) && !state_is_failover(new_state)
+               && this->failover_start) {
+        this->failovers++;
+        this->failover_end = g_get_real_time();
+        this->failover_duration = g_get_monotonic_time()
+                                  - this->failover_start_mono;
+        this->failover_result = new_state;
+    }
+}
+
+/*
+ * Publishing is deferred, so all state changes done before the main
+ * coroutine yields end up in a single snapshot.
+ */
+static void colod_state_changed(ColodMainCoroutine *this) {
+    colod_publish_changes(this);
+    status_page_update(this);
+
+    if (this->checkpoint_path && !this->checkpoint_source_id) {
+        this->checkpoint_source_id = g_idle_add(checkpoint_save_cb, this);
+        g_source_set_name_by_id(this->checkpoint_source_id,
+                                "save checkpoint");
+    }
+
+    if (this->snapshot_source_id) {
+        return;
+    }
+
+    this->snapshot_source_id = g_idle_add(snapshot_publish_cb, this);
+    g_source_set_name_by_id(this->snapshot_source_id, "publish snapshot");
+}
+
+static void snapshot_receive(ColodMainCoroutine *this,
+                             const SnapshotPayload *snapshot) {
+    ColodPeerState *peer = &this->peer_state;
+    uint32_t version = ntohl(snapshot->version);
+    uint32_t state = ntohl(snapshot->state);
+    uint32_t flags = ntohl(snapshot->flags);
+
+    if (peer->valid && this->peer_epoch == snapshot->epoch
+            && version <= peer->version) {
+        return;
+    }
+
+    this->peer_epoch = snapshot->epoch;
+    peer->valid = TRUE;
+    peer->version = version;
+    peer->state.state = state_str(state < STATE_MAX ? state : STATE_MAX);
+    peer->state.primary = !!(flags & SNAPSHOT_PRIMARY);
+    peer->state.replication = !!(flags & SNAPSHOT_REPLICATION);
+    peer->state.failed = !!(flags & SNAPSHOT_FAILED);
+    peer->state.peer_failover = !!(flags & SNAPSHOT_PEER_FAILOVER);
+    peer->state.peer_failed = !!(flags & SNAPSHOT_PEER_FAILED);
+    peer->state.yellow = !!(flags & SNAPSHOT_YELLOW);
+    status_page_update(this);
+
+    if (!QLIST_EMPTY(&this->subscribers)) {
+        gchar *data;
+        data = g_strdup_printf("{\"state\": \"%s\", \"version\": %u,"
+                               " \"primary\": %s, \"replication\": %s,"
+                               " \"failed\": %s, \"peer-failover\": %s,"
+                               " \"peer-failed\": %s, \"yellow\": %s}",
+                               peer->state.state, peer->version,
+                               bool_to_json(peer->state.primary),
+                               bool_to_json(peer->state.replication),
+                               bool_to_json(peer->state.failed),
+                               bool_to_json(peer->state.peer_failover),
+                               bool_to_json(peer->state.peer_failed),
+                               bool_to_json(peer->state.yellow));
+        colod_publish(this, "COLOD_PEER", data);
+        g_free(data);
+    }
+}
+
+void colod_query_heartbeat(ColodMainCoroutine *this, HeartbeatStats *ret) {
+    heartbeat_query(this->heartbeat, ret);
+}
+
+void colod_query_yellow(ColodMainCoroutine *this, YellowStatus *ret) {
+    yellow_query(this->yellow_co, ret);
+}
+
+/*
+ * The peer counts as yellow if it told us so or if it stopped sending
+ * heartbeats, in both cases we must not fail because of our own yellow.
+ */
+static gboolean colod_peer_yellow(ColodMainCoroutine *this) {
+    return this->peer_yellow || this->peer_late;
 }
 
 void colod_peer_failed(ColodMainCoroutine *this) {
     this->peer_failed = TRUE;
+    colod_state_changed(this);
 }
 
 void colod_set_peer(ColodMainCoroutine *this, const gchar *peer) {
@@ -92,6 +540,7 @@ void colod_set_peer(ColodMainCoroutine *this, const gchar *peer) {
     this->peer = g_strdup(peer);
     this->peer_failed = FALSE;
     this->peer_yellow = FALSE;
+    colod_state_changed(this);
 }
 
 const gchar *colod_get_peer(ColodMainCoroutine *this) {
@@ -182,6 +631,8 @@ static void _colod_event_queue(ColodMainCoroutine *this, ColodEvent event,
     colod_trace("%s:%u: queued %s (%s)\n", func, line, event_str(event),
                 reason);
 
+    colod_state_changed(this);
+
     if (!this->wake_source_id) {
         if (!eventqueue_pending(this->queue)
                 || eventqueue_event_interrupting(this->queue, event)) {
@@ -200,6 +651,16 @@ static void _colod_event_queue(ColodMainCoroutine *this, ColodEvent event,
     }
 
     eventqueue_add(this->queue, event, NULL);
+
+    if (!QLIST_EMPTY(&this->subscribers)) {
+        GString *data = g_string_new(NULL);
+        g_string_append_printf(data, "{\"event\": \"%s\", \"reason\": ",
+                               event_str(event));
+        json_append_string(data, reason);
+        g_string_append(data, "}");
+        colod_publish(this, "COLOD_EVENT", data->str);
+        g_string_free(data, TRUE);
+    }
 }
 
 #define colod_event_wait(coroutine, ctx) \
@@ -283,17 +744,25 @@ int _colod_yank_co(Coroutine *coroutine, ColodMainCoroutine *this, GError **errp
     return ret;
 }
 
-ColodQmpResult *_colod_execute_nocheck_co(Coroutine *coroutine,
-                                          ColodMainCoroutine *this,
-                                          GError **errp,
-                                          const gchar *command) {
+static ColodQmpResult *__colod_execute_nocheck_co(Coroutine *coroutine,
+                                                 ColodMainCoroutine *this,
+                                                 GError **errp,
+                                                 const gchar *command,
+                                                 QmpRole role,
+                                                 gboolean raw) {
     ColodQmpResult *result;
     int ret;
     GError *local_errp = NULL;
 
     colod_watchdog_refresh(this->ctx->watchdog);
 
-    result = _qmp_execute_nocheck_co(coroutine, this->qmp, &local_errp, command);
+    if (raw) {
+        assert(role == QMP_ROLE_CLIENT);
+        result = _qmp_relay_co(coroutine, this->qmp, &local_errp, command);
+    } else {
+        result = _qmp_execute_role_co(coroutine, this->qmp, role, &local_errp,
+                                      command);
+    }
     if (coroutine->yield) {
         return NULL;
     }
@@ -319,13 +788,31 @@ ColodQmpResult *_colod_execute_nocheck_co(Coroutine *coroutine,
     return result;
 }
 
-ColodQmpResult *_colod_execute_co(Coroutine *coroutine,
-                                  ColodMainCoroutine *this,
-                                  GError **errp,
-                                  const gchar *command) {
+ColodQmpResult *_colod_execute_nocheck_co(Coroutine *coroutine,
+                                          ColodMainCoroutine *this,
+                                          GError **errp,
+                                          const gchar *command) {
+    return __colod_execute_nocheck_co(coroutine, this, errp, command,
+                                      QMP_ROLE_CRITICAL, FALSE);
+}
+
+ColodQmpResult *_colod_relay_co(Coroutine *coroutine,
+                                ColodMainCoroutine *this,
+                                GError **errp,
+                                const gchar *command) {
+    return __colod_execute_nocheck_co(coroutine, this, errp, command,
+                                      QMP_ROLE_CLIENT, TRUE);
+}
+
+static ColodQmpResult *__colod_execute_co(Coroutine *coroutine,
+                                         ColodMainCoroutine *this,
+                                         GError **errp,
+                                         const gchar *command,
+                                         QmpRole role) {
     ColodQmpResult *result;
 
-    result = _colod_execute_nocheck_co(coroutine, this, errp, command);
+    result = __colod_execute_nocheck_co(coroutine, this, errp, command, role,
+                                        FALSE);
     if (coroutine->yield) {
         return NULL;
     }
@@ -343,6 +830,24 @@ ColodQmpResult *_colod_execute_co(Coroutine *coroutine,
     return result;
 }
 
+ColodQmpResult *_colod_execute_co(Coroutine *coroutine,
+                                  ColodMainCoroutine *this,
+                                  GError **errp,
+                                  const gchar *command) {
+    return __colod_execute_co(coroutine, this, errp, command,
+                              QMP_ROLE_CRITICAL);
+}
+
+// Health checks use their own monitor if one is configured
+#define colod_execute_health_co(...) \
+    co_wrap(_colod_execute_health_co(__VA_ARGS__))
+static ColodQmpResult *_colod_execute_health_co(Coroutine *coroutine,
+                                                ColodMainCoroutine *this,
+                                                GError **errp,
+                                                const gchar *command) {
+    return __colod_execute_co(coroutine, this, errp, command, QMP_ROLE_HEALTH);
+}
+
 
 #define colod_execute_array_co(...) \
     co_wrap(_colod_execute_array_co(__VA_ARGS__))
@@ -401,14 +906,6 @@ static int _colod_execute_array_co(Coroutine *coroutine, ColodMainCoroutine *thi
     return 0;
 }
 
-static gboolean qemu_runnng(const gchar *status) {
-    return !strcmp(status, "running")
-            || !strcmp(status, "finish-migrate")
-            || !strcmp(status, "colo")
-            || !strcmp(status, "prelaunch")
-            || !strcmp(status, "paused");
-}
-
 #define qemu_query_status_co(...) \
     co_wrap(_qemu_query_status_co(__VA_ARGS__))
 static int _qemu_query_status_co(Coroutine *coroutine, ColodMainCoroutine *this,
@@ -416,19 +913,21 @@ static int _qemu_query_status_co(Coroutine *coroutine, ColodMainCoroutine *this,
                                  GError **errp) {
     struct {
         ColodQmpResult *qemu_status, *colo_status;
+        guint seq;
     } *co;
 
     co_frame(co, sizeof(*co));
     co_begin(int, -1);
 
-    co_recurse(CO qemu_status = colod_execute_co(coroutine, this, errp,
-                                                 "{'execute': 'query-status'}\n"));
+    CO seq = qemu_state_seq(this->qemu_state);
+    co_recurse(CO qemu_status = colod_execute_health_co(coroutine, this, errp,
+                                                        "{'execute': 'query-status'}\n"));
     if (!CO qemu_status) {
         return -1;
     }
 
-    co_recurse(CO colo_status = colod_execute_co(coroutine, this, errp,
-                                                 "{'execute': 'query-colo-status'}\n"));
+    co_recurse(CO colo_status = colod_execute_health_co(coroutine, this, errp,
+                                                        "{'execute': 'query-colo-status'}\n"));
     if (!CO colo_status) {
         qmp_result_free(CO qemu_status);
         return -1;
@@ -451,50 +950,46 @@ static int _qemu_query_status_co(Coroutine *coroutine, ColodMainCoroutine *this,
         return -1;
     }
 
-    if (!strcmp(status, "inmigrate") || !strcmp(status, "shutdown")) {
-        *primary = FALSE;
-        *replication = FALSE;
-    } else if (qemu_runnng(status) && !strcmp(colo_mode, "none")
-               && (!strcmp(colo_reason, "none")
-                   || !strcmp(colo_reason, "request"))) {
-        *primary = TRUE;
-        *replication = FALSE;
-    } else if (qemu_runnng(status) &&!strcmp(colo_mode, "primary")) {
-        *primary = TRUE;
-        *replication = TRUE;
-    } else if (qemu_runnng(status) && !strcmp(colo_mode, "secondary")) {
-        *primary = FALSE;
-        *replication = TRUE;
-    } else {
+    if (qemu_state_classify(status, colo_mode, colo_reason, primary,
+                            replication, NULL) < 0) {
         colod_error_set(errp, "Unknown qemu status: %s, %s",
                         CO qemu_status->line, CO colo_status->line);
+        qemu_state_invalidate(this->qemu_state);
         qmp_result_free(CO qemu_status);
         qmp_result_free(CO colo_status);
         return -1;
     }
 
+    if (qemu_state_reconcile(this->qemu_state, CO seq, status, colo_mode,
+                             colo_reason) < 0) {
+        colod_syslog(LOG_WARNING, "qemu state mirror was out of sync: %s, %s",
+                     CO qemu_status->line, CO colo_status->line);
+    }
+
     qmp_result_free(CO qemu_status);
     qmp_result_free(CO colo_status);
     return 0;
 }
 
-int _colod_check_health_co(Coroutine *coroutine, ColodMainCoroutine *this,
-                           GError **errp) {
-    gboolean primary;
-    gboolean replication;
-    int ret;
-    GError *local_errp = NULL;
+/*
+ * Called whenever qemu's state may have changed, so the next health check
+ * asks qemu again.
+ */
+static void colod_health_invalidate(ColodMainCoroutine *this) {
+    this->health_generation++;
+    this->health_valid = FALSE;
+}
 
-    ret = _qemu_query_status_co(coroutine, this, &primary, &replication,
-                                &local_errp);
-    if (coroutine->yield) {
-        return -1;
-    }
-    if (ret < 0) {
-        colod_event_queue(this, EVENT_FAILED, local_errp->message);
-        g_propagate_error(errp, local_errp);
-        return -1;
-    }
+static gboolean colod_health_fresh(ColodMainCoroutine *this) {
+    gint64 ttl = (gint64) this->ctx->health_cache_ttl * 1000;
+
+    return this->health_valid
+            && g_get_monotonic_time() - this->health_time < ttl;
+}
+
+static int colod_health_compare(ColodMainCoroutine *this, gboolean primary,
+                                gboolean replication, GError **errp) {
+    GError *local_errp = NULL;
 
     if (!this->transitioning &&
             (this->primary != primary ||
@@ -512,6 +1007,95 @@ int _colod_check_health_co(Coroutine *coroutine, ColodMainCoroutine *this,
     return 0;
 }
 
+static int colod_health_cached(ColodMainCoroutine *this, GError **errp) {
+    if (this->health_ret < 0) {
+        colod_error_set(errp, "%s", this->health_error);
+        return -1;
+    }
+
+    return colod_health_compare(this, this->health_primary,
+                                this->health_replication, errp);
+}
+
+static int _colod_health_co(Coroutine *coroutine, ColodMainCoroutine *this,
+                            gboolean use_mirror, GError **errp) {
+    struct {
+        guint generation, seq;
+        gboolean primary, replication;
+    } *co;
+    int ret;
+    GError *local_errp = NULL;
+
+    co_frame(co, sizeof(*co));
+    co_begin(int, -1);
+
+    // Answer from the mirror, it is reconciled at least every interval
+    if (use_mirror && this->ctx->qemu_reconcile_interval
+            && !qmp_get_error(this->qmp, NULL)
+            && qemu_state_get(this->qemu_state,
+                              this->ctx->qemu_reconcile_interval,
+                              &CO primary, &CO replication)) {
+        return colod_health_compare(this, CO primary, CO replication, errp);
+    }
+
+    if (this->health_inflight) {
+        // Join the check in flight instead of starting another one
+        CO seq = this->health_seq;
+        while (this->health_inflight) {
+            g_queue_push_tail(&this->health_waiters, coroutine);
+            co_yield_int(G_SOURCE_REMOVE);
+        }
+
+        if (this->health_valid && this->health_seq != CO seq) {
+            return colod_health_cached(this, errp);
+        }
+    }
+
+    if (colod_health_fresh(this)) {
+        return colod_health_cached(this, errp);
+    }
+
+    this->health_inflight = TRUE;
+    CO generation = this->health_generation;
+    co_recurse(ret = qemu_query_status_co(coroutine, this, &CO primary,
+                                          &CO replication, &local_errp));
+
+    this->health_inflight = FALSE;
+    this->health_seq++;
+    this->health_valid = (CO generation == this->health_generation);
+    this->health_time = g_get_monotonic_time();
+    this->health_ret = ret;
+    this->health_primary = CO primary;
+    this->health_replication = CO replication;
+    g_free(this->health_error);
+    this->health_error = (ret < 0 ? g_strdup(local_errp->message) : NULL);
+
+    while (!g_queue_is_empty(&this->health_waiters)) {
+        Coroutine *waiter = g_queue_pop_head(&this->health_waiters);
+        g_idle_add(waiter->cb.plain, waiter);
+    }
+
+    if (ret < 0) {
+        colod_event_queue(this, EVENT_FAILED, local_errp->message);
+        g_propagate_error(errp, local_errp);
+        return -1;
+    }
+
+    co_end;
+
+    return colod_health_compare(this, CO primary, CO replication, errp);
+}
+
+int _colod_check_health_co(Coroutine *coroutine, ColodMainCoroutine *this,
+                           GError **errp) {
+    return _colod_health_co(coroutine, this, TRUE, errp);
+}
+
+int _colod_probe_health_co(Coroutine *coroutine, ColodMainCoroutine *this,
+                           GError **errp) {
+    return _colod_health_co(coroutine, this, FALSE, errp);
+}
+
 int colod_start_migration(ColodMainCoroutine *this) {
     if (this->state != STATE_PRIMARY_WAIT) {
         return -1;
@@ -529,6 +1113,10 @@ void colod_qemu_failed(ColodMainCoroutine *this) {
     colod_event_queue(this, EVENT_FAILED, "?");
 }
 
+void colod_cpg_failed(ColodMainCoroutine *this) {
+    colod_event_queue(this, EVENT_FAILED, "lost connection to corosync");
+}
+
 #define colod_stop_co(...) \
     co_wrap(_colod_stop_co(__VA_ARGS__))
 static int _colod_stop_co(Coroutine *coroutine, ColodMainCoroutine *this,
@@ -672,6 +1260,7 @@ static MainState _colod_secondary_wait_co(Coroutine *coroutine,
                 return handle_always_interrupting(event);
             } else if (event_failover(event)) {
                 this->peer_failed = FALSE;
+                colod_state_changed(this);
             }
             continue;
         }
@@ -701,7 +1290,10 @@ static MainState _colod_colo_running_co(Coroutine *coroutine,
 
     eventqueue_set_interrupting(this->queue, EVENT_FAILOVER_SYNC, 0);
 
-    if (this->primary) {
+    if (this->resumed) {
+        // Replication is up since long ago
+        this->resumed = FALSE;
+    } else if (this->primary) {
         co_recurse(ret = colod_qmp_event_wait_co(coroutine, this, 0,
                                         "{'event': 'RESUME'}", &local_errp));
 
@@ -731,7 +1323,7 @@ static MainState _colod_colo_running_co(Coroutine *coroutine,
             goto handle_event;
         }
 
-        if (this->yellow && !this->peer_yellow) {
+        if (this->yellow && !colod_peer_yellow(this)) {
             return STATE_FAILED;
         }
     }
@@ -746,7 +1338,7 @@ handle_event:
         } else if (event_always_interrupting(event)) {
             return handle_always_interrupting(event);
         } else if (event_yellow(event)) {
-            if (this->primary && this->yellow && !this->peer_yellow) {
+            if (this->primary && this->yellow && !colod_peer_yellow(this)) {
                 return STATE_FAILED;
             }
         }
@@ -911,6 +1503,119 @@ failover:
     return STATE_FAILED;
 }
 
+static MainState colod_startup_state(ColodMainCoroutine *this) {
+    if (this->primary) {
+        colod_syslog(LOG_INFO, "starting in primary mode");
+        return STATE_PRIMARY_STARTUP;
+    } else {
+        colod_syslog(LOG_INFO, "starting in secondary mode");
+        return STATE_SECONDARY_STARTUP;
+    }
+}
+
+/*
+ * Pick up the state of the previous daemon from its checkpoint if qemu is
+ * still in that state. When replicating, the peer decides if we may
+ * carry on: if it is still replicating with us, we re-enter the state
+ * directly. If it moved on without us, we fail. If it doesn't answer while
+ * qemu is replicating, it is treated as gone and we fail over.
+ *
+ * The peer sees our old daemon leave the cpg group, so it only keeps
+ * replicating with us if it runs with --peer_restart_grace and we are
+ * back in time.
+ */
+#define colod_resume_co(...) \
+    co_wrap(_colod_resume_co(__VA_ARGS__))
+static MainState _colod_resume_co(Coroutine *coroutine,
+                                  ColodMainCoroutine *this) {
+    struct {
+        MainState state;
+        gboolean primary, replication;
+        gint64 deadline;
+        guint source_id;
+    } *co;
+    const ColodState *peer = &this->peer_state.state;
+    GError *local_errp = NULL;
+    int ret;
+
+    co_frame(co, sizeof(*co));
+    co_begin(MainState, STATE_FAILED);
+
+    CO state = state_from_str(this->resume->state);
+    if (CO state != STATE_PRIMARY_WAIT
+            && CO state != STATE_PRIMARY_COLO_RUNNING
+            && CO state != STATE_SECONDARY_COLO_RUNNING) {
+        return colod_startup_state(this);
+    }
+
+    co_recurse(ret = qemu_query_status_co(coroutine, this, &CO primary,
+                                          &CO replication, &local_errp));
+    if (ret < 0) {
+        colod_syslog(LOG_WARNING, "Not resuming, failed to query qemu: %s",
+                     local_errp->message);
+        g_error_free(local_errp);
+        return colod_startup_state(this);
+    }
+
+    if (CO primary != this->resume->primary
+            || CO replication != this->resume->replication) {
+        colod_syslog(LOG_WARNING, "Not resuming %s, qemu is in a different "
+                     "state", this->resume->state);
+        return colod_startup_state(this);
+    }
+
+    this->primary = CO primary;
+    this->replication = CO replication;
+    if (CO state == STATE_PRIMARY_WAIT) {
+        colod_syslog(LOG_INFO, "resuming in state %s", state_str(CO state));
+        return CO state;
+    }
+
+    // The peer answers our hello with its snapshot
+    CO deadline = g_get_monotonic_time() + MAIN_RESUME_PEER_TIMEOUT * 1000;
+    while (!this->peer_state.valid && g_get_monotonic_time() < CO deadline) {
+        CO source_id = g_timeout_add(100, coroutine->cb.plain, coroutine);
+        g_source_set_name_by_id(CO source_id, "Waiting for peer snapshot");
+        co_yield_int(G_SOURCE_REMOVE);
+
+        if (g_source_get_id(g_main_current_source()) != CO source_id) {
+            g_source_remove(CO source_id);
+        }
+    }
+
+    co_end;
+
+    if (!this->peer_state.valid) {
+        if (!this->replication) {
+            colod_syslog(LOG_WARNING, "Not resuming, peer did not answer");
+            return colod_startup_state(this);
+        }
+
+        // qemu is still replicating, only failover gets it out of that
+        colod_syslog(LOG_WARNING, "Peer did not answer while resuming");
+        colod_peer_failed(this);
+        return STATE_FAILOVER_SYNC;
+    }
+
+    if (peer->replication && !peer->failed && peer->primary != this->primary) {
+        colod_syslog(LOG_INFO, "resuming in state %s", state_str(CO state));
+        this->resumed = TRUE;
+        return CO state;
+    }
+
+    colod_syslog(LOG_WARNING, "Not resuming, peer is in state %s",
+                 peer->state);
+    if (peer->primary && !peer->failed) {
+        // It took over while we were gone
+        return this->primary ? STATE_FAILED_PEER_FAILOVER : STATE_FAILED;
+    }
+
+    if (peer->failed) {
+        colod_peer_failed(this);
+    }
+    return STATE_FAILOVER_SYNC;
+}
+
 void colod_quit(ColodMainCoroutine *this) {
     g_main_loop_quit(this->ctx->mainloop);
 }
@@ -949,19 +1654,22 @@ static gboolean _colod_main_co(Coroutine *coroutine, ColodMainCoroutine *this) {
 
     co_begin(gboolean, G_SOURCE_CONTINUE);
 
-    if (this->primary) {
-        colod_syslog(LOG_INFO, "starting in primary mode");
-        new_state = STATE_PRIMARY_STARTUP;
+    colod_cpg_send(this->ctx->cpg, MESSAGE_HELLO);
+
+    if (this->resume) {
+        co_recurse(new_state = colod_resume_co(coroutine, this));
+        checkpoint_free(this->resume);
+        this->resume = NULL;
     } else {
-        colod_syslog(LOG_INFO, "starting in secondary mode");
-        new_state = STATE_SECONDARY_STARTUP;
+        new_state = colod_startup_state(this);
     }
 
-    colod_cpg_send(this->ctx->cpg, MESSAGE_HELLO);
-
     while (TRUE) {
         this->transitioning = FALSE;
+        colod_account_transition(this, this->state, new_state);
         this->state = new_state;
+        colod_state_changed(this);
+        colod_health_invalidate(this);
         if (this->state == STATE_SECONDARY_STARTUP) {
             co_recurse(new_state = colod_secondary_startup_co(coroutine,
                                                                 this));
@@ -1014,6 +1722,7 @@ static gboolean _colod_main_co(Coroutine *coroutine, ColodMainCoroutine *this) {
                 co_recurse(event = colod_event_wait(coroutine, this));
                 if (event == EVENT_PEER_FAILOVER) {
                     this->peer_failover = TRUE;
+                    colod_state_changed(this);
                 } else if (event == EVENT_QUIT) {
                     new_state = STATE_QUIT;
                     break;
@@ -1037,6 +1746,7 @@ static gboolean _colod_main_co(Coroutine *coroutine, ColodMainCoroutine *this) {
                 co_recurse(event = colod_event_wait(coroutine, this));
                 if (event == EVENT_PEER_FAILOVER) {
                     this->peer_failover = TRUE;
+                    colod_state_changed(this);
                 } else if (event == EVENT_QUIT) {
                     new_state = STATE_QUIT;
                     break;
@@ -1057,6 +1767,7 @@ static void colod_hup_cb(gpointer data) {
 
     log_error("qemu quit");
     this->qemu_quit = TRUE;
+    qemu_state_invalidate(this->qemu_state);
     colod_event_queue(this, EVENT_FAILED, "qmp hup");
 }
 
@@ -1065,6 +1776,13 @@ static void colod_qmp_event_cb(gpointer data, ColodQmpResult *result) {
     const gchar *event;
 
     event = get_member_str(result->json_root, "event");
+    qemu_state_event(this->qemu_state, event);
+
+    if (!strcmp(event, "STOP") || !strcmp(event, "RESUME")
+            || !strcmp(event, "RESET") || !strcmp(event, "SHUTDOWN")
+            || !strcmp(event, "MIGRATION") || !strcmp(event, "COLO_EXIT")) {
+        colod_health_invalidate(this);
+    }
 
     if (!strcmp(event, "QUORUM_REPORT_BAD")) {
         const gchar *node, *type;
@@ -1106,15 +1824,59 @@ static void colod_qmp_event_cb(gpointer data, ColodQmpResult *result) {
     }
 }
 
+static void colod_peer_gone(ColodMainCoroutine *this) {
+    log_error("Peer failed");
+    colod_peer_failed(this);
+    colod_event_queue(this, EVENT_FAILOVER_SYNC, "peer left cpg group");
+}
+
+static gboolean colod_peer_grace_cb(gpointer data) {
+    ColodMainCoroutine *this = data;
+
+    this->peer_grace_source_id = 0;
+    colod_syslog(LOG_WARNING, "Peer did not come back in time");
+    colod_peer_gone(this);
+    return G_SOURCE_REMOVE;
+}
+
+/*
+ * If only the colod of the peer went away, qemu keeps replicating without
+ * it. With --peer_restart_grace, give it the chance to come back and
+ * resume from its checkpoint before failing over.
+ */
+static void colod_peer_left(ColodMainCoroutine *this) {
+    ColodContext *ctx = this->ctx;
+
+    this->peer_state.valid = FALSE;
+
+    if (ctx->peer_restart_grace && this->replication
+            && !colod_cpg_left_node_down(ctx->cpg)) {
+        if (!this->peer_grace_source_id) {
+            colod_syslog(LOG_WARNING, "Peer left cpg group, waiting %u ms "
+                         "for it to come back", ctx->peer_restart_grace);
+            this->peer_grace_source_id = g_timeout_add(ctx->peer_restart_grace,
+                                                       colod_peer_grace_cb,
+                                                       this);
+            g_source_set_name_by_id(this->peer_grace_source_id,
+                                    "peer restart grace");
+        }
+        return;
+    }
+
+    if (this->peer_grace_source_id) {
+        g_source_remove(this->peer_grace_source_id);
+        this->peer_grace_source_id = 0;
+    }
+    colod_peer_gone(this);
+}
+
 static void colod_cpg_event_cb(gpointer data, ColodMessage message,
                                gboolean message_from_this_node,
                                gboolean peer_left_group) {
     ColodMainCoroutine *this = data;
 
     if (peer_left_group) {
-        log_error("Peer failed");
-        colod_peer_failed(this);
-        colod_event_queue(this, EVENT_FAILOVER_SYNC, "peer left cpg group");
+        colod_peer_left(this);
     } else if (message == MESSAGE_FAILOVER) {
         if (message_from_this_node) {
             colod_event_queue(this, EVENT_FAILOVER_WIN, "Got our failover msg");
@@ -1131,6 +1893,21 @@ static void colod_cpg_event_cb(gpointer data, ColodMessage message,
         if (this->yellow) {
             colod_cpg_send(this->ctx->cpg, MESSAGE_YELLOW);
         }
+        if (!message_from_this_node) {
+            if (this->peer_grace_source_id) {
+                colod_syslog(LOG_INFO, "Peer came back");
+                g_source_remove(this->peer_grace_source_id);
+                this->peer_grace_source_id = 0;
+            }
+
+            /*
+             * Peer (re)started, send it our current snapshot. Its own
+             * snapshot stays valid: hello is retransmitted and a restarted
+             * peer sends a new epoch, the peer leaving invalidates it.
+             */
+            this->snapshot_sent = FALSE;
+            colod_state_changed(this);
+        }
     } else if (message == MESSAGE_YELLOW) {
         if (!message_from_this_node) {
             this->peer_yellow = TRUE;
@@ -1144,6 +1921,25 @@ static void colod_cpg_event_cb(gpointer data, ColodMessage message,
     }
 }
 
+static void colod_cpg_payload_cb(gpointer data, ColodMessage message,
+                                 gboolean message_from_this_node,
+                                 const void *payload, size_t len) {
+    ColodMainCoroutine *this = data;
+    SnapshotPayload snapshot;
+
+    if (message != MESSAGE_SNAPSHOT || message_from_this_node) {
+        return;
+    }
+
+    if (len != sizeof(snapshot)) {
+        log_error_fmt("Got snapshot of invalid length %zu", len);
+        return;
+    }
+    memcpy(&snapshot, payload, sizeof(snapshot));
+
+    snapshot_receive(this, &snapshot);
+}
+
 static void colod_yellow_event_cb(gpointer data, ColodEvent event) {
     ColodMainCoroutine *this = data;
 
@@ -1158,6 +1954,89 @@ static void colod_yellow_event_cb(gpointer data, ColodEvent event) {
     }
 }
 
+static void colod_heartbeat_event_cb(gpointer data, ColodEvent event) {
+    ColodMainCoroutine *this = data;
+
+    if (event == EVENT_YELLOW) {
+        this->peer_late = TRUE;
+        colod_event_queue(this, EVENT_YELLOW, "peer heartbeat late");
+    } else if (event == EVENT_UNYELLOW) {
+        this->peer_late = FALSE;
+        colod_event_queue(this, EVENT_YELLOW, "peer heartbeat resumed");
+    } else if (event == EVENT_FAILOVER_SYNC) {
+        log_error("Peer failed");
+        colod_peer_failed(this);
+        colod_event_queue(this, EVENT_FAILOVER_SYNC, "peer heartbeat lost");
+    } else {
+        abort();
+    }
+}
+
+/*
+ * Restore the configuration of the previous daemon right away, its state
+ * is reconciled by colod_resume_co() once the main coroutine runs.
+ */
+static void colod_checkpoint_init(ColodMainCoroutine *this) {
+    const ColodContext *ctx = this->ctx;
+    GError *local_errp = NULL;
+    ColodCheckpoint *checkpoint;
+
+    if (!ctx->checkpoint_interval || !ctx->base_dir || !*ctx->base_dir) {
+        return;
+    }
+
+    this->checkpoint_path = g_build_filename(ctx->base_dir, "checkpoint.json",
+                                             NULL);
+    this->checkpoint_timer_id = g_timeout_add(ctx->checkpoint_interval,
+                                              checkpoint_timer_cb, this);
+    g_source_set_name_by_id(this->checkpoint_timer_id, "checkpoint timer");
+
+    checkpoint = checkpoint_load(this->checkpoint_path, &local_errp);
+    if (!checkpoint) {
+        if (local_errp) {
+            colod_syslog(LOG_WARNING, "Ignoring checkpoint: %s",
+                         local_errp->message);
+            g_error_free(local_errp);
+        }
+        return;
+    }
+
+    g_free(this->peer);
+    this->peer = g_strdup(checkpoint->peer);
+    qmp_commands_set_migration_start(ctx->commands,
+                                     checkpoint->migration_start);
+    qmp_commands_set_migration_switchover(ctx->commands,
+                                          checkpoint->migration_switchover);
+    qmp_commands_set_failover_primary(ctx->commands,
+                                      checkpoint->failover_primary);
+    qmp_commands_set_failover_secondary(ctx->commands,
+                                        checkpoint->failover_secondary);
+    if (checkpoint->yank_instances) {
+        qmp_set_yank_instances(this->qmp, checkpoint->yank_instances);
+    }
+
+    this->resume = checkpoint;
+}
+
+static void colod_status_page_init(ColodMainCoroutine *this) {
+    const ColodContext *ctx = this->ctx;
+    GError *local_errp = NULL;
+    gchar *path;
+
+    if (!ctx->status_page || !ctx->base_dir || !*ctx->base_dir) {
+        return;
+    }
+
+    path = g_build_filename(ctx->base_dir, "status.page", NULL);
+    this->status_page = status_page_new(path, &local_errp);
+    if (!this->status_page) {
+        colod_syslog(LOG_WARNING, "Not publishing status page: %s",
+                     local_errp->message);
+        g_error_free(local_errp);
+    }
+    g_free(path);
+}
+
 ColodMainCoroutine *colod_main_new(const ColodContext *ctx, GError **errp) {
     ColodMainCoroutine *this;
     Coroutine *coroutine;
@@ -1171,22 +2050,35 @@ ColodMainCoroutine *colod_main_new(const ColodContext *ctx, GError **errp) {
     this->ctx = ctx;
     this->qmp = ctx->qmp;
 
-    this->yellow_co = yellow_coroutine_new(ctx->cpg, ctx, 500, 1000, errp);
+    this->yellow_co = yellow_coroutine_new(ctx->cpg, ctx, ctx->yellow_delay,
+                                           ctx->yellow_hold, errp);
     if (!this->yellow_co) {
         g_free(this);
         return NULL;
     }
 
+    this->heartbeat = heartbeat_new(ctx->cpg, ctx->heartbeat_interval,
+                                    ctx->heartbeat_miss_yellow,
+                                    ctx->heartbeat_miss_failover);
+
     this->queue = colod_eventqueue_new();
+    this->qemu_state = qemu_state_new();
 
     this->primary = ctx->primary_startup;
     this->peer = g_strdup("");
+    colod_checkpoint_init(this);
+    colod_status_page_init(this);
+    this->published_state = STATE_MAX;
+    this->snapshot.epoch = g_random_int();
+    g_queue_init(&this->health_waiters);
     qmp_add_notify_event(this->qmp, colod_qmp_event_cb, this);
     qmp_add_notify_hup(this->qmp, colod_hup_cb, this);
 
     colod_cpg_add_notify(ctx->cpg, colod_cpg_event_cb, this);
+    colod_cpg_add_payload_notify(ctx->cpg, colod_cpg_payload_cb, this);
 
     yellow_add_notify(this->yellow_co, colod_yellow_event_cb, this);
+    heartbeat_add_notify(this->heartbeat, colod_heartbeat_event_cb, this);
 
     g_idle_add(colod_main_co, this);
     return this;
@@ -1197,7 +2089,13 @@ void colod_main_free(ColodMainCoroutine *this) {
 
     yellow_del_notify(this->yellow_co, colod_yellow_event_cb, this);
     yellow_coroutine_free(this->yellow_co);
+    this->yellow_co = NULL;
+
+    heartbeat_del_notify(this->heartbeat, colod_heartbeat_event_cb, this);
+    heartbeat_free(this->heartbeat);
+    this->heartbeat = NULL;
 
+    colod_cpg_del_payload_notify(this->ctx->cpg, colod_cpg_payload_cb, this);
     colod_cpg_del_notify(this->ctx->cpg, colod_cpg_event_cb, this);
 
     qmp_del_notify_hup(this->qmp, colod_hup_cb, this);
@@ -1208,7 +2106,31 @@ void colod_main_free(ColodMainCoroutine *this) {
         g_main_context_iteration(g_main_context_default(), TRUE);
     }
 
+    if (this->snapshot_source_id) {
+        g_source_remove(this->snapshot_source_id);
+    }
+    if (this->peer_grace_source_id) {
+        g_source_remove(this->peer_grace_source_id);
+    }
+    if (this->checkpoint_source_id) {
+        g_source_remove(this->checkpoint_source_id);
+    }
+    if (this->checkpoint_timer_id) {
+        g_source_remove(this->checkpoint_timer_id);
+    }
+    if (this->resume) {
+        checkpoint_free(this->resume);
+    }
+    status_page_update(this);
+    status_page_free(this->status_page);
+
+    assert(g_queue_is_empty(&this->health_waiters));
+    assert(QLIST_EMPTY(&this->subscribers));
     eventqueue_free(this->queue);
+    qemu_state_free(this->qemu_state);
+    g_free(this->health_error);
+    g_free(this->checkpoint_path);
+    g_free(this->checkpoint_written);
     g_free(this->peer);
     g_free(this);
 }
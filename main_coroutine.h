@@ -2,17 +2,46 @@
 #define MAIN_COROUTINE_H
 
 #include "daemon.h"
+#include "heartbeat.h"
+#include "yellow_coroutine.h"
 
 typedef struct ColodState {
+    const gchar *state;
     gboolean primary;
     gboolean replication, failed, peer_failover, peer_failed;
+    gboolean yellow;
 } ColodState;
 
+typedef struct ColodPeerState {
+    gboolean valid;
+    guint32 version;
+    ColodState state;
+} ColodPeerState;
+
 #define colod_check_health_co(...) \
     co_wrap(_colod_check_health_co(__VA_ARGS__))
 int _colod_check_health_co(Coroutine *coroutine, ColodMainCoroutine *this,
                            GError **errp);
+// Like colod_check_health_co, but never answered from the qemu state mirror
+#define colod_probe_health_co(...) \
+    co_wrap(_colod_probe_health_co(__VA_ARGS__))
+int _colod_probe_health_co(Coroutine *coroutine, ColodMainCoroutine *this,
+                           GError **errp);
 void colod_query_status(ColodMainCoroutine *this, ColodState *ret);
+void colod_query_peer_state(ColodMainCoroutine *this, ColodPeerState *ret);
+void colod_query_heartbeat(ColodMainCoroutine *this, HeartbeatStats *ret);
+void colod_query_yellow(ColodMainCoroutine *this, YellowStatus *ret);
+
+/*
+ * Called with a json line, formatted like a qmp event, for every state
+ * transition, queued event, peer state and yellow change.
+ */
+typedef void (*ColodChangeCallback)(gpointer user_data, const gchar *line);
+
+void colod_add_notify_change(ColodMainCoroutine *this,
+                             ColodChangeCallback _func, gpointer user_data);
+void colod_del_notify_change(ColodMainCoroutine *this,
+                             ColodChangeCallback _func, gpointer user_data);
 
 void colod_peer_failed(ColodMainCoroutine *this);
 void colod_set_peer(ColodMainCoroutine *this, const gchar *peer);
@@ -23,6 +52,7 @@ int colod_start_migration(ColodMainCoroutine *this);
 void colod_autoquit(ColodMainCoroutine *this);
 void colod_quit(ColodMainCoroutine *this);
 void colod_qemu_failed(ColodMainCoroutine *this);
+void colod_cpg_failed(ColodMainCoroutine *this);
 
 #define colod_yank(...) \
     co_wrap(_colod_yank_co(__VA_ARGS__))
@@ -35,6 +65,14 @@ ColodQmpResult *_colod_execute_nocheck_co(Coroutine *coroutine,
                                           GError **errp,
                                           const gchar *command);
 
+// Like colod_execute_nocheck_co, but the reply is not parsed, see qmp_relay_co
+#define colod_relay_co(...) \
+    co_wrap(_colod_relay_co(__VA_ARGS__))
+ColodQmpResult *_colod_relay_co(Coroutine *coroutine,
+                                ColodMainCoroutine *this,
+                                GError **errp,
+                                const gchar *command);
+
 #define colod_execute_co(...) \
     co_wrap(_colod_execute_co(__VA_ARGS__))
 ColodQmpResult *_colod_execute_co(Coroutine *coroutine,
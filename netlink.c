@@ -12,6 +12,7 @@
 
 #include <netlink/netlink.h>
 #include <netlink/msg.h>
+#include <netlink/attr.h>
 
 #include <sys/socket.h>
 #include <sys/ioctl.h>
@@ -19,16 +20,36 @@
 #include <netinet/in.h>
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
+#include <linux/if_link.h>
+#include <linux/filter.h>
+#include <arpa/inet.h>
 #include <errno.h>
 
 #include "util.h"
 #include "daemon.h"
 #include "netlink.h"
 
+typedef struct NetlinkWatch {
+    char ifname[IF_NAMESIZE];
+    // 0 while no interface of that name exists
+    unsigned int ifindex;
+    guint32 carrier_changes;
+    // Counters at the last stats poll
+    gboolean have_stats;
+    NetlinkLinkStats last;
+} NetlinkWatch;
+
+#define NETLINK_RCVBUF (4*1024*1024)
+
 struct ColodNetlink {
     struct nl_sock *sock;
     guint source_id;
     ColodCallbackHead callbacks;
+    ColodCallbackHead stats_callbacks;
+    GArray *watches;
+    guint resync_source_id;
+    NetlinkStats stats;
+    guint stats_source_id;
 };
 
 void netlink_add_notify(ColodNetlink *this, NetlinkCallback _func,
@@ -43,6 +64,27 @@ void netlink_del_notify(ColodNetlink *this, NetlinkCallback _func,
     colod_callback_del(&this->callbacks, func, user_data);
 }
 
+void netlink_add_stats_notify(ColodNetlink *this, NetlinkStatsCallback _func,
+                              gpointer user_data) {
+    ColodCallbackFunc func = (ColodCallbackFunc) _func;
+    colod_callback_add(&this->stats_callbacks, func, user_data);
+}
+
+void netlink_del_stats_notify(ColodNetlink *this, NetlinkStatsCallback _func,
+                              gpointer user_data) {
+    ColodCallbackFunc func = (ColodCallbackFunc) _func;
+    colod_callback_del(&this->stats_callbacks, func, user_data);
+}
+
+static void notify_stats(ColodNetlink *this, const char *ifname,
+                         const NetlinkLinkStats *delta) {
+    ColodCallback *entry, *next_entry;
+    QLIST_FOREACH_SAFE(entry, &this->stats_callbacks, next, next_entry) {
+        NetlinkStatsCallback func = (NetlinkStatsCallback) entry->func;
+        func(entry->user_data, ifname, delta);
+    }
+}
+
 static void notify(ColodNetlink *this, const char *ifname, gboolean up) {
     ColodCallback *entry, *next_entry;
     QLIST_FOREACH_SAFE(entry, &this->callbacks, next, next_entry) {
@@ -51,23 +93,290 @@ static void notify(ColodNetlink *this, const char *ifname, gboolean up) {
     }
 }
 
+static NetlinkWatch *netlink_watch_by_index(ColodNetlink *this,
+                                            unsigned int ifindex) {
+    for (guint i = 0; i < this->watches->len; i++) {
+        NetlinkWatch *watch = &g_array_index(this->watches, NetlinkWatch, i);
+        if (watch->ifindex && watch->ifindex == ifindex) {
+            return watch;
+        }
+    }
+
+    return NULL;
+}
+
+static NetlinkWatch *netlink_watch_by_name(ColodNetlink *this,
+                                           const char *ifname) {
+    for (guint i = 0; i < this->watches->len; i++) {
+        NetlinkWatch *watch = &g_array_index(this->watches, NetlinkWatch, i);
+        if (!strcmp(watch->ifname, ifname)) {
+            return watch;
+        }
+    }
+
+    return NULL;
+}
+
+#define BPF_ACCEPT 0xffffffff
+
+static struct sock_filter bpf_stmt(guint16 code, guint32 k) {
+    struct sock_filter insn = BPF_STMT(code, k);
+    return insn;
+}
+
+static struct sock_filter bpf_jump(guint16 code, guint32 k, guint8 jt,
+                                   guint8 jf) {
+    struct sock_filter insn = BPF_JUMP(code, k, jt, jf);
+    return insn;
+}
+
+/*
+ * Let the kernel drop link messages of interfaces we don't watch. Multipart
+ * (dump) messages and everything that isn't a link message always pass.
+ * While a watched interface doesn't exist, all link messages pass so we
+ * notice when it appears. BPF loads are big endian, hence the byte swaps.
+ */
+static void netlink_update_filter(ColodNetlink *this) {
+    GArray *prog = g_array_new(FALSE, FALSE, sizeof(struct sock_filter));
+    struct sock_fprog fprog;
+    struct sock_filter insn;
+    guint count = this->watches->len;
+    int ret;
+
+    for (guint i = 0; i < count; i++) {
+        if (!g_array_index(this->watches, NetlinkWatch, i).ifindex) {
+            count = 0;
+            break;
+        }
+    }
+
+    // Jump offsets are 8 bit
+    if ((!count && this->watches->len) || count > 200) {
+        insn = bpf_stmt(BPF_RET | BPF_K, BPF_ACCEPT);
+        g_array_append_val(prog, insn);
+    } else {
+        // Jump offsets are relative to the next instruction, drop is
+        // instruction count + 6 and accept is count + 7
+        insn = bpf_stmt(BPF_LD | BPF_H | BPF_ABS,
+                        offsetof(struct nlmsghdr, nlmsg_flags));
+        g_array_append_val(prog, insn);
+        insn = bpf_jump(BPF_JMP | BPF_JSET | BPF_K, htons(NLM_F_MULTI),
+                        count + 5, 0);
+        g_array_append_val(prog, insn);
+        insn = bpf_stmt(BPF_LD | BPF_H | BPF_ABS,
+                        offsetof(struct nlmsghdr, nlmsg_type));
+        g_array_append_val(prog, insn);
+        insn = bpf_jump(BPF_JMP | BPF_JEQ | BPF_K, htons(RTM_NEWLINK), 1, 0);
+        g_array_append_val(prog, insn);
+        insn = bpf_jump(BPF_JMP | BPF_JEQ | BPF_K, htons(RTM_DELLINK), 0,
+                        count + 2);
+        g_array_append_val(prog, insn);
+        insn = bpf_stmt(BPF_LD | BPF_W | BPF_ABS,
+                        NLMSG_LENGTH(offsetof(struct ifinfomsg, ifi_index)));
+        g_array_append_val(prog, insn);
+        for (guint i = 0; i < count; i++) {
+            NetlinkWatch *watch = &g_array_index(this->watches, NetlinkWatch,
+                                                 i);
+            insn = bpf_jump(BPF_JMP | BPF_JEQ | BPF_K, htonl(watch->ifindex),
+                            count - i, 0);
+            g_array_append_val(prog, insn);
+        }
+        insn = bpf_stmt(BPF_RET | BPF_K, 0);
+        g_array_append_val(prog, insn);
+        insn = bpf_stmt(BPF_RET | BPF_K, BPF_ACCEPT);
+        g_array_append_val(prog, insn);
+    }
+
+    fprog.len = prog->len;
+    fprog.filter = (struct sock_filter *) prog->data;
+    ret = setsockopt(nl_socket_get_fd(this->sock), SOL_SOCKET,
+                     SO_ATTACH_FILTER, &fprog, sizeof(fprog));
+    if (ret < 0) {
+        // Not fatal, netlink_message filters by ifindex as well
+        colod_syslog(LOG_WARNING, "Failed to attach netlink filter: %s",
+                     g_strerror(errno));
+    }
+
+    g_array_free(prog, TRUE);
+}
+
+void netlink_watch(ColodNetlink *this, const char *ifname) {
+    NetlinkWatch watch = {0};
+
+    if (netlink_watch_by_name(this, ifname)) {
+        return;
+    }
+
+    g_strlcpy(watch.ifname, ifname, sizeof(watch.ifname));
+    watch.ifindex = if_nametoindex(ifname);
+    g_array_append_val(this->watches, watch);
+
+    netlink_update_filter(this);
+}
+
+static void netlink_stats_message(ColodNetlink *this,
+                                  const struct nlmsghdr *hdr) {
+    const struct if_stats_msg *ifsm = nlmsg_data(hdr);
+    const struct nlattr *attr;
+    struct rtnl_link_stats64 stats64;
+    NetlinkLinkStats now, delta;
+    NetlinkWatch *watch;
+
+    watch = netlink_watch_by_index(this, ifsm->ifindex);
+    if (!watch) {
+        return;
+    }
+
+    attr = nlmsg_find_attr(hdr, sizeof(*ifsm), IFLA_STATS_LINK_64);
+    if (!attr || nla_len(attr) < (int) sizeof(stats64)) {
+        return;
+    }
+    memcpy(&stats64, nla_data(attr), sizeof(stats64));
+
+    now.errors = stats64.rx_errors + stats64.tx_errors;
+    now.drops = stats64.rx_dropped + stats64.tx_dropped;
+    now.carrier_changes = watch->carrier_changes;
+
+    if (watch->have_stats) {
+        // Counters only go backwards if the interface was recreated
+        delta.errors = now.errors - MIN(now.errors, watch->last.errors);
+        delta.drops = now.drops - MIN(now.drops, watch->last.drops);
+        delta.carrier_changes = now.carrier_changes
+            - MIN(now.carrier_changes, watch->last.carrier_changes);
+        notify_stats(this, watch->ifname, &delta);
+    }
+
+    watch->last = now;
+    watch->have_stats = TRUE;
+}
+
 static int netlink_message(struct nl_msg *msg, void *data) {
     ColodNetlink *this = data;
     const struct nlmsghdr *hdr = nlmsg_hdr(msg);
-    char ifname[IF_NAMESIZE] = {0};
+    const struct ifinfomsg *ifi;
+    const struct nlattr *attr;
+    const char *ifname = NULL;
+    NetlinkWatch *watch;
+    gboolean up;
+
+    if (hdr->nlmsg_type == RTM_NEWSTATS) {
+        netlink_stats_message(this, hdr);
+        return NL_OK;
+    }
 
-    if (hdr->nlmsg_type == RTM_NEWLINK) {
-        struct ifinfomsg *ifi = nlmsg_data(hdr);
-        if_indextoname(ifi->ifi_index, ifname);
-        colod_trace("netlink message: link %s %s\n", ifname,
-                    (ifi->ifi_flags & IFF_RUNNING) ? "up" : "down");
+    if (hdr->nlmsg_type != RTM_NEWLINK && hdr->nlmsg_type != RTM_DELLINK) {
+        return NL_OK;
+    }
+
+    ifi = nlmsg_data(hdr);
+    attr = nlmsg_find_attr(hdr, sizeof(*ifi), IFLA_IFNAME);
+    if (attr) {
+        ifname = nla_get_string(attr);
+    }
+    up = hdr->nlmsg_type == RTM_NEWLINK && (ifi->ifi_flags & IFF_RUNNING);
+
+    watch = netlink_watch_by_index(this, ifi->ifi_index);
+    if (watch) {
+        if (hdr->nlmsg_type == RTM_NEWLINK
+                && (!ifname || !strcmp(ifname, watch->ifname))) {
+            attr = nlmsg_find_attr(hdr, sizeof(*ifi), IFLA_CARRIER_CHANGES);
+            if (attr) {
+                watch->carrier_changes = nla_get_u32(attr);
+            }
+            colod_trace("netlink message: link %s %s\n", watch->ifname,
+                        up ? "up" : "down");
+            notify(this, watch->ifname, up);
+            return NL_OK;
+        }
+
+        // Deleted or renamed
+        colod_trace("netlink message: link %s gone\n", watch->ifname);
+        watch->ifindex = 0;
+        watch->have_stats = FALSE;
+        netlink_update_filter(this);
+        notify(this, watch->ifname, FALSE);
+    }
 
-        notify(this, ifname, ifi->ifi_flags & IFF_RUNNING);
+    if (hdr->nlmsg_type == RTM_NEWLINK && ifname) {
+        watch = netlink_watch_by_name(this, ifname);
+        if (watch && !watch->ifindex) {
+            watch->ifindex = ifi->ifi_index;
+            attr = nlmsg_find_attr(hdr, sizeof(*ifi), IFLA_CARRIER_CHANGES);
+            if (attr) {
+                watch->carrier_changes = nla_get_u32(attr);
+            }
+            netlink_update_filter(this);
+            colod_trace("netlink message: link %s %s\n", watch->ifname,
+                        up ? "up" : "down");
+            notify(this, watch->ifname, up);
+        }
     }
 
     return NL_OK;
 }
 
+void netlink_query(ColodNetlink *this, NetlinkStats *ret) {
+    *ret = this->stats;
+}
+
+/*
+ * Link messages may have been lost, so look up the watched interfaces
+ * again. Interfaces that vanished meanwhile won't show up in the dump.
+ */
+static void netlink_resolve_watches(ColodNetlink *this) {
+    gboolean changed = FALSE;
+
+    for (guint i = 0; i < this->watches->len; i++) {
+        NetlinkWatch *watch = &g_array_index(this->watches, NetlinkWatch, i);
+        unsigned int ifindex = if_nametoindex(watch->ifname);
+
+        if (ifindex == watch->ifindex) {
+            continue;
+        }
+
+        changed = TRUE;
+        watch->have_stats = FALSE;
+        if (watch->ifindex && !ifindex) {
+            watch->ifindex = 0;
+            notify(this, watch->ifname, FALSE);
+        } else {
+            watch->ifindex = ifindex;
+        }
+    }
+
+    if (changed) {
+        netlink_update_filter(this);
+    }
+}
+
+static gboolean netlink_resync_cb(gpointer data) {
+    ColodNetlink *this = data;
+    GError *local_errp = NULL;
+    int ret;
+
+    netlink_resolve_watches(this);
+
+    ret = netlink_request_status(this, &local_errp);
+    if (ret < 0) {
+        log_error(local_errp->message);
+        g_error_free(local_errp);
+        return G_SOURCE_CONTINUE;
+    }
+
+    this->stats.resyncs++;
+    this->resync_source_id = 0;
+    return G_SOURCE_REMOVE;
+}
+
+static void netlink_schedule_resync(ColodNetlink *this) {
+    if (this->resync_source_id) {
+        return;
+    }
+
+    this->resync_source_id = g_timeout_add(100, netlink_resync_cb, this);
+    g_source_set_name_by_id(this->resync_source_id, "netlink resync");
+}
+
 static gboolean netlink_io_watch(G_GNUC_UNUSED int fd,
                                  G_GNUC_UNUSED GIOCondition condition,
                                  gpointer data) {
@@ -75,7 +384,27 @@ static gboolean netlink_io_watch(G_GNUC_UNUSED int fd,
     ColodNetlink *this = data;
 
     ret = nl_recvmsgs_default(this->sock);
-    if (ret < 0) {
+    if (ret == -NLE_NOMEM) {
+        // ENOBUFS, the receive buffer overran and messages were dropped
+        this->stats.overruns++;
+        colod_syslog(LOG_WARNING, "Netlink receive buffer overrun, "
+                     "resyncing link state");
+        netlink_schedule_resync(this);
+        return G_SOURCE_CONTINUE;
+    } else if (ret == -NLE_DUMP_INTR || ret == -NLE_BUSY) {
+        // The dump was inconsistent or another one is still running
+        netlink_schedule_resync(this);
+        return G_SOURCE_CONTINUE;
+    } else if (ret == -NLE_NODEV || ret == -NLE_OBJ_NOTFOUND) {
+        // An interface vanished before we polled its stats
+        return G_SOURCE_CONTINUE;
+    } else if (ret == -NLE_OPNOTSUPP && this->stats_source_id) {
+        colod_syslog(LOG_WARNING, "Kernel doesn't support RTM_GETSTATS, "
+                     "disabling interface stats polling");
+        g_source_remove(this->stats_source_id);
+        this->stats_source_id = 0;
+        return G_SOURCE_CONTINUE;
+    } else if (ret < 0) {
         colod_syslog(LOG_ERR, "Failed processing netlink messages: %s",
                      nl_geterror(ret));
         this->source_id = 0;
@@ -85,6 +414,63 @@ static gboolean netlink_io_watch(G_GNUC_UNUSED int fd,
     return G_SOURCE_CONTINUE;
 }
 
+static int netlink_request_stats(ColodNetlink *this, unsigned int ifindex) {
+    int ret;
+    struct nl_msg *msg;
+    struct if_stats_msg hdr = {0};
+    hdr.family = AF_UNSPEC;
+    hdr.ifindex = ifindex;
+    hdr.filter_mask = IFLA_STATS_FILTER_BIT(IFLA_STATS_LINK_64);
+
+    msg = nlmsg_alloc_simple(RTM_GETSTATS, 0);
+    if (!msg) {
+        log_error("Failed to allocate netlink message");
+        abort();
+    }
+
+    ret = nlmsg_append(msg, &hdr, sizeof(hdr), NLMSG_ALIGNTO);
+    if (ret >= 0) {
+        ret = nl_send_auto(this->sock, msg);
+    }
+    nlmsg_free(msg);
+
+    return ret;
+}
+
+static gboolean netlink_stats_cb(gpointer data) {
+    ColodNetlink *this = data;
+    int ret;
+
+    for (guint i = 0; i < this->watches->len; i++) {
+        NetlinkWatch *watch = &g_array_index(this->watches, NetlinkWatch, i);
+        if (!watch->ifindex) {
+            continue;
+        }
+
+        ret = netlink_request_stats(this, watch->ifindex);
+        if (ret < 0) {
+            log_error_fmt("Failed to request stats of %s: %s",
+                          watch->ifname, nl_geterror(ret));
+        }
+    }
+
+    return G_SOURCE_CONTINUE;
+}
+
+void netlink_poll_stats(ColodNetlink *this, guint interval) {
+    if (this->stats_source_id) {
+        g_source_remove(this->stats_source_id);
+        this->stats_source_id = 0;
+    }
+
+    if (!interval) {
+        return;
+    }
+
+    this->stats_source_id = g_timeout_add(interval, netlink_stats_cb, this);
+    g_source_set_name_by_id(this->stats_source_id, "netlink stats poll");
+}
+
 int netlink_request_status(ColodNetlink *this, GError **errp) {
     int ret;
     struct nl_msg *msg;
@@ -121,11 +507,19 @@ err:
 
 void netlink_free(ColodNetlink *this) {
     colod_callback_clear(&this->callbacks);
+    colod_callback_clear(&this->stats_callbacks);
 
     if (this->source_id) {
         g_source_remove(this->source_id);
     }
+    if (this->resync_source_id) {
+        g_source_remove(this->resync_source_id);
+    }
+    if (this->stats_source_id) {
+        g_source_remove(this->stats_source_id);
+    }
     nl_socket_free(this->sock);
+    g_array_free(this->watches, TRUE);
     g_free(this);
 }
 
@@ -155,6 +549,19 @@ ColodNetlink *netlink_new(GError **errp) {
 
     nl_socket_disable_seq_check(sock);
 
+    // Bursts of link events must not overrun the receive buffer
+    int size = NETLINK_RCVBUF;
+    ret = setsockopt(nl_socket_get_fd(sock), SOL_SOCKET, SO_RCVBUFFORCE,
+                     &size, sizeof(size));
+    if (ret < 0) {
+        ret = nl_socket_set_buffer_size(sock, NETLINK_RCVBUF, 0);
+        if (ret < 0) {
+            colod_syslog(LOG_WARNING,
+                         "Failed to set netlink receive buffer size: %s",
+                         nl_geterror(ret));
+        }
+    }
+
     ret = nl_socket_set_nonblocking(sock);
     if (ret < 0) {
         colod_error_set(errp, "Failed to set netlink socket nonblocking: %s",
@@ -164,12 +571,14 @@ ColodNetlink *netlink_new(GError **errp) {
 
     ColodNetlink *this = g_new0(ColodNetlink, 1);
     this->sock = sock;
+    this->watches = g_array_new(FALSE, FALSE, sizeof(NetlinkWatch));
 
     ret = nl_socket_modify_cb(sock, NL_CB_VALID, NL_CB_CUSTOM,
                               netlink_message, this);
     if (ret < 0) {
         colod_error_set(errp, "Failed to set netlink callback: %s",
                         nl_geterror(ret));
+        g_array_free(this->watches, TRUE);
         g_free(this);
         goto err;
     }
@@ -177,6 +586,7 @@ ColodNetlink *netlink_new(GError **errp) {
     int fd = nl_socket_get_fd(sock);
     this->source_id = g_unix_fd_add(fd, G_IO_IN | G_IO_HUP,
                                     netlink_io_watch, this);
+    netlink_update_filter(this);
 
     return this;
 
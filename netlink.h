@@ -5,14 +5,39 @@
 
 typedef struct ColodNetlink ColodNetlink;
 
+typedef struct NetlinkStats {
+    guint64 overruns;
+    guint64 resyncs;
+} NetlinkStats;
+
 typedef void (*NetlinkCallback)(gpointer user_data, const char *ifname,
                                 gboolean up);
 
+typedef struct NetlinkLinkStats {
+    guint64 errors;
+    guint64 drops;
+    guint64 carrier_changes;
+} NetlinkLinkStats;
+
+// Called with the counter increments since the last poll
+typedef void (*NetlinkStatsCallback)(gpointer user_data, const char *ifname,
+                                     const NetlinkLinkStats *delta);
+
 void netlink_add_notify(ColodNetlink *this, NetlinkCallback _func,
                         gpointer user_data);
 void netlink_del_notify(ColodNetlink *this, NetlinkCallback _func,
                         gpointer user_data);
+void netlink_add_stats_notify(ColodNetlink *this, NetlinkStatsCallback _func,
+                              gpointer user_data);
+void netlink_del_stats_notify(ColodNetlink *this, NetlinkStatsCallback _func,
+                              gpointer user_data);
 void netlink_stub_notify(const char *ifname, gboolean up);
+void netlink_stub_notify_stats(const char *ifname,
+                               const NetlinkLinkStats *delta);
+
+void netlink_watch(ColodNetlink *this, const char *ifname);
+void netlink_query(ColodNetlink *this, NetlinkStats *ret);
+void netlink_poll_stats(ColodNetlink *this, guint interval);
 
 int netlink_request_status(ColodNetlink *this, GError **errp);
 void netlink_free(ColodNetlink *this);
@@ -7,6 +7,14 @@
  * See the COPYING file in the top-level directory.
  */
 
+#define _GNU_SOURCE
+#include <assert.h>
+#include <dlfcn.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include <netlink/netlink.h>
+
 #include "netlink.h"
 #include "util.h"
 #include "daemon.h"
@@ -33,6 +41,77 @@ void colod_syslog(G_GNUC_UNUSED int pri, const char *fmt, ...) {
     va_end(args);
 }
 
+static gboolean overrun;
+
+/*
+ * Takes precedence over the libnl function. If overrun is set, everything
+ * queued on the socket is dropped and the overrun is reported, like the
+ * kernel does when the receive buffer is full.
+ */
+int nl_recvmsgs_default(struct nl_sock *sk) {
+    static int (*real_recvmsgs_default)(struct nl_sock *sk);
+    char buf[65536];
+
+    if (!overrun) {
+        if (!real_recvmsgs_default) {
+            real_recvmsgs_default = dlsym(RTLD_NEXT, "nl_recvmsgs_default");
+            assert(real_recvmsgs_default);
+        }
+        return real_recvmsgs_default(sk);
+    }
+
+    overrun = FALSE;
+    while (recv(nl_socket_get_fd(sk), buf, sizeof(buf), MSG_DONTWAIT) > 0);
+    return -NLE_NOMEM;
+}
+
+static guint lo_reports;
+static gboolean lo_up;
+
+static void link_cb(G_GNUC_UNUSED gpointer data, const char *ifname,
+                    gboolean up) {
+    if (!strcmp(ifname, "lo")) {
+        lo_reports++;
+        lo_up = up;
+    }
+}
+
+// Run the main loop for ms or until lo was reported
+static void run(guint ms) {
+    gint64 deadline = g_get_monotonic_time() + ms * 1000;
+
+    while (!lo_reports && g_get_monotonic_time() < deadline) {
+        g_main_context_iteration(g_main_context_default(), FALSE);
+        g_usleep(1000);
+    }
+}
+
+static void test_overrun() {
+    ColodNetlink *link;
+    NetlinkStats stats;
+
+    link = netlink_new(NULL);
+    assert(link);
+    netlink_add_notify(link, link_cb, NULL);
+    netlink_watch(link, "lo");
+
+    // The dump with the state of lo is lost
+    overrun = TRUE;
+    assert(!netlink_request_status(link, NULL));
+    run(50);
+    netlink_query(link, &stats);
+    assert(stats.overruns == 1 && !stats.resyncs);
+    assert(!lo_reports);
+
+    // And reported after the resync
+    run(1000);
+    netlink_query(link, &stats);
+    assert(stats.overruns == 1 && stats.resyncs >= 1);
+    assert(lo_reports == 1 && lo_up);
+
+    netlink_free(link);
+}
+
 gboolean timeout_cb(gpointer data) {
     GMainLoop *mainloop = data;
     g_main_loop_quit(mainloop);
@@ -55,6 +134,8 @@ int main(G_GNUC_UNUSED int argc, G_GNUC_UNUSED char **argv) {
         return -1;
     }
 
+    netlink_watch(link, "lo");
+
     ret = netlink_request_status(link, &errp);
     if (ret < 0) {
         colod_syslog(LOG_ERR, "netlink_request_status(): %s", errp->message);
@@ -67,5 +148,7 @@ int main(G_GNUC_UNUSED int argc, G_GNUC_UNUSED char **argv) {
 
     netlink_free(link);
 
+    test_overrun();
+
     return 0;
 }
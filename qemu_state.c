@@ -0,0 +1,157 @@
+/*
+ * COLO background daemon qemu state mirror
+ *
+ * Copyright (c) Lukas Straub <lukasstraub2@web.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <string.h>
+
+#include <glib-2.0/glib.h>
+
+#include "qemu_state.h"
+#include "util.h"
+
+struct QemuState {
+    gboolean valid;
+    // Incremented for every event, see qemu_state_reconcile()
+    guint seq;
+    gint64 time;
+    gchar *status, *colo_mode, *colo_reason;
+};
+
+static gboolean qemu_runnng(const gchar *status) {
+    return !strcmp(status, "running")
+            || !strcmp(status, "finish-migrate")
+            || !strcmp(status, "colo")
+            || !strcmp(status, "prelaunch")
+            || !strcmp(status, "paused");
+}
+
+int qemu_state_classify(const gchar *status, const gchar *colo_mode,
+                        const gchar *colo_reason, gboolean *primary,
+                        gboolean *replication, GError **errp) {
+    if (!strcmp(status, "inmigrate") || !strcmp(status, "shutdown")) {
+        *primary = FALSE;
+        *replication = FALSE;
+    } else if (qemu_runnng(status) && !strcmp(colo_mode, "none")
+               && (!strcmp(colo_reason, "none")
+                   || !strcmp(colo_reason, "request"))) {
+        *primary = TRUE;
+        *replication = FALSE;
+    } else if (qemu_runnng(status) &&!strcmp(colo_mode, "primary")) {
+        *primary = TRUE;
+        *replication = TRUE;
+    } else if (qemu_runnng(status) && !strcmp(colo_mode, "secondary")) {
+        *primary = FALSE;
+        *replication = TRUE;
+    } else {
+        colod_error_set(errp, "Unknown qemu status: %s, %s, %s",
+                        status, colo_mode, colo_reason);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void qemu_state_set_status(QemuState *this, const gchar *status) {
+    g_free(this->status);
+    this->status = g_strdup(status);
+}
+
+void qemu_state_event(QemuState *this, const gchar *event) {
+    this->seq++;
+
+    if (!this->valid) {
+        return;
+    }
+
+    /*
+     * Colo checkpoints stop and resume the guest all the time, this never
+     * changes the outcome of qemu_state_classify().
+     */
+    if (!strcmp(event, "STOP") && qemu_runnng(this->status)) {
+        qemu_state_set_status(this, "paused");
+    } else if (!strcmp(event, "RESUME") && qemu_runnng(this->status)) {
+        qemu_state_set_status(this, "running");
+    } else if (!strcmp(event, "SHUTDOWN")) {
+        qemu_state_set_status(this, "shutdown");
+    } else if (!strcmp(event, "STOP") || !strcmp(event, "RESUME")
+               || !strcmp(event, "RESET") || !strcmp(event, "MIGRATION")
+               || !strcmp(event, "COLO_EXIT")) {
+        // Can't tell the resulting state for sure
+        this->valid = FALSE;
+    }
+}
+
+void qemu_state_invalidate(QemuState *this) {
+    this->valid = FALSE;
+}
+
+guint qemu_state_seq(QemuState *this) {
+    return this->seq;
+}
+
+/*
+ * Update the mirror with the output of a real query that was started when
+ * qemu_state_seq() returned seq. Returns -1 if the mirror disagreed with
+ * qemu, which means that we missed or misinterpreted an event.
+ */
+int qemu_state_reconcile(QemuState *this, guint seq, const gchar *status,
+                         const gchar *colo_mode, const gchar *colo_reason) {
+    gboolean primary, replication, mirror_primary, mirror_replication;
+    int ret = 0;
+
+    if (seq != this->seq) {
+        // Events arrived while the query was in flight
+        this->valid = FALSE;
+        return 0;
+    }
+
+    if (qemu_state_get(this, G_MAXUINT, &mirror_primary, &mirror_replication)
+            && (!qemu_state_classify(status, colo_mode, colo_reason,
+                                     &primary, &replication, NULL)
+                && (primary != mirror_primary
+                    || replication != mirror_replication))) {
+        ret = -1;
+    }
+
+    qemu_state_set_status(this, status);
+    g_free(this->colo_mode);
+    this->colo_mode = g_strdup(colo_mode);
+    g_free(this->colo_reason);
+    this->colo_reason = g_strdup(colo_reason);
+    this->time = g_get_monotonic_time();
+    this->valid = TRUE;
+
+    return ret;
+}
+
+/*
+ * Get the state if the mirror is sure about it and it was reconciled within
+ * the last max_age ms.
+ */
+gboolean qemu_state_get(QemuState *this, guint max_age, gboolean *primary,
+                        gboolean *replication) {
+    if (!this->valid
+            || g_get_monotonic_time() - this->time >= (gint64) max_age * 1000) {
+        return FALSE;
+    }
+
+    return !qemu_state_classify(this->status, this->colo_mode,
+                                this->colo_reason, primary, replication,
+                                NULL);
+}
+
+QemuState *qemu_state_new() {
+    return g_new0(QemuState, 1);
+}
+
+void qemu_state_free(QemuState *this) {
+    g_free(this->status);
+    g_free(this->colo_mode);
+    g_free(this->colo_reason);
+    g_free(this);
+}
@@ -0,0 +1,39 @@
+/*
+ * COLO background daemon qemu state mirror
+ *
+ * Copyright (c) Lukas Straub <lukasstraub2@web.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_STATE_H
+#define QEMU_STATE_H
+
+#include <glib-2.0/glib.h>
+
+/*
+ * Mirror of qemu's run state and colo mode, kept up to date from qmp
+ * events. It only answers while it is sure about the state: events it
+ * can't apply exactly mark it invalid until the next reconcile with the
+ * output of query-status and query-colo-status.
+ */
+typedef struct QemuState QemuState;
+
+int qemu_state_classify(const gchar *status, const gchar *colo_mode,
+                        const gchar *colo_reason, gboolean *primary,
+                        gboolean *replication, GError **errp);
+
+void qemu_state_event(QemuState *this, const gchar *event);
+void qemu_state_invalidate(QemuState *this);
+
+guint qemu_state_seq(QemuState *this);
+int qemu_state_reconcile(QemuState *this, guint seq, const gchar *status,
+                         const gchar *colo_mode, const gchar *colo_reason);
+gboolean qemu_state_get(QemuState *this, guint max_age, gboolean *primary,
+                        gboolean *replication);
+
+QemuState *qemu_state_new();
+void qemu_state_free(QemuState *this);
+
+#endif // QEMU_STATE_H
@@ -24,11 +24,14 @@ typedef struct QmpChannel {
     GIOChannel *channel;
     CoroutineLock lock;
     gboolean discard_events;
+    QmpRole role;
 } QmpChannel;
 
 struct ColodQmpState {
     QmpChannel channel;
     QmpChannel yank_channel;
+    // Additional monitors added with qmp_add_monitor()
+    GPtrArray *monitors;
     guint timeout;
     JsonNode *yank_instances;
     ColodCallbackHead yank_callbacks;
@@ -40,6 +43,47 @@ struct ColodQmpState {
     guint hup_source_id;
 };
 
+int qmp_role_from_str(const gchar *str, QmpRole *role) {
+    for (QmpRole i = 0; i < QMP_ROLE_MAX; i++) {
+        if (!g_strcmp0(str, qmp_role_str(i))) {
+            *role = i;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+const gchar *qmp_role_str(QmpRole role) {
+    switch (role) {
+        case QMP_ROLE_CRITICAL: return "critical";
+        case QMP_ROLE_HEALTH: return "health";
+        case QMP_ROLE_CLIENT: return "client";
+        default: abort();
+    }
+}
+
+// Pick an idle monitor of role, falling back to the main monitor
+static QmpChannel *qmp_channel_for(ColodQmpState *state, QmpRole role) {
+    QmpChannel *busy = NULL;
+
+    for (guint i = 0; i < state->monitors->len; i++) {
+        QmpChannel *channel = g_ptr_array_index(state->monitors, i);
+
+        if (channel->role != role) {
+            continue;
+        }
+        if (!channel->lock.holder) {
+            return channel;
+        }
+        if (!busy) {
+            busy = channel;
+        }
+    }
+
+    return busy ? busy : &state->channel;
+}
+
 static void qmp_set_error(ColodQmpState *state, GError *error) {
     assert(error);
 
@@ -134,7 +178,9 @@ void qmp_result_free(ColodQmpResult *result) {
     if (!result)
         return;
 
-    json_node_unref(result->json_root);
+    if (result->json_root) {
+        json_node_unref(result->json_root);
+    }
     g_free(result->line);
     g_free(result);
 }
@@ -169,6 +215,7 @@ static ColodQmpResult *_qmp_read_line_co(Coroutine *coroutine,
                                          QmpChannel *channel,
                                          gboolean yank,
                                          gboolean skip_events,
+                                         gboolean raw,
                                          GError **errp) {
     struct {
         gchar *line;
@@ -200,7 +247,8 @@ static ColodQmpResult *_qmp_read_line_co(Coroutine *coroutine,
                         return NULL;
                     }
                     co_recurse(result = qmp_read_line_co(coroutine, state, channel,
-                                                         FALSE, skip_events, errp));
+                                                         FALSE, skip_events, raw,
+                                                         errp));
                     return result;
                 }
             }
@@ -208,6 +256,17 @@ static ColodQmpResult *_qmp_read_line_co(Coroutine *coroutine,
             return NULL;
         }
 
+        // Everything but events is passed on unparsed in raw mode
+        if (raw && json_scan_member(CO line, CO len, "event", NULL, NULL) == 0) {
+            if (!channel->discard_events) {
+                colod_trace("%s", CO line);
+            }
+            result = g_new0(ColodQmpResult, 1);
+            result->line = CO line;
+            result->len = CO len;
+            break;
+        }
+
         result = qmp_parse_result(CO line, CO len, errp);
         if (!result) {
             return NULL;
@@ -245,6 +304,7 @@ static ColodQmpResult *__qmp_execute_co(Coroutine *coroutine,
                                         ColodQmpState *state,
                                         QmpChannel *channel,
                                         gboolean yank,
+                                        gboolean raw,
                                         GError **errp,
                                         const gchar *command) {
     ColodQmpResult *result;
@@ -269,7 +329,7 @@ static ColodQmpResult *__qmp_execute_co(Coroutine *coroutine,
     }
 
     co_recurse(result = qmp_read_line_co(coroutine, state, channel, yank, TRUE,
-                                         &local_errp));
+                                         raw, &local_errp));
     colod_unlock_co(channel->lock);
     state->inflight--;
     if (!result) {
@@ -283,14 +343,37 @@ static ColodQmpResult *__qmp_execute_co(Coroutine *coroutine,
     return result;
 }
 
+static ColodQmpResult *__qmp_execute_role_co(Coroutine *coroutine,
+                                             ColodQmpState *state,
+                                             QmpRole role,
+                                             gboolean raw,
+                                             GError **errp,
+                                             const gchar *command) {
+    struct {
+        QmpChannel *channel;
+    } *co;
+    ColodQmpResult *result;
+
+    co_frame(co, sizeof(*co));
+    co_begin(ColodQmpResult *, NULL);
+
+    CO channel = qmp_channel_for(state, role);
+    co_recurse(result = ___qmp_execute_co(coroutine, state, CO channel, TRUE,
+                                          raw, errp, command));
+
+    co_end;
+
+    return result;
+}
+
 ColodQmpResult *_qmp_execute_co(Coroutine *coroutine,
                                 ColodQmpState *state,
                                 GError **errp,
                                 const gchar *command) {
     ColodQmpResult *result;
 
-    result = __qmp_execute_co(coroutine, state, &state->channel, TRUE, errp,
-                              command);
+    result = __qmp_execute_role_co(coroutine, state, QMP_ROLE_CRITICAL, FALSE,
+                                   errp, command);
     if (coroutine->yield) {
         return NULL;
     }
@@ -312,8 +395,23 @@ ColodQmpResult *_qmp_execute_nocheck_co(Coroutine *coroutine,
                                         ColodQmpState *state,
                                         GError **errp,
                                         const gchar *command) {
-    return __qmp_execute_co(coroutine, state, &state->channel, TRUE, errp,
-                            command);
+    return __qmp_execute_role_co(coroutine, state, QMP_ROLE_CRITICAL, FALSE,
+                                 errp, command);
+}
+
+ColodQmpResult *_qmp_execute_role_co(Coroutine *coroutine,
+                                     ColodQmpState *state,
+                                     QmpRole role,
+                                     GError **errp,
+                                     const gchar *command) {
+    return __qmp_execute_role_co(coroutine, state, role, FALSE, errp,
+                                 command);
+}
+
+ColodQmpResult *_qmp_relay_co(Coroutine *coroutine, ColodQmpState *state,
+                              GError **errp, const gchar *command) {
+    return __qmp_execute_role_co(coroutine, state, QMP_ROLE_CLIENT, TRUE,
+                                 errp, command);
 }
 
 static gchar *pick_yank_instances(JsonNode *result,
@@ -358,7 +456,7 @@ int _qmp_yank_co(Coroutine *coroutine, ColodQmpState *state,
     co_begin(int, -1);
 
     co_recurse(result = ___qmp_execute_co(coroutine, state, &state->yank_channel,
-                               FALSE, errp,
+                               FALSE, FALSE, errp,
                                "{'exec-oob': 'query-yank', 'id': 'yank0'}\n"));
     if (!result) {
         return -1;
@@ -379,7 +477,7 @@ int _qmp_yank_co(Coroutine *coroutine, ColodQmpState *state,
     qmp_result_free(result);
 
     co_recurse(result = ___qmp_execute_co(coroutine, state, &state->yank_channel,
-                                          FALSE, errp, CO command));
+                                          FALSE, FALSE, errp, CO command));
     if (!result) {
         g_free(CO command);
         return -1;
@@ -440,7 +538,7 @@ static gboolean _qmp_handshake_readable_co(Coroutine *coroutine) {
     co_begin(gboolean, G_SOURCE_CONTINUE);
 
     co_recurse(result = qmp_read_line_co(coroutine, qmp, qmpco->channel,
-                                         FALSE, TRUE, &local_errp));
+                                         FALSE, TRUE, FALSE, &local_errp));
     if (!result) {
         colod_unlock_co(qmpco->channel->lock);
         colod_trace("%s:%u: %s\n", __func__, __LINE__, local_errp->message);
@@ -451,7 +549,8 @@ static gboolean _qmp_handshake_readable_co(Coroutine *coroutine) {
     colod_trace("%s", result->line);
     qmp_result_free(result);
 
-    co_recurse(result = ___qmp_execute_co(coroutine, qmp, qmpco->channel, FALSE, &local_errp,
+    co_recurse(result = ___qmp_execute_co(coroutine, qmp, qmpco->channel, FALSE,
+                                          FALSE, &local_errp,
                                           "{'execute': 'qmp_capabilities', "
                                           "'arguments': {'enable': ['oob']}}\n"));
     colod_unlock_co(qmpco->channel->lock);
@@ -612,7 +711,7 @@ static gboolean _qmp_event_co(Coroutine *coroutine) {
         colod_lock_co(channel->lock);
 
         co_recurse(result = qmp_read_line_co(coroutine, qmpco->state, channel,
-                                             FALSE, FALSE, &local_errp));
+                                             FALSE, FALSE, FALSE, &local_errp));
         colod_unlock_co(channel->lock);
         if (!result) {
             colod_trace("%s:%u: %s\n", __func__, __LINE__, local_errp->message);
@@ -685,6 +784,10 @@ void qmp_set_yank_instances(ColodQmpState *state, JsonNode *instances) {
     state->yank_instances = json_node_ref(instances);
 }
 
+JsonNode *qmp_get_yank_instances(ColodQmpState *state) {
+    return state->yank_instances;
+}
+
 void qmp_set_timeout(ColodQmpState *state, guint timeout) {
     assert(timeout);
 
@@ -702,11 +805,20 @@ void qmp_free(ColodQmpState *state) {
 
     colod_shutdown_channel(state->yank_channel.channel);
     colod_shutdown_channel(state->channel.channel);
+    for (guint i = 0; i < state->monitors->len; i++) {
+        QmpChannel *channel = g_ptr_array_index(state->monitors, i);
+        colod_shutdown_channel(channel->channel);
+    }
 
     while (state->inflight) {
         g_main_context_iteration(g_main_context_default(), TRUE);
     }
 
+    for (guint i = 0; i < state->monitors->len; i++) {
+        QmpChannel *channel = g_ptr_array_index(state->monitors, i);
+        g_io_channel_unref(channel->channel);
+    }
+    g_ptr_array_free(state->monitors, TRUE);
     g_io_channel_unref(state->yank_channel.channel);
     g_io_channel_unref(state->channel.channel);
     g_free(state);
@@ -731,6 +843,8 @@ ColodQmpState *qmp_new(int fd, int yank_fd, guint timeout, GError **errp) {
         return NULL;
     }
 
+    state->monitors = g_ptr_array_new_with_free_func(g_free);
+
     qmp_handshake_coroutine(state, &state->channel);
     qmp_handshake_coroutine(state, &state->yank_channel);
     qmp_event_coroutine(state, &state->channel);
@@ -741,3 +855,25 @@ ColodQmpState *qmp_new(int fd, int yank_fd, guint timeout, GError **errp) {
 
     return state;
 }
+
+int qmp_add_monitor(ColodQmpState *state, int fd, QmpRole role,
+                    GError **errp) {
+    QmpChannel *channel;
+
+    assert(role < QMP_ROLE_MAX);
+
+    channel = g_new0(QmpChannel, 1);
+    channel->channel = colod_create_channel(fd, errp);
+    if (!channel->channel) {
+        g_free(channel);
+        return -1;
+    }
+    // qemu sends events to every monitor, they are handled on the main one
+    channel->discard_events = TRUE;
+    channel->role = role;
+    g_ptr_array_add(state->monitors, channel);
+
+    qmp_handshake_coroutine(state, channel);
+    qmp_event_coroutine(state, channel);
+    return 0;
+}
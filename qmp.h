@@ -26,6 +26,20 @@ typedef struct ColodQmpResult {
     gsize len;
 } ColodQmpResult;
 
+// What an additional monitor is used for, see qmp_add_monitor()
+typedef enum QmpRole {
+    // Commands of the main coroutine
+    QMP_ROLE_CRITICAL,
+    // Health checks
+    QMP_ROLE_HEALTH,
+    // Passthrough commands of clients
+    QMP_ROLE_CLIENT,
+    QMP_ROLE_MAX
+} QmpRole;
+
+int qmp_role_from_str(const gchar *str, QmpRole *role);
+const gchar *qmp_role_str(QmpRole role);
+
 typedef void (*QmpYankCallback)(gpointer user_data);
 typedef void (*QmpEventCallback)(gpointer user_data, ColodQmpResult *event);
 
@@ -35,6 +49,14 @@ ColodQmpResult *qmp_parse_result(gchar *line, gsize len, GError **errp);
 ColodQmpState *qmp_new(int fd, int yank_fd, guint timeout, GError **errp);
 void qmp_free(ColodQmpState *state);
 
+/*
+ * Use the monitor on fd for the commands of role instead of the main
+ * monitor. Events are only consumed from the main monitor. With several
+ * monitors for one role, an idle one is picked.
+ */
+int qmp_add_monitor(ColodQmpState *state, int fd, QmpRole role,
+                    GError **errp);
+
 #define qmp_execute_co(...) \
     co_wrap(_qmp_execute_co(__VA_ARGS__))
 ColodQmpResult *_qmp_execute_co(Coroutine *coroutine,
@@ -49,6 +71,22 @@ ColodQmpResult *_qmp_execute_nocheck_co(Coroutine *coroutine,
                                         GError **errp,
                                         const gchar *command);
 
+// Like qmp_execute_nocheck_co, on a monitor of role
+#define qmp_execute_role_co(...) \
+    co_wrap(_qmp_execute_role_co(__VA_ARGS__))
+ColodQmpResult *_qmp_execute_role_co(Coroutine *coroutine,
+                                     ColodQmpState *state,
+                                     QmpRole role,
+                                     GError **errp,
+                                     const gchar *command);
+
+// Forward command to qemu on a monitor with the client role and return
+// the reply without parsing it, so json_root of the result is NULL
+#define qmp_relay_co(...) \
+    co_wrap(_qmp_relay_co(__VA_ARGS__))
+ColodQmpResult *_qmp_relay_co(Coroutine *coroutine, ColodQmpState *state,
+                              GError **errp, const gchar *command);
+
 #define qmp_yank_co(...) \
     co_wrap(_qmp_yank_co(__VA_ARGS__))
 int _qmp_yank_co(Coroutine *coroutine, ColodQmpState *state,
@@ -78,6 +116,8 @@ void qmp_clear_yank(ColodQmpState *state);
 
 guint qmp_hup_source(ColodQmpState *state, GIOFunc func, gpointer data);
 void qmp_set_yank_instances(ColodQmpState *state, JsonNode *instances);
+// Borrowed reference, NULL if never set
+JsonNode *qmp_get_yank_instances(ColodQmpState *state);
 void qmp_set_timeout(ColodQmpState *state, guint timeout);
 
 #endif // QMP_H
@@ -0,0 +1,186 @@
+/*
+ * COLO background daemon
+ *
+ * Copyright (c) Lukas Straub <lukasstraub2@web.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <arpa/inet.h>
+
+#include <glib-2.0/glib.h>
+
+#include "base_types.h"
+#include "smoketest.h"
+#include "coroutine_stack.h"
+#include "smoke_util.h"
+#include "main_coroutine.h"
+#include "cpg.h"
+
+// Wire layout of the snapshot multicast by main_coroutine.c
+typedef struct TestSnapshot {
+    uint32_t epoch;
+    uint32_t version;
+    uint32_t state;
+    uint32_t flags;
+} TestSnapshot;
+
+// primary-colo-running with the primary and replication flags
+#define TEST_STATE 6
+#define TEST_FLAGS 3
+
+struct SmokeTestcase {
+    Coroutine coroutine;
+    SmokeColodContext *sctx;
+    gboolean do_quit, quit;
+};
+
+static void peer_snapshot(SmokeTestcase *this, uint32_t epoch,
+                          uint32_t version, uint32_t state, uint32_t flags) {
+    TestSnapshot snapshot = {
+        .epoch = epoch,
+        .version = htonl(version),
+        .state = htonl(state),
+        .flags = htonl(flags)
+    };
+
+    colod_cpg_stub_notify_payload(this->sctx->cctx.cpg, MESSAGE_SNAPSHOT,
+                                  FALSE, &snapshot, sizeof(snapshot));
+}
+
+static void test_snapshot(SmokeTestcase *this) {
+    ColodMainCoroutine *main_coroutine = this->sctx->cctx.main_coroutine;
+    ColodPeerState peer;
+
+    colod_query_peer_state(main_coroutine, &peer);
+    g_assert_false(peer.valid);
+
+    peer_snapshot(this, 1, 2, TEST_STATE, TEST_FLAGS);
+    colod_query_peer_state(main_coroutine, &peer);
+    g_assert_true(peer.valid);
+    g_assert_cmpuint(peer.version, ==, 2);
+    g_assert_cmpstr(peer.state.state, ==, "primary-colo-running");
+    g_assert_true(peer.state.primary && peer.state.replication);
+    g_assert_false(peer.state.failed || peer.state.yellow);
+
+    // Reordered or duplicate snapshots are ignored
+    peer_snapshot(this, 1, 1, 0, 0);
+    peer_snapshot(this, 1, 2, 0, 0);
+    colod_query_peer_state(main_coroutine, &peer);
+    g_assert_cmpuint(peer.version, ==, 2);
+    g_assert_true(peer.state.primary);
+
+    // Hello retransmits don't invalidate the snapshot
+    colod_cpg_stub_notify(this->sctx->cctx.cpg, MESSAGE_HELLO, FALSE, FALSE);
+    colod_cpg_stub_notify(this->sctx->cctx.cpg, MESSAGE_HELLO, FALSE, FALSE);
+    colod_query_peer_state(main_coroutine, &peer);
+    g_assert_true(peer.valid);
+
+    // A restarted peer starts over with a new epoch
+    peer_snapshot(this, 2, 1, 0, 0);
+    colod_query_peer_state(main_coroutine, &peer);
+    g_assert_true(peer.valid);
+    g_assert_cmpuint(peer.version, ==, 1);
+    g_assert_cmpstr(peer.state.state, ==, "secondary-startup");
+    g_assert_false(peer.state.primary);
+
+    // Garbage state numbers don't index out of bounds
+    peer_snapshot(this, 2, 2, 1000, 0);
+    colod_query_peer_state(main_coroutine, &peer);
+    g_assert_cmpstr(peer.state.state, ==, "unknown");
+}
+
+static gboolean _testcase_co(Coroutine *coroutine, SmokeTestcase *this) {
+    co_begin(gboolean, G_SOURCE_CONTINUE);
+
+    g_timeout_add(200, coroutine->cb.plain, this);
+    co_yield_int(G_SOURCE_REMOVE);
+
+    test_snapshot(this);
+
+    colod_quit(this->sctx->cctx.main_coroutine);
+
+    assert(!this->do_quit);
+    while (!this->do_quit) {
+        progress_source_add(coroutine->cb.plain, this);
+        co_yield_int(G_SOURCE_REMOVE);
+    }
+    this->quit = TRUE;
+    co_end;
+
+    return G_SOURCE_REMOVE;
+}
+
+static gboolean testcase_co(gpointer data) {
+    SmokeTestcase *this = data;
+    Coroutine *coroutine = data;
+    gboolean ret;
+
+    co_enter(coroutine, ret = _testcase_co(coroutine, this));
+    if (coroutine->yield) {
+        return GPOINTER_TO_INT(coroutine->yield_value);
+    }
+
+    colod_assert_remove_one_source(coroutine);
+    return ret;
+}
+
+static gboolean testcase_co_wrap(
+        G_GNUC_UNUSED GIOChannel *channel,
+        G_GNUC_UNUSED GIOCondition revents,
+        gpointer data) {
+    return testcase_co(data);
+}
+
+static SmokeTestcase *testcase_new(SmokeColodContext *sctx) {
+    SmokeTestcase *this;
+    Coroutine *coroutine;
+
+    this = g_new0(SmokeTestcase, 1);
+    coroutine = &this->coroutine;
+    coroutine->cb.plain = testcase_co;
+    coroutine->cb.iofunc = testcase_co_wrap;
+    this->sctx = sctx;
+
+    sctx->cctx.qmp_timeout_low = 10;
+
+    g_idle_add(testcase_co, this);
+    return this;
+}
+
+static void testcase_free(SmokeTestcase *this) {
+    this->do_quit = TRUE;
+
+    while (!this->quit) {
+        g_main_context_iteration(g_main_context_default(), TRUE);
+    }
+
+    g_free(this);
+}
+
+static void test_run() {
+    GError *errp = NULL;
+    SmokeColodContext *sctx;
+    SmokeTestcase *testcase;
+
+    sctx = smoke_context_new(&errp);
+    g_assert_true(sctx);
+
+    testcase = testcase_new(sctx);
+
+    daemon_mainloop(&sctx->cctx);
+
+    testcase_free(testcase);
+    smoke_context_free(sctx);
+}
+
+int main(int argc, char **argv) {
+    smoke_init();
+
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/snapshot/exchange", test_run);
+
+    return g_test_run();
+}
@@ -0,0 +1,153 @@
+/*
+ * COLO background daemon shared memory status page
+ *
+ * Copyright (c) Lukas Straub <lukasstraub2@web.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <glib-2.0/glib.h>
+
+#include "status_page.h"
+#include "util.h"
+
+// A writer dying in the middle of an update leaves seq odd
+#define STATUS_PAGE_READ_RETRIES 1000
+
+struct ColodStatusPage {
+    StatusPage *map;
+};
+
+static void status_page_write_begin(StatusPage *map) {
+    uint32_t seq = __atomic_load_n(&map->seq, __ATOMIC_RELAXED);
+
+    // Recover from a previous writer that died in the middle of an update
+    __atomic_store_n(&map->seq, (seq | 1) + (seq & 1 ? 2 : 0),
+                     __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void status_page_write_end(StatusPage *map) {
+    uint32_t seq = __atomic_load_n(&map->seq, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&map->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+void status_page_write(ColodStatusPage *this, const StatusPageData *data) {
+    status_page_write_begin(this->map);
+    memcpy(&this->map->data, data, sizeof(*data));
+    status_page_write_end(this->map);
+}
+
+ColodStatusPage *status_page_new(const gchar *path, GError **errp) {
+    ColodStatusPage *this;
+    StatusPage *map;
+    int fd;
+
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        colod_error_set(errp, "Failed to open %s: %s", path,
+                        g_strerror(errno));
+        return NULL;
+    }
+
+    if (ftruncate(fd, STATUS_PAGE_SIZE) < 0) {
+        colod_error_set(errp, "Failed to resize %s: %s", path,
+                        g_strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    map = mmap(NULL, STATUS_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+               fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        colod_error_set(errp, "Failed to map %s: %s", path, g_strerror(errno));
+        return NULL;
+    }
+
+    // Readers may still have the page of the previous daemon mapped, so
+    // keep its seq going
+    status_page_write_begin(map);
+    memset(&map->data, 0, sizeof(map->data));
+    map->magic = STATUS_PAGE_MAGIC;
+    map->layout = STATUS_PAGE_LAYOUT;
+    status_page_write_end(map);
+
+    this = g_new0(ColodStatusPage, 1);
+    this->map = map;
+    return this;
+}
+
+void status_page_free(ColodStatusPage *this) {
+    if (!this) {
+        return;
+    }
+
+    munmap(this->map, STATUS_PAGE_SIZE);
+    g_free(this);
+}
+
+const StatusPage *status_page_map(const gchar *path, GError **errp) {
+    struct stat st;
+    StatusPage *map;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        colod_error_set(errp, "Failed to open %s: %s", path,
+                        g_strerror(errno));
+        return NULL;
+    }
+
+    if (fstat(fd, &st) < 0 || st.st_size < STATUS_PAGE_SIZE) {
+        colod_error_set(errp, "%s is not a status page", path);
+        close(fd);
+        return NULL;
+    }
+
+    map = mmap(NULL, STATUS_PAGE_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        colod_error_set(errp, "Failed to map %s: %s", path, g_strerror(errno));
+        return NULL;
+    }
+
+    return map;
+}
+
+void status_page_unmap(const StatusPage *page) {
+    munmap((void *) page, STATUS_PAGE_SIZE);
+}
+
+int status_page_read(const StatusPage *page, StatusPageData *ret) {
+    for (guint i = 0; i < STATUS_PAGE_READ_RETRIES; i++) {
+        uint32_t seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+
+        if (seq & 1) {
+            continue;
+        }
+
+        if (page->magic != STATUS_PAGE_MAGIC
+                || page->layout != STATUS_PAGE_LAYOUT) {
+            return -1;
+        }
+
+        memcpy(ret, &page->data, sizeof(*ret));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+        if (__atomic_load_n(&page->seq, __ATOMIC_RELAXED) == seq) {
+            return 0;
+        }
+    }
+
+    return -1;
+}
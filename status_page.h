@@ -0,0 +1,97 @@
+/*
+ * COLO background daemon shared memory status page
+ *
+ * Copyright (c) Lukas Straub <lukasstraub2@web.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef STATUS_PAGE_H
+#define STATUS_PAGE_H
+
+#include <stdint.h>
+
+#include <glib-2.0/glib.h>
+
+/*
+ * The daemon keeps its status in a file in the base directory that local
+ * readers mmap, so polling it costs no syscalls and no work in the daemon.
+ * The layout is fixed and in host byte order, readers on the same host
+ * only need this header and status_page_map()/status_page_read().
+ *
+ * The data is protected by a seqlock: the writer makes seq odd while it
+ * updates the data and even again when it is done. A reader copies the
+ * data and retries if seq was odd or changed meanwhile.
+ */
+
+#define STATUS_PAGE_MAGIC 0x45474150444f4c43ULL // "CLODPAGE"
+#define STATUS_PAGE_LAYOUT 1
+#define STATUS_PAGE_SIZE 4096
+#define STATUS_PAGE_NAME_MAX 32
+
+enum {
+    STATUS_PAGE_PRIMARY = 1 << 0,
+    STATUS_PAGE_REPLICATION = 1 << 1,
+    STATUS_PAGE_FAILED = 1 << 2,
+    STATUS_PAGE_PEER_FAILOVER = 1 << 3,
+    STATUS_PAGE_PEER_FAILED = 1 << 4,
+    STATUS_PAGE_YELLOW = 1 << 5,
+    STATUS_PAGE_PEER_YELLOW = 1 << 6,
+    STATUS_PAGE_QUIT = 1 << 7
+};
+
+typedef struct StatusPageData {
+    // Wall clock time in us of the last update
+    int64_t updated;
+    int32_t pid;
+    uint32_t state;
+    uint32_t flags;
+    char state_name[STATUS_PAGE_NAME_MAX];
+
+    // The peer fields are only meaningful if peer_valid is set
+    uint32_t peer_valid;
+    uint32_t peer_version;
+    uint32_t peer_flags;
+    char peer_state_name[STATUS_PAGE_NAME_MAX];
+
+    uint32_t yellow_score;
+    uint32_t yellow_penalty;
+    uint32_t yellow_suppressed;
+
+    // Wall clock times in us, 0 if there was no failover yet
+    int64_t failover_start;
+    int64_t failover_end;
+    int64_t failover_duration;
+    char failover_result[STATUS_PAGE_NAME_MAX];
+
+    uint64_t transitions;
+    uint64_t failovers;
+    uint64_t heartbeat_missed;
+    uint64_t heartbeat_samples;
+    int64_t heartbeat_srtt;
+} StatusPageData;
+
+typedef struct StatusPage {
+    uint64_t magic;
+    uint32_t layout;
+    uint32_t seq;
+    StatusPageData data;
+} StatusPage;
+
+G_STATIC_ASSERT(sizeof(StatusPage) <= STATUS_PAGE_SIZE);
+
+typedef struct ColodStatusPage ColodStatusPage;
+
+// Writer side, used by the daemon
+ColodStatusPage *status_page_new(const gchar *path, GError **errp);
+void status_page_write(ColodStatusPage *this, const StatusPageData *data);
+void status_page_free(ColodStatusPage *this);
+
+// Reader side
+const StatusPage *status_page_map(const gchar *path, GError **errp);
+void status_page_unmap(const StatusPage *page);
+// Returns -1 if no consistent snapshot could be read
+int status_page_read(const StatusPage *page, StatusPageData *ret);
+
+#endif // STATUS_PAGE_H
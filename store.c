@@ -0,0 +1,259 @@
+/*
+ * COLO background daemon client store
+ *
+ * Copyright (c) Lukas Straub <lukasstraub2@web.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <assert.h>
+
+#include <glib-2.0/glib.h>
+#include <json-glib-1.0/json-glib/json-glib.h>
+
+#include "store.h"
+#include "util.h"
+#include "json_util.h"
+
+struct ColodStore {
+    gchar *path;
+    // Always holds an object. Nodes are never modified once they are in
+    // the store, so changes share the members they don't touch.
+    JsonNode *root;
+    guint64 version;
+    gchar *serialized;
+};
+
+static JsonNode *store_node_new(JsonObject *object) {
+    JsonNode *node = json_node_alloc();
+
+    json_node_init_object(node, object);
+    json_object_unref(object);
+    return node;
+}
+
+// Copy of the object in node that shares its members
+static JsonObject *store_copy_object(JsonNode *node) {
+    JsonObject *copy = json_object_new();
+    JsonObject *object;
+    GList *members;
+
+    if (!node || !JSON_NODE_HOLDS_OBJECT(node)) {
+        return copy;
+    }
+
+    object = json_node_get_object(node);
+    members = json_object_get_members(object);
+    for (GList *entry = members; entry; entry = entry->next) {
+        const gchar *name = entry->data;
+        json_object_set_member(copy, name,
+                               json_node_copy(json_object_get_member(object,
+                                                                     name)));
+    }
+    g_list_free(members);
+
+    return copy;
+}
+
+JsonNode *store_merge_patch(JsonNode *target, JsonNode *patch) {
+    JsonObject *result, *patch_object;
+    GList *members;
+
+    if (!JSON_NODE_HOLDS_OBJECT(patch)) {
+        return json_node_copy(patch);
+    }
+
+    result = store_copy_object(target);
+    patch_object = json_node_get_object(patch);
+    members = json_object_get_members(patch_object);
+    for (GList *entry = members; entry; entry = entry->next) {
+        const gchar *name = entry->data;
+        JsonNode *value = json_object_get_member(patch_object, name);
+
+        if (JSON_NODE_HOLDS_NULL(value)) {
+            if (json_object_has_member(result, name)) {
+                json_object_remove_member(result, name);
+            }
+        } else {
+            JsonNode *old = json_object_get_member(result, name);
+            json_object_set_member(result, name,
+                                   store_merge_patch(old, value));
+        }
+    }
+    g_list_free(members);
+
+    return store_node_new(result);
+}
+
+static int store_check_version(ColodStore *this, gint64 if_version,
+                               GError **errp) {
+    if (if_version >= 0 && (guint64) if_version != this->version) {
+        colod_error_set(errp, "Store is at version %" G_GUINT64_FORMAT
+                        ", not %" G_GINT64_FORMAT, this->version, if_version);
+        return -1;
+    }
+
+    return 0;
+}
+
+// Takes ownership of root. It only replaces the store once it is persisted.
+static int store_commit(ColodStore *this, JsonNode *root, GError **errp) {
+    gchar *serialized = NULL;
+
+    if (this->path) {
+        gchar *contents;
+        gboolean ret;
+
+        serialized = json_to_string(root, FALSE);
+        contents = g_strdup_printf("{\"version\": %" G_GUINT64_FORMAT ","
+                                   " \"store\": %s}\n",
+                                   this->version + 1, serialized);
+        ret = g_file_set_contents(this->path, contents, -1, errp);
+        g_free(contents);
+        if (!ret) {
+            g_free(serialized);
+            json_node_unref(root);
+            return -1;
+        }
+    }
+
+    json_node_unref(this->root);
+    this->root = root;
+    g_free(this->serialized);
+    this->serialized = serialized;
+    this->version++;
+    return 0;
+}
+
+guint64 store_version(ColodStore *this) {
+    return this->version;
+}
+
+const gchar *store_serialized(ColodStore *this) {
+    if (!this->serialized) {
+        this->serialized = json_to_string(this->root, FALSE);
+    }
+
+    return this->serialized;
+}
+
+JsonNode *store_get(ColodStore *this, const gchar *key) {
+    return get_member_node(this->root, key);
+}
+
+int store_set(ColodStore *this, JsonNode *store, gint64 if_version,
+              GError **errp) {
+    if (store_check_version(this, if_version, errp) < 0) {
+        return -1;
+    }
+
+    if (!JSON_NODE_HOLDS_OBJECT(store)) {
+        colod_error_set(errp, "Store must be an object");
+        return -1;
+    }
+
+    return store_commit(this, json_node_copy(store), errp);
+}
+
+int store_set_key(ColodStore *this, const gchar *key, JsonNode *value,
+                  gint64 if_version, GError **errp) {
+    JsonObject *object;
+
+    if (store_check_version(this, if_version, errp) < 0) {
+        return -1;
+    }
+
+    object = store_copy_object(this->root);
+    if (!value || JSON_NODE_HOLDS_NULL(value)) {
+        if (json_object_has_member(object, key)) {
+            json_object_remove_member(object, key);
+        }
+    } else {
+        json_object_set_member(object, key, json_node_copy(value));
+    }
+
+    return store_commit(this, store_node_new(object), errp);
+}
+
+int store_patch(ColodStore *this, JsonNode *patch, gint64 if_version,
+                GError **errp) {
+    if (store_check_version(this, if_version, errp) < 0) {
+        return -1;
+    }
+
+    if (!JSON_NODE_HOLDS_OBJECT(patch)) {
+        colod_error_set(errp, "Patch must be an object");
+        return -1;
+    }
+
+    return store_commit(this, store_merge_patch(this->root, patch), errp);
+}
+
+int store_load(ColodStore *this, GError **errp) {
+    GError *local_errp = NULL;
+    gchar *contents;
+    JsonNode *node, *store, *version;
+    int ret = -1;
+
+    if (!this->path) {
+        return 0;
+    }
+
+    if (!g_file_get_contents(this->path, &contents, NULL, &local_errp)) {
+        if (g_error_matches(local_errp, G_FILE_ERROR, G_FILE_ERROR_NOENT)) {
+            g_error_free(local_errp);
+            return 0;
+        }
+        g_propagate_error(errp, local_errp);
+        return -1;
+    }
+
+    node = json_from_string(contents, &local_errp);
+    g_free(contents);
+    if (!node) {
+        if (local_errp) {
+            g_propagate_error(errp, local_errp);
+        } else {
+            colod_error_set(errp, "Store file %s is empty", this->path);
+        }
+        return -1;
+    }
+
+    if (!JSON_NODE_HOLDS_OBJECT(node)
+            || !(store = get_member_node(node, "store"))
+            || !JSON_NODE_HOLDS_OBJECT(store)
+            || !(version = get_member_node(node, "version"))
+            || !JSON_NODE_HOLDS_VALUE(version)
+            || json_node_get_value_type(version) != G_TYPE_INT64) {
+        colod_error_set(errp, "Invalid store file %s", this->path);
+        goto out;
+    }
+
+    json_node_unref(this->root);
+    this->root = json_node_copy(store);
+    this->version = json_node_get_int(version);
+    g_free(this->serialized);
+    this->serialized = NULL;
+    ret = 0;
+
+out:
+    json_node_unref(node);
+    return ret;
+}
+
+ColodStore *store_new(const gchar *path) {
+    ColodStore *this;
+
+    this = g_new0(ColodStore, 1);
+    this->path = g_strdup(path);
+    this->root = store_node_new(json_object_new());
+    return this;
+}
+
+void store_free(ColodStore *this) {
+    json_node_unref(this->root);
+    g_free(this->serialized);
+    g_free(this->path);
+    g_free(this);
+}
@@ -0,0 +1,47 @@
+/*
+ * COLO background daemon client store
+ *
+ * Copyright (c) Lukas Straub <lukasstraub2@web.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef STORE_H
+#define STORE_H
+
+#include <glib-2.0/glib.h>
+#include <json-glib-1.0/json-glib/json-glib.h>
+
+/*
+ * Json object clients keep their data in. Every change bumps the version.
+ * A change given an if_version >= 0 is only applied if the store is still
+ * at that version, so concurrent clients don't lose each others updates.
+ * If the store has a path, it is written there atomically on every change
+ * and loaded again with store_load().
+ */
+typedef struct ColodStore ColodStore;
+
+guint64 store_version(ColodStore *this);
+// Cached until the next change
+const gchar *store_serialized(ColodStore *this);
+// Borrowed reference, NULL if key is missing
+JsonNode *store_get(ColodStore *this, const gchar *key);
+
+int store_set(ColodStore *this, JsonNode *store, gint64 if_version,
+              GError **errp);
+// Removes key if value is NULL or json null
+int store_set_key(ColodStore *this, const gchar *key, JsonNode *value,
+                  gint64 if_version, GError **errp);
+// Apply a json merge patch (RFC 7396)
+int store_patch(ColodStore *this, JsonNode *patch, gint64 if_version,
+                GError **errp);
+
+// New node with patch applied to target (RFC 7396), target may be NULL
+JsonNode *store_merge_patch(JsonNode *target, JsonNode *patch);
+
+int store_load(ColodStore *this, GError **errp);
+ColodStore *store_new(const gchar *path);
+void store_free(ColodStore *this);
+
+#endif // STORE_H
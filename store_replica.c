@@ -0,0 +1,745 @@
+/*
+ * COLO background daemon replicated client store
+ *
+ * Copyright (c) Lukas Straub <lukasstraub2@web.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <assert.h>
+#include <string.h>
+
+#include <glib-2.0/glib.h>
+#include <json-glib-1.0/json-glib/json-glib.h>
+
+#include "store_replica.h"
+#include "store.h"
+#include "daemon.h"
+#include "util.h"
+#include "json_util.h"
+#include "coroutine_stack.h"
+
+/*
+ * MESSAGE_STORE payloads are json objects with the sending node in "node"
+ * and either
+ *   "ticket" and "set" or "patch": a write, applied by every member, or
+ *   "version", "seen" and "sync": the keys of the sender with their
+ *   versions, the sum of all of them and the last ticket the sender applied
+ *   from each node, merged by the other members.
+ *
+ * "node" is the nodeid and the start time of the daemon, so a restarted
+ * daemon counts its writes from zero without them looking older than the
+ * ones before the restart.
+ */
+
+// Time in ms to wait for our own write to come back from cpg
+#define STORE_REPLICA_TIMEOUT 5000
+
+typedef struct ReplicaEntry {
+    // NULL if the key was removed. The entry is kept so the removal is
+    // versioned like any other write.
+    JsonNode *value;
+    // Number of writes to this key per node
+    JsonObject *version;
+    // The write that last set the value and the view it was applied in,
+    // writer is NULL if the value came from a sync
+    gchar *writer;
+    gint64 ticket;
+    guint64 view;
+} ReplicaEntry;
+
+typedef struct ReplicaWaiter {
+    guint64 ticket;
+    Coroutine *coroutine;
+    guint source_id;
+} ReplicaWaiter;
+
+struct ColodStoreReplica {
+    Cpg *cpg;
+    gchar *node;
+    GHashTable *entries;
+    gchar *serialized;
+    // Tickets of our own writes
+    guint64 sent, applied;
+    // Last ticket applied per node
+    JsonObject *seen;
+    GQueue waiters;
+    guint sync_source_id;
+    // Incremented whenever the cpg membership changes
+    guint64 view, synced_view;
+    guint view_member_count;
+    CpgMember view_members[CPG_MEMBERS_MAX];
+};
+
+typedef enum VersionOrder {
+    VERSION_EQUAL,
+    VERSION_BEFORE,
+    VERSION_AFTER,
+    VERSION_CONCURRENT
+} VersionOrder;
+
+static gint64 version_get(JsonObject *version, const gchar *node) {
+    JsonNode *count;
+
+    if (!version || !(count = json_object_get_member(version, node))) {
+        return 0;
+    }
+
+    return json_node_get_int(count);
+}
+
+static gboolean version_valid(JsonNode *node) {
+    JsonObject *version;
+    GList *members;
+    gboolean valid = TRUE;
+
+    if (!node || !JSON_NODE_HOLDS_OBJECT(node)) {
+        return FALSE;
+    }
+
+    version = json_node_get_object(node);
+    members = json_object_get_members(version);
+    for (GList *entry = members; entry; entry = entry->next) {
+        JsonNode *count = json_object_get_member(version, entry->data);
+        if (!JSON_NODE_HOLDS_VALUE(count)
+                || json_node_get_value_type(count) != G_TYPE_INT64
+                || json_node_get_int(count) < 0) {
+            valid = FALSE;
+            break;
+        }
+    }
+    g_list_free(members);
+
+    return valid;
+}
+
+static void version_compare_members(JsonObject *a, JsonObject *b,
+                                    JsonObject *members_of,
+                                    gboolean *less, gboolean *greater) {
+    GList *members;
+
+    if (!members_of) {
+        return;
+    }
+
+    members = json_object_get_members(members_of);
+    for (GList *entry = members; entry; entry = entry->next) {
+        gint64 count_a = version_get(a, entry->data);
+        gint64 count_b = version_get(b, entry->data);
+
+        if (count_a < count_b) {
+            *less = TRUE;
+        } else if (count_a > count_b) {
+            *greater = TRUE;
+        }
+    }
+    g_list_free(members);
+}
+
+// Order of a relative to b, NULL is the empty version
+static VersionOrder version_compare(JsonObject *a, JsonObject *b) {
+    gboolean less = FALSE, greater = FALSE;
+
+    version_compare_members(a, b, a, &less, &greater);
+    version_compare_members(a, b, b, &less, &greater);
+
+    if (less && greater) {
+        return VERSION_CONCURRENT;
+    } else if (less) {
+        return VERSION_BEFORE;
+    } else if (greater) {
+        return VERSION_AFTER;
+    }
+    return VERSION_EQUAL;
+}
+
+static void version_merge(JsonObject *into, JsonObject *from) {
+    GList *members = json_object_get_members(from);
+
+    for (GList *entry = members; entry; entry = entry->next) {
+        const gchar *node = entry->data;
+        gint64 count = version_get(from, node);
+
+        if (count > version_get(into, node)) {
+            json_object_set_int_member(into, node, count);
+        }
+    }
+    g_list_free(members);
+}
+
+static gint64 version_sum(JsonObject *version) {
+    GList *members = json_object_get_members(version);
+    gint64 sum = 0;
+
+    for (GList *entry = members; entry; entry = entry->next) {
+        sum += version_get(version, entry->data);
+    }
+    g_list_free(members);
+
+    return sum;
+}
+
+static void replica_entry_free(gpointer data) {
+    ReplicaEntry *entry = data;
+
+    if (entry->value) {
+        json_node_unref(entry->value);
+    }
+    json_object_unref(entry->version);
+    g_free(entry->writer);
+    g_free(entry);
+}
+
+static ReplicaEntry *replica_entry(ColodStoreReplica *this, const gchar *key) {
+    ReplicaEntry *entry = g_hash_table_lookup(this->entries, key);
+
+    if (!entry) {
+        entry = g_new0(ReplicaEntry, 1);
+        entry->version = json_object_new();
+        g_hash_table_insert(this->entries, g_strdup(key), entry);
+    }
+
+    return entry;
+}
+
+static void replica_entry_set(ReplicaEntry *entry, JsonNode *value) {
+    if (entry->value) {
+        json_node_unref(entry->value);
+    }
+    entry->value = value;
+}
+
+/*
+ * Membership changes are delivered in order with the messages, so checking
+ * for them on every message tells which messages were delivered in the
+ * same view.
+ */
+static void replica_update_view(ColodStoreReplica *this) {
+    const CpgMembership *membership = colod_cpg_membership(this->cpg);
+    gsize size = membership->member_count * sizeof(membership->members[0]);
+
+    if (membership->member_count == this->view_member_count
+            && !memcmp(membership->members, this->view_members, size)) {
+        return;
+    }
+
+    memcpy(this->view_members, membership->members, size);
+    this->view_member_count = membership->member_count;
+    this->view++;
+}
+
+static void replica_changed(ColodStoreReplica *this) {
+    g_free(this->serialized);
+    this->serialized = NULL;
+}
+
+static gchar *replica_object_to_string(JsonObject *object) {
+    JsonNode *node = json_node_alloc();
+    gchar *ret;
+
+    json_node_init_object(node, object);
+    ret = json_to_string(node, FALSE);
+    json_node_unref(node);
+
+    return ret;
+}
+
+// Sum of the versions of all keys
+static JsonObject *replica_version(ColodStoreReplica *this) {
+    JsonObject *version = json_object_new();
+    GHashTableIter iter;
+    gpointer value;
+
+    g_hash_table_iter_init(&iter, this->entries);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        ReplicaEntry *entry = value;
+        version_merge(version, entry->version);
+    }
+
+    return version;
+}
+
+const gchar *store_replica_serialized(ColodStoreReplica *this) {
+    JsonObject *object;
+    GHashTableIter iter;
+    gpointer key, value;
+
+    if (this->serialized) {
+        return this->serialized;
+    }
+
+    object = json_object_new();
+    g_hash_table_iter_init(&iter, this->entries);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        ReplicaEntry *entry = value;
+        if (entry->value) {
+            json_object_set_member(object, key, json_node_copy(entry->value));
+        }
+    }
+
+    this->serialized = replica_object_to_string(object);
+    json_object_unref(object);
+    return this->serialized;
+}
+
+JsonNode *store_replica_get(ColodStoreReplica *this, const gchar *key,
+                            JsonObject **version) {
+    ReplicaEntry *entry = g_hash_table_lookup(this->entries, key);
+
+    *version = entry ? entry->version : NULL;
+    return entry ? entry->value : NULL;
+}
+
+static void replica_apply(ColodStoreReplica *this, const gchar *node,
+                          gint64 ticket, JsonObject *changes, gboolean merge) {
+    GList *members = json_object_get_members(changes);
+
+    for (GList *member = members; member; member = member->next) {
+        const gchar *key = member->data;
+        JsonNode *change = json_object_get_member(changes, key);
+        ReplicaEntry *entry = replica_entry(this, key);
+
+        if (JSON_NODE_HOLDS_NULL(change)) {
+            replica_entry_set(entry, NULL);
+        } else if (merge) {
+            replica_entry_set(entry, store_merge_patch(entry->value, change));
+        } else {
+            replica_entry_set(entry, json_node_copy(change));
+        }
+
+        json_object_set_int_member(entry->version, node,
+                                   version_get(entry->version, node) + 1);
+        g_free(entry->writer);
+        entry->writer = g_strdup(node);
+        entry->ticket = ticket;
+        entry->view = this->view;
+    }
+    g_list_free(members);
+
+    json_object_set_int_member(this->seen, node, ticket);
+    replica_changed(this);
+}
+
+/*
+ * Concurrent versions are resolved by the number of writes and then by
+ * value, so every member picks the same one.
+ */
+static gboolean replica_remote_wins(ReplicaEntry *entry, JsonNode *value,
+                                    JsonObject *version) {
+    gint64 local_sum = version_sum(entry->version);
+    gint64 remote_sum = version_sum(version);
+    gchar *local_str, *remote_str;
+    gboolean ret;
+
+    if (local_sum != remote_sum) {
+        return remote_sum > local_sum;
+    }
+
+    local_str = entry->value ? json_to_string(entry->value, FALSE) : NULL;
+    remote_str = value ? json_to_string(value, FALSE) : NULL;
+    ret = g_strcmp0(remote_str, local_str) > 0;
+    g_free(local_str);
+    g_free(remote_str);
+
+    return ret;
+}
+
+/*
+ * The sender composed its sync before the write that last set the value
+ * was delivered to it. It applies that write after its sync, so keep the
+ * value instead of going back to the older one of the sender.
+ */
+static gboolean replica_sender_behind(ColodStoreReplica *this,
+                                      ReplicaEntry *entry, JsonObject *seen) {
+    return entry->writer && entry->view == this->view
+            && version_get(seen, entry->writer) < entry->ticket;
+}
+
+static void replica_merge(ColodStoreReplica *this, const gchar *key,
+                          JsonNode *value, JsonObject *version,
+                          JsonObject *seen) {
+    ReplicaEntry *entry = g_hash_table_lookup(this->entries, key);
+    VersionOrder order;
+
+    order = version_compare(version, entry ? entry->version : NULL);
+    if (order == VERSION_BEFORE || order == VERSION_EQUAL) {
+        return;
+    }
+
+    entry = replica_entry(this, key);
+    if (replica_sender_behind(this, entry, seen)) {
+        version_merge(entry->version, version);
+        return;
+    }
+
+    if (order == VERSION_CONCURRENT) {
+        colod_syslog(LOG_WARNING, "Concurrent writes to replicated store "
+                     "key %s", key);
+        if (!replica_remote_wins(entry, value, version)) {
+            version_merge(entry->version, version);
+            return;
+        }
+    }
+
+    replica_entry_set(entry, value ? json_node_copy(value) : NULL);
+    version_merge(entry->version, version);
+    g_free(entry->writer);
+    entry->writer = NULL;
+    replica_changed(this);
+}
+
+static void replica_send(ColodStoreReplica *this, const gchar *payload) {
+    colod_cpg_send_payload(this->cpg, MESSAGE_STORE, payload,
+                           strlen(payload));
+}
+
+static void replica_send_sync_chunk(ColodStoreReplica *this,
+                                    JsonObject *keys, JsonObject *version) {
+    JsonObject *message = json_object_new();
+    gchar *payload;
+
+    json_object_set_string_member(message, "node", this->node);
+    json_object_set_object_member(message, "version",
+                                  json_object_ref(version));
+    json_object_set_object_member(message, "seen",
+                                  json_object_ref(this->seen));
+    json_object_set_object_member(message, "sync", keys);
+    payload = replica_object_to_string(message);
+    json_object_unref(message);
+
+    replica_send(this, payload);
+    g_free(payload);
+}
+
+// Send all keys, split into as many messages as needed
+static void replica_send_sync(ColodStoreReplica *this) {
+    JsonObject *version = replica_version(this);
+    JsonObject *keys = NULL;
+    gsize base, size = 0;
+    GHashTableIter iter;
+    gpointer key, value;
+    gchar *version_str, *seen_str;
+
+    version_str = replica_object_to_string(version);
+    seen_str = replica_object_to_string(this->seen);
+    base = strlen(version_str) + strlen(seen_str) + strlen(this->node) + 64;
+    g_free(version_str);
+    g_free(seen_str);
+
+    g_hash_table_iter_init(&iter, this->entries);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        ReplicaEntry *entry = value;
+        JsonObject *object = json_object_new();
+        gchar *object_str;
+        gsize len;
+
+        if (entry->value) {
+            json_object_set_member(object, "value",
+                                   json_node_copy(entry->value));
+        } else {
+            json_object_set_null_member(object, "value");
+        }
+        json_object_set_object_member(object, "version",
+                                      json_object_ref(entry->version));
+
+        // Room for the key, even if every character needs escaping
+        object_str = replica_object_to_string(object);
+        len = strlen(object_str) + 6 * strlen(key) + 4;
+        g_free(object_str);
+
+        if (base + len > CPG_PAYLOAD_MAX) {
+            log_error_fmt("Replicated store key %s is too large to sync",
+                          (const gchar *) key);
+            json_object_unref(object);
+            continue;
+        }
+
+        if (keys && size + len > CPG_PAYLOAD_MAX) {
+            replica_send_sync_chunk(this, keys, version);
+            keys = NULL;
+        }
+        if (!keys) {
+            keys = json_object_new();
+            size = base;
+        }
+
+        json_object_set_object_member(keys, key, object);
+        size += len;
+    }
+
+    if (keys) {
+        replica_send_sync_chunk(this, keys, version);
+    }
+    json_object_unref(version);
+}
+
+static gboolean replica_sync_cb(gpointer data) {
+    ColodStoreReplica *this = data;
+
+    this->sync_source_id = 0;
+    replica_send_sync(this);
+    return G_SOURCE_REMOVE;
+}
+
+static void replica_schedule_sync(ColodStoreReplica *this) {
+    if (!this->sync_source_id && g_hash_table_size(this->entries)) {
+        this->sync_source_id = g_idle_add(replica_sync_cb, this);
+        g_source_set_name_by_id(this->sync_source_id, "replicated store sync");
+    }
+}
+
+static int replica_process_sync(ColodStoreReplica *this, JsonNode *root) {
+    JsonNode *sync = get_member_node(root, "sync");
+    JsonNode *version = get_member_node(root, "version");
+    JsonNode *seen = get_member_node(root, "seen");
+    JsonObject *keys, *local_version;
+    GList *members;
+    int ret = 0;
+
+    if (!sync || !JSON_NODE_HOLDS_OBJECT(sync) || !version_valid(version)
+            || !version_valid(seen)) {
+        return -1;
+    }
+
+    keys = json_node_get_object(sync);
+    members = json_object_get_members(keys);
+    for (GList *member = members; member; member = member->next) {
+        const gchar *key = member->data;
+        JsonNode *entry = json_object_get_member(keys, key);
+        JsonNode *value, *entry_version;
+
+        if (!JSON_NODE_HOLDS_OBJECT(entry)
+                || !(value = get_member_node(entry, "value"))
+                || !version_valid(entry_version = get_member_node(entry,
+                                                                  "version"))) {
+            ret = -1;
+            continue;
+        }
+
+        replica_merge(this, key, JSON_NODE_HOLDS_NULL(value) ? NULL : value,
+                      json_node_get_object(entry_version),
+                      json_node_get_object(seen));
+    }
+    g_list_free(members);
+
+    // Tell the sender about the writes it missed
+    local_version = replica_version(this);
+    switch (version_compare(local_version, json_node_get_object(version))) {
+        case VERSION_AFTER:
+        case VERSION_CONCURRENT:
+            replica_schedule_sync(this);
+        break;
+
+        default:
+        break;
+    }
+    json_object_unref(local_version);
+
+    return ret;
+}
+
+static void replica_wake(ColodStoreReplica *this) {
+    ReplicaWaiter *waiter;
+
+    while ((waiter = g_queue_peek_head(&this->waiters))
+           && waiter->ticket <= this->applied) {
+        g_queue_pop_head(&this->waiters);
+        waiter->source_id = g_idle_add(waiter->coroutine->cb.plain,
+                                       waiter->coroutine);
+    }
+}
+
+static int replica_process_write(ColodStoreReplica *this, JsonNode *root,
+                                 const gchar *node,
+                                 gboolean message_from_this_node) {
+    JsonNode *ticket = get_member_node(root, "ticket");
+    JsonNode *changes;
+    gboolean merge = has_member(root, "patch");
+
+    changes = get_member_node(root, merge ? "patch" : "set");
+    if (!changes || !JSON_NODE_HOLDS_OBJECT(changes)
+            || !ticket || !JSON_NODE_HOLDS_VALUE(ticket)
+            || json_node_get_value_type(ticket) != G_TYPE_INT64) {
+        return -1;
+    }
+
+    replica_apply(this, node, json_node_get_int(ticket),
+                  json_node_get_object(changes), merge);
+
+    if (message_from_this_node) {
+        this->applied = json_node_get_int(ticket);
+        replica_wake(this);
+    }
+
+    return 0;
+}
+
+static void replica_cpg_payload_cb(gpointer data, ColodMessage message,
+                                   gboolean message_from_this_node,
+                                   const void *payload, size_t len) {
+    ColodStoreReplica *this = data;
+    GError *local_errp = NULL;
+    gchar *str;
+    JsonNode *root;
+    const gchar *node;
+    int ret;
+
+    if (message != MESSAGE_STORE) {
+        return;
+    }
+
+    str = g_strndup(payload, len);
+    root = json_from_string(str, &local_errp);
+    g_free(str);
+    if (!root) {
+        log_error_fmt("Got invalid replicated store message: %s",
+                      local_errp ? local_errp->message : "empty");
+        if (local_errp) {
+            g_error_free(local_errp);
+        }
+        return;
+    }
+
+    replica_update_view(this);
+
+    if (!JSON_NODE_HOLDS_OBJECT(root) || !has_member(root, "node")
+            || !(node = get_member_str(root, "node"))) {
+        ret = -1;
+    } else if (has_member(root, "sync")) {
+        ret = message_from_this_node ? 0 : replica_process_sync(this, root);
+    } else {
+        ret = replica_process_write(this, root, node, message_from_this_node);
+    }
+    if (ret < 0) {
+        log_error("Got invalid replicated store message");
+    }
+
+    json_node_unref(root);
+}
+
+static void replica_cpg_cb(gpointer data, ColodMessage message,
+                           gboolean message_from_this_node,
+                           G_GNUC_UNUSED gboolean peer_left_group) {
+    ColodStoreReplica *this = data;
+
+    if (message != MESSAGE_HELLO || message_from_this_node) {
+        return;
+    }
+
+    // Peer (re)started, send it what we have. Hello is retransmitted, so
+    // only once per membership change.
+    replica_update_view(this);
+    if (this->synced_view != this->view) {
+        this->synced_view = this->view;
+        replica_schedule_sync(this);
+    }
+}
+
+// Returns the ticket of the write or 0 on error
+static guint64 replica_send_write(ColodStoreReplica *this, JsonNode *changes,
+                                  gboolean merge, GError **errp) {
+    JsonObject *message = json_object_new();
+    gchar *payload;
+
+    if (!JSON_NODE_HOLDS_OBJECT(changes)) {
+        colod_error_set(errp, "Changes must be an object");
+        json_object_unref(message);
+        return 0;
+    }
+
+    json_object_set_string_member(message, "node", this->node);
+    json_object_set_int_member(message, "ticket", this->sent + 1);
+    json_object_set_member(message, merge ? "patch" : "set",
+                           json_node_copy(changes));
+    payload = replica_object_to_string(message);
+    json_object_unref(message);
+
+    if (strlen(payload) > CPG_PAYLOAD_MAX) {
+        colod_error_set(errp, "Write too large to replicate");
+        g_free(payload);
+        return 0;
+    }
+
+    replica_send(this, payload);
+    g_free(payload);
+    return ++this->sent;
+}
+
+int _store_replica_write_co(Coroutine *coroutine, ColodStoreReplica *this,
+                            JsonNode *changes, gboolean merge, GError **errp) {
+    struct {
+        ReplicaWaiter waiter;
+        guint timeout_source_id;
+    } *co;
+
+    co_frame(co, sizeof(*co));
+    co_begin(int, -1);
+
+    CO waiter.ticket = replica_send_write(this, changes, merge, errp);
+    if (!CO waiter.ticket) {
+        return -1;
+    }
+
+    CO waiter.coroutine = coroutine;
+    CO waiter.source_id = 0;
+    g_queue_push_tail(&this->waiters, &CO waiter);
+    CO timeout_source_id = g_timeout_add(STORE_REPLICA_TIMEOUT,
+                                         coroutine->cb.plain, coroutine);
+    g_source_set_name_by_id(CO timeout_source_id,
+                            "replicated store write timeout");
+
+    co_yield_int(G_SOURCE_REMOVE);
+
+    if (g_source_get_id(g_main_current_source()) != CO timeout_source_id) {
+        g_source_remove(CO timeout_source_id);
+    } else if (CO waiter.source_id) {
+        // Applied just now
+        g_source_remove(CO waiter.source_id);
+    } else {
+        g_queue_remove(&this->waiters, &CO waiter);
+        g_set_error(errp, COLOD_ERROR, COLOD_ERROR_TIMEOUT,
+                    "Timed out waiting for the write to be replicated");
+        return -1;
+    }
+
+    co_end;
+
+    return 0;
+}
+
+ColodStoreReplica *store_replica_new(Cpg *cpg) {
+    ColodStoreReplica *this;
+
+    this = g_new0(ColodStoreReplica, 1);
+    this->cpg = cpg;
+    this->node = g_strdup_printf("%u:%" G_GINT64_FORMAT,
+                                 colod_cpg_membership(cpg)->local_nodeid,
+                                 g_get_real_time());
+    this->entries = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                          replica_entry_free);
+    this->seen = json_object_new();
+    replica_update_view(this);
+    // View 0 is never current, so the first hello always gets a sync
+    this->view = 1;
+
+    colod_cpg_add_notify(cpg, replica_cpg_cb, this);
+    colod_cpg_add_payload_notify(cpg, replica_cpg_payload_cb, this);
+
+    return this;
+}
+
+void store_replica_free(ColodStoreReplica *this) {
+    assert(g_queue_is_empty(&this->waiters));
+
+    colod_cpg_del_payload_notify(this->cpg, replica_cpg_payload_cb, this);
+    colod_cpg_del_notify(this->cpg, replica_cpg_cb, this);
+    if (this->sync_source_id) {
+        g_source_remove(this->sync_source_id);
+    }
+    g_hash_table_unref(this->entries);
+    json_object_unref(this->seen);
+    g_free(this->serialized);
+    g_free(this->node);
+    g_free(this);
+}
@@ -0,0 +1,58 @@
+/*
+ * COLO background daemon replicated client store
+ *
+ * Copyright (c) Lukas Straub <lukasstraub2@web.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef STORE_REPLICA_H
+#define STORE_REPLICA_H
+
+#include <glib-2.0/glib.h>
+#include <json-glib-1.0/json-glib/json-glib.h>
+
+#include "cpg.h"
+
+/*
+ * Json object shared by the members of the cpg group. Writes are multicast
+ * as MESSAGE_STORE and applied by every member in the agreed cpg order, so
+ * members that saw the same messages hold the same store. Reads are
+ * answered from the local copy.
+ *
+ * Every key carries a version vector counting the writes of each daemon
+ * start of each node to it. When a peer says hello, its members exchange
+ * their keys and keep the newer version of each, so writes made while the
+ * group was split up are not lost. Concurrent versions of a key are
+ * resolved the same way on every member. A sync never undoes a write that
+ * was delivered after the sender composed it.
+ *
+ * Removed keys are kept as tombstones and the version vectors get a member
+ * for every daemon start that wrote to them. Neither is ever collected, so
+ * clients should stick to a bounded set of keys.
+ */
+typedef struct ColodStoreReplica ColodStoreReplica;
+
+// Cached until the next change
+const gchar *store_replica_serialized(ColodStoreReplica *this);
+// Borrowed references. The value is NULL if key is missing, the version
+// is NULL if key was never written.
+JsonNode *store_replica_get(ColodStoreReplica *this, const gchar *key,
+                            JsonObject **version);
+
+/*
+ * Write the members of changes to the keys of the same name and wait until
+ * the write is applied locally. A key is removed if its value is json null.
+ * If merge is set, object values are applied as a json merge patch
+ * (RFC 7396) to the current value of the key.
+ */
+#define store_replica_write_co(...) \
+    co_wrap(_store_replica_write_co(__VA_ARGS__))
+int _store_replica_write_co(Coroutine *coroutine, ColodStoreReplica *this,
+                            JsonNode *changes, gboolean merge, GError **errp);
+
+ColodStoreReplica *store_replica_new(Cpg *cpg);
+void store_replica_free(ColodStoreReplica *this);
+
+#endif // STORE_REPLICA_H
@@ -14,6 +14,9 @@
 
 struct Cpg {
     ColodCallbackHead callbacks;
+    ColodCallbackHead payload_callbacks;
+    CpgMembership membership;
+    guint payloads_sent;
 };
 
 void colod_cpg_add_notify(Cpg *this, CpgCallback _func, gpointer user_data) {
@@ -26,6 +29,18 @@ void colod_cpg_del_notify(Cpg *this, CpgCallback _func, gpointer user_data) {
     colod_callback_del(&this->callbacks, func, user_data);
 }
 
+void colod_cpg_add_payload_notify(Cpg *this, CpgPayloadCallback _func,
+                                  gpointer user_data) {
+    ColodCallbackFunc func = (ColodCallbackFunc) _func;
+    colod_callback_add(&this->payload_callbacks, func, user_data);
+}
+
+void colod_cpg_del_payload_notify(Cpg *this, CpgPayloadCallback _func,
+                                  gpointer user_data) {
+    ColodCallbackFunc func = (ColodCallbackFunc) _func;
+    colod_callback_del(&this->payload_callbacks, func, user_data);
+}
+
 void colod_cpg_stub_notify(Cpg *this, ColodMessage message,
                            gboolean message_from_this_node,
                            gboolean peer_left_group) {
@@ -36,8 +51,36 @@ void colod_cpg_stub_notify(Cpg *this, ColodMessage message,
     }
 }
 
+void colod_cpg_stub_notify_payload(Cpg *this, ColodMessage message,
+                                   gboolean message_from_this_node,
+                                   const void *payload, size_t len) {
+    ColodCallback *entry, *next_entry;
+    QLIST_FOREACH_SAFE(entry, &this->payload_callbacks, next, next_entry) {
+        CpgPayloadCallback func = (CpgPayloadCallback) entry->func;
+        func(entry->user_data, message, message_from_this_node, payload, len);
+    }
+}
+
+guint colod_cpg_stub_payloads_sent(Cpg *this) {
+    return this->payloads_sent;
+}
+
+const CpgMembership *colod_cpg_membership(Cpg *cpg) {
+    return &cpg->membership;
+}
+
+gboolean colod_cpg_left_node_down(G_GNUC_UNUSED Cpg *cpg) {
+    return TRUE;
+}
+
 void colod_cpg_send(G_GNUC_UNUSED Cpg *cpg, G_GNUC_UNUSED uint32_t message) {}
 
+void colod_cpg_send_payload(Cpg *cpg, G_GNUC_UNUSED uint32_t message,
+                            G_GNUC_UNUSED const void *payload,
+                            G_GNUC_UNUSED size_t len) {
+    cpg->payloads_sent++;
+}
+
 Cpg *colod_open_cpg(G_GNUC_UNUSED ColodContext *ctx, G_GNUC_UNUSED GError **errp) {
     return g_new0(Cpg, 1);
 }
@@ -48,5 +91,6 @@ Cpg *cpg_new(Cpg *cpg, G_GNUC_UNUSED GError **errp) {
 
 void cpg_free(Cpg *cpg) {
     colod_callback_clear(&cpg->callbacks);
+    colod_callback_clear(&cpg->payload_callbacks);
     g_free(cpg);
 }
@@ -15,6 +15,7 @@ struct ColodNetlink {
 };
 
 ColodCallbackHead callbacks;
+ColodCallbackHead stats_callbacks;
 
 void netlink_add_notify(G_GNUC_UNUSED ColodNetlink *this,
                         NetlinkCallback _func, gpointer user_data) {
@@ -36,6 +37,37 @@ void netlink_stub_notify(const char *ifname, gboolean up) {
     }
 }
 
+void netlink_add_stats_notify(G_GNUC_UNUSED ColodNetlink *this,
+                              NetlinkStatsCallback _func, gpointer user_data) {
+    ColodCallbackFunc func = (ColodCallbackFunc) _func;
+    colod_callback_add(&stats_callbacks, func, user_data);
+}
+
+void netlink_del_stats_notify(G_GNUC_UNUSED ColodNetlink *this,
+                              NetlinkStatsCallback _func, gpointer user_data) {
+    ColodCallbackFunc func = (ColodCallbackFunc) _func;
+    colod_callback_del(&stats_callbacks, func, user_data);
+}
+
+void netlink_stub_notify_stats(const char *ifname,
+                               const NetlinkLinkStats *delta) {
+    ColodCallback *entry, *next_entry;
+    QLIST_FOREACH_SAFE(entry, &stats_callbacks, next, next_entry) {
+        NetlinkStatsCallback func = (NetlinkStatsCallback) entry->func;
+        func(entry->user_data, ifname, delta);
+    }
+}
+
+void netlink_poll_stats(G_GNUC_UNUSED ColodNetlink *this,
+                        G_GNUC_UNUSED guint interval) {}
+
+void netlink_watch(G_GNUC_UNUSED ColodNetlink *this,
+                   G_GNUC_UNUSED const char *ifname) {}
+
+void netlink_query(G_GNUC_UNUSED ColodNetlink *this, NetlinkStats *ret) {
+    memset(ret, 0, sizeof(*ret));
+}
+
 int netlink_request_status(G_GNUC_UNUSED ColodNetlink *this,
                            G_GNUC_UNUSED GError **errp) {
     return 0;
@@ -43,6 +75,7 @@ int netlink_request_status(G_GNUC_UNUSED ColodNetlink *this,
 
 void netlink_free(ColodNetlink *this) {
     colod_callback_clear(&callbacks);
+    colod_callback_clear(&stats_callbacks);
     g_free(this);
 }
 
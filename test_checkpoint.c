@@ -0,0 +1,110 @@
+/*
+ * COLO background daemon
+ *
+ * Copyright (c) Lukas Straub <lukasstraub2@web.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <assert.h>
+#include <string.h>
+
+#include "checkpoint.h"
+#include "test_util.h"
+
+static void assert_json_equal(JsonNode *a, JsonNode *b) {
+    assert(a && b);
+    assert(json_node_equal(a, b));
+}
+
+static void test_roundtrip() {
+    TestTmpFile *tmp = test_tmpfile_new("checkpoint.json");
+    ColodCheckpoint checkpoint = {
+        .state = "primary colo running",
+        .primary = TRUE,
+        .replication = TRUE,
+        .peer_failed = TRUE,
+        .peer_yellow = TRUE,
+        .peer = "node \"b\"",
+        .migration_start = test_parse("[{\"execute\": \"migrate\"}]"),
+        .migration_switchover = test_parse("[]"),
+        .failover_primary =
+            test_parse("[{\"execute\": \"x-colo-lost-heartbeat\"}]"),
+        .failover_secondary = test_parse("[{\"execute\": \"stop\"}]"),
+        .yank_instances = NULL
+    };
+    ColodCheckpoint *loaded;
+    GError *local_errp = NULL;
+    gchar *serialized;
+
+    assert(!checkpoint_load(tmp->path, &local_errp));
+    assert(!local_errp);
+
+    serialized = checkpoint_serialize(&checkpoint);
+    assert(!checkpoint_write(tmp->path, serialized, NULL));
+    g_free(serialized);
+
+    loaded = checkpoint_load(tmp->path, NULL);
+    assert(loaded);
+    assert(!strcmp(loaded->state, checkpoint.state));
+    assert(loaded->primary && loaded->replication);
+    assert(!loaded->failed && !loaded->peer_failover);
+    assert(loaded->peer_failed && !loaded->yellow && loaded->peer_yellow);
+    assert(!strcmp(loaded->peer, checkpoint.peer));
+    assert_json_equal(loaded->migration_start, checkpoint.migration_start);
+    assert_json_equal(loaded->migration_switchover,
+                      checkpoint.migration_switchover);
+    assert_json_equal(loaded->failover_primary, checkpoint.failover_primary);
+    assert_json_equal(loaded->failover_secondary,
+                      checkpoint.failover_secondary);
+    assert(!loaded->yank_instances);
+    checkpoint_free(loaded);
+
+    checkpoint.yank_instances = test_parse("[{\"type\": \"migration\"}]");
+    serialized = checkpoint_serialize(&checkpoint);
+    assert(!checkpoint_write(tmp->path, serialized, NULL));
+    g_free(serialized);
+
+    loaded = checkpoint_load(tmp->path, NULL);
+    assert(loaded);
+    assert_json_equal(loaded->yank_instances, checkpoint.yank_instances);
+    checkpoint_free(loaded);
+
+    json_node_unref(checkpoint.migration_start);
+    json_node_unref(checkpoint.migration_switchover);
+    json_node_unref(checkpoint.failover_primary);
+    json_node_unref(checkpoint.failover_secondary);
+    json_node_unref(checkpoint.yank_instances);
+
+    test_tmpfile_free(tmp);
+}
+
+static void test_invalid() {
+    TestTmpFile *tmp = test_tmpfile_new("checkpoint.json");
+    const gchar *invalid[] = {
+        "",
+        "[]",
+        "{\"format\": 2}",
+        "{\"format\": 1, \"state\": 1}",
+        "{\"format\": 1, \"state\": \"primary wait\"}"
+    };
+
+    for (guint i = 0; i < G_N_ELEMENTS(invalid); i++) {
+        GError *local_errp = NULL;
+
+        g_file_set_contents(tmp->path, invalid[i], -1, NULL);
+        assert(!checkpoint_load(tmp->path, &local_errp));
+        assert(local_errp);
+        g_error_free(local_errp);
+    }
+
+    test_tmpfile_free(tmp);
+}
+
+int main(G_GNUC_UNUSED int argc, G_GNUC_UNUSED char **argv) {
+    test_roundtrip();
+    test_invalid();
+
+    return 0;
+}
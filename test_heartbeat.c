@@ -0,0 +1,119 @@
+/*
+ * COLO background daemon peer heartbeat test
+ *
+ * Copyright (c) Lukas Straub <lukasstraub2@web.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+
+#include "heartbeat.h"
+#include "daemon.h"
+
+#define INTERVAL 20
+#define MISS_YELLOW 3
+#define MISS_FAILOVER 6
+
+void colod_syslog(G_GNUC_UNUSED int pri, const char *fmt, ...) {
+    va_list args;
+
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    fwrite("\n", 1, 1, stderr);
+    va_end(args);
+}
+
+static ColodEvent events[8];
+static guint event_count;
+
+static void event_cb(G_GNUC_UNUSED gpointer data, ColodEvent event) {
+    assert(event_count < G_N_ELEMENTS(events));
+    events[event_count++] = event;
+}
+
+static void peer_heartbeat(Cpg *cpg) {
+    guint8 payload[16] = {0};
+
+    colod_cpg_stub_notify_payload(cpg, MESSAGE_HEARTBEAT, FALSE, payload,
+                                  sizeof(payload));
+}
+
+// Run the main loop for ms or until count events were seen
+static void run(guint ms, guint count) {
+    gint64 deadline = g_get_monotonic_time() + ms * 1000;
+
+    while (event_count < count && g_get_monotonic_time() < deadline) {
+        g_main_context_iteration(g_main_context_default(), FALSE);
+        g_usleep(1000);
+    }
+}
+
+static void test_thresholds(Cpg *cpg) {
+    ColodHeartbeat *heartbeat = heartbeat_new(cpg, INTERVAL, MISS_YELLOW,
+                                              MISS_FAILOVER);
+    HeartbeatStats stats;
+
+    event_count = 0;
+    heartbeat_add_notify(heartbeat, event_cb, NULL);
+
+    // Not seen yet, nothing to miss
+    run(MISS_FAILOVER * INTERVAL * 2, 1);
+    assert(!event_count);
+
+    peer_heartbeat(cpg);
+    run(MISS_FAILOVER * INTERVAL * 10, 1);
+    assert(event_count == 1 && events[0] == EVENT_YELLOW);
+    heartbeat_query(heartbeat, &stats);
+    assert(stats.peer_late && stats.missed >= MISS_YELLOW);
+    assert(stats.missed < MISS_FAILOVER);
+
+    peer_heartbeat(cpg);
+    assert(event_count == 2 && events[1] == EVENT_UNYELLOW);
+    heartbeat_query(heartbeat, &stats);
+    assert(!stats.peer_late && !stats.missed);
+
+    run(MISS_FAILOVER * INTERVAL * 10, 4);
+    assert(event_count == 4);
+    assert(events[2] == EVENT_YELLOW && events[3] == EVENT_FAILOVER_SYNC);
+
+    // Dead peers are reported once
+    run(MISS_FAILOVER * INTERVAL * 2, 5);
+    assert(event_count == 4);
+
+    heartbeat_del_notify(heartbeat, event_cb, NULL);
+    heartbeat_free(heartbeat);
+}
+
+static void test_stall(Cpg *cpg) {
+    ColodHeartbeat *heartbeat = heartbeat_new(cpg, INTERVAL, MISS_YELLOW,
+                                              MISS_FAILOVER);
+
+    event_count = 0;
+    heartbeat_add_notify(heartbeat, event_cb, NULL);
+
+    peer_heartbeat(cpg);
+    run(INTERVAL * 2, 1);
+
+    // Our own main loop stalls, the peer is fine
+    g_usleep(MISS_FAILOVER * INTERVAL * 3 * 1000);
+    run(INTERVAL, 1);
+    peer_heartbeat(cpg);
+    run(INTERVAL * 2, 1);
+    assert(!event_count);
+
+    heartbeat_del_notify(heartbeat, event_cb, NULL);
+    heartbeat_free(heartbeat);
+}
+
+int main(G_GNUC_UNUSED int argc, G_GNUC_UNUSED char **argv) {
+    Cpg *cpg = colod_open_cpg(NULL, NULL);
+
+    test_thresholds(cpg);
+    test_stall(cpg);
+
+    cpg_free(cpg);
+    return 0;
+}
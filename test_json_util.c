@@ -0,0 +1,56 @@
+/*
+ * COLO background daemon
+ *
+ * Copyright (c) Lukas Straub <lukasstraub2@web.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <assert.h>
+#include <string.h>
+
+#include "json_util.h"
+
+static int scan(const gchar *line, const gchar *member, const gchar *expect) {
+    const gchar *value;
+    gsize len;
+    int ret;
+
+    ret = json_scan_member(line, strlen(line), member, &value, &len);
+    if (ret == 1) {
+        assert(expect);
+        assert(len == strlen(expect) && !memcmp(value, expect, len));
+    }
+
+    return ret;
+}
+
+static void test_scan_member() {
+    assert(scan("{\"execute\": \"stop\", \"id\": 5}\n", "id", "5") == 1);
+    assert(scan("{\"id\" : {\"a\": [1, 2]} }", "id", "{\"a\": [1, 2]}") == 1);
+    assert(scan("{\"return\": {}, \"id\": \"x,}\"}\r\n", "id", "\"x,}\"") == 1);
+    assert(scan("{'exec-colod': 'query-status'}", "exec-colod",
+                "'query-status'") == 1);
+    assert(scan("{\"a\": \"\\\"}\", \"event\": \"STOP\"}", "event",
+                "\"STOP\"") == 1);
+
+    // Only top-level members count
+    assert(scan("{'execute': 'x', 'arguments': {'id': 3}}", "id", NULL) == 0);
+    assert(scan("{\"data\": \"event\"}", "event", NULL) == 0);
+    assert(scan("{}", "id", NULL) == 0);
+
+    // Not exactly one object
+    assert(scan("{\"execute\": \"stop\"", "id", NULL) < 0);
+    assert(scan("{\"execute\": \"stop\"}}", "id", NULL) < 0);
+    assert(scan("{\"execute\": \"stop\"} {", "id", NULL) < 0);
+    assert(scan("{\"execute\": \"stop}", "id", NULL) < 0);
+    assert(scan("[1]", "id", NULL) < 0);
+    assert(scan("", "id", NULL) < 0);
+}
+
+int main(G_GNUC_UNUSED int argc, G_GNUC_UNUSED char **argv) {
+    test_scan_member();
+
+    return 0;
+}
@@ -0,0 +1,79 @@
+/*
+ * COLO background daemon
+ *
+ * Copyright (c) Lukas Straub <lukasstraub2@web.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <assert.h>
+
+#include "qemu_state.h"
+
+static void test_events() {
+    QemuState *state = qemu_state_new();
+    gboolean primary, replication;
+    guint seq;
+
+    assert(!qemu_state_get(state, 1000, &primary, &replication));
+
+    seq = qemu_state_seq(state);
+    assert(!qemu_state_reconcile(state, seq, "running", "primary", "none"));
+    assert(qemu_state_get(state, 1000, &primary, &replication));
+    assert(primary && replication);
+
+    // Checkpoints don't change the result
+    qemu_state_event(state, "STOP");
+    qemu_state_event(state, "RESUME");
+    assert(qemu_state_get(state, 1000, &primary, &replication));
+    assert(primary && replication);
+
+    qemu_state_event(state, "COLO_EXIT");
+    assert(!qemu_state_get(state, 1000, &primary, &replication));
+
+    seq = qemu_state_seq(state);
+    assert(!qemu_state_reconcile(state, seq, "running", "none", "request"));
+    assert(qemu_state_get(state, 1000, &primary, &replication));
+    assert(primary && !replication);
+
+    qemu_state_event(state, "SHUTDOWN");
+    assert(qemu_state_get(state, 1000, &primary, &replication));
+    assert(!primary && !replication);
+
+    qemu_state_free(state);
+}
+
+static void test_reconcile() {
+    QemuState *state = qemu_state_new();
+    gboolean primary, replication;
+    guint seq;
+
+    // Event while the query was in flight
+    seq = qemu_state_seq(state);
+    qemu_state_event(state, "RESUME");
+    assert(!qemu_state_reconcile(state, seq, "inmigrate", "none", "none"));
+    assert(!qemu_state_get(state, 1000, &primary, &replication));
+
+    seq = qemu_state_seq(state);
+    assert(!qemu_state_reconcile(state, seq, "inmigrate", "none", "none"));
+    assert(qemu_state_get(state, 1000, &primary, &replication));
+    assert(!primary && !replication);
+
+    // Missed event
+    seq = qemu_state_seq(state);
+    assert(qemu_state_reconcile(state, seq, "colo", "secondary", "none") < 0);
+    assert(qemu_state_get(state, 1000, &primary, &replication));
+    assert(!primary && replication);
+
+    assert(!qemu_state_get(state, 0, &primary, &replication));
+
+    qemu_state_free(state);
+}
+
+int main(G_GNUC_UNUSED int argc, G_GNUC_UNUSED char **argv) {
+    test_events();
+    test_reconcile();
+
+    return 0;
+}
@@ -0,0 +1,82 @@
+/*
+ * COLO background daemon
+ *
+ * Copyright (c) Lukas Straub <lukasstraub2@web.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <assert.h>
+
+#include "util.h"
+
+#define SIZE 4
+
+static gpointer entry(guint i) {
+    return GUINT_TO_POINTER(i + 1);
+}
+
+static void test_edges() {
+    ColodSpscQueue queue;
+
+    colod_spsc_init(&queue, SIZE);
+
+    assert(!colod_spsc_pop(&queue));
+
+    for (guint i = 0; i < SIZE; i++) {
+        assert(colod_spsc_push(&queue, entry(i)));
+    }
+    assert(!colod_spsc_push(&queue, entry(SIZE)));
+
+    assert(colod_spsc_pop(&queue) == entry(0));
+    assert(colod_spsc_push(&queue, entry(SIZE)));
+    assert(!colod_spsc_push(&queue, entry(SIZE + 1)));
+
+    for (guint i = 1; i <= SIZE; i++) {
+        assert(colod_spsc_pop(&queue) == entry(i));
+    }
+    assert(!colod_spsc_pop(&queue));
+
+    colod_spsc_destroy(&queue);
+}
+
+static void test_wraparound() {
+    ColodSpscQueue queue;
+    guint pushed = 0, popped = 0;
+
+    colod_spsc_init(&queue, SIZE);
+
+    // Let the positions run past the end of the array many times
+    for (guint round = 0; round < 100; round++) {
+        guint count = round % SIZE + 1;
+
+        for (guint i = 0; i < count; i++) {
+            assert(colod_spsc_push(&queue, entry(pushed++)));
+        }
+        for (guint i = 0; i < count; i++) {
+            assert(colod_spsc_pop(&queue) == entry(popped++));
+        }
+        assert(!colod_spsc_pop(&queue));
+    }
+
+    // And past the end of the unsigned range
+    queue.head = queue.tail = G_MAXUINT - 1;
+    for (guint i = 0; i < SIZE; i++) {
+        assert(colod_spsc_push(&queue, entry(i)));
+    }
+    assert(!colod_spsc_push(&queue, entry(SIZE)));
+    for (guint i = 0; i < SIZE; i++) {
+        assert(colod_spsc_pop(&queue) == entry(i));
+    }
+    assert(!colod_spsc_pop(&queue));
+
+    colod_spsc_destroy(&queue);
+}
+
+int main(G_GNUC_UNUSED int argc, G_GNUC_UNUSED char **argv) {
+    test_edges();
+    test_wraparound();
+
+    return 0;
+}
@@ -0,0 +1,68 @@
+/*
+ * COLO background daemon
+ *
+ * Copyright (c) Lukas Straub <lukasstraub2@web.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <assert.h>
+#include <string.h>
+
+#include "status_page.h"
+#include "test_util.h"
+
+static void test_page() {
+    TestTmpFile *tmp = test_tmpfile_new("status.page");
+    StatusPageData data = {0}, read;
+    ColodStatusPage *writer;
+    const StatusPage *page;
+    uint32_t seq;
+
+    assert(!status_page_map(tmp->path, NULL));
+
+    writer = status_page_new(tmp->path, NULL);
+    assert(writer);
+    page = status_page_map(tmp->path, NULL);
+    assert(page);
+
+    assert(!status_page_read(page, &read));
+    assert(read.state == 0 && !read.state_name[0]);
+
+    data.state = 6;
+    data.flags = STATUS_PAGE_PRIMARY | STATUS_PAGE_REPLICATION;
+    strcpy(data.state_name, "primary colo running");
+    data.failovers = 2;
+    status_page_write(writer, &data);
+
+    assert(!status_page_read(page, &read));
+    assert(!memcmp(&read, &data, sizeof(data)));
+
+    // A restarted daemon keeps the seq going and clears the data
+    seq = page->seq;
+    status_page_free(writer);
+    writer = status_page_new(tmp->path, NULL);
+    assert(writer);
+    assert(page->seq == seq + 2);
+    assert(!status_page_read(page, &read));
+    assert(!read.failovers);
+
+    // Writer died in the middle of an update
+    ((StatusPage *) page)->seq |= 1;
+    assert(status_page_read(page, &read) < 0);
+    status_page_write(writer, &data);
+    assert(!(page->seq & 1));
+    assert(!status_page_read(page, &read));
+    assert(read.failovers == 2);
+
+    status_page_unmap(page);
+    status_page_free(writer);
+    test_tmpfile_free(tmp);
+}
+
+int main(G_GNUC_UNUSED int argc, G_GNUC_UNUSED char **argv) {
+    test_page();
+
+    return 0;
+}
@@ -0,0 +1,93 @@
+/*
+ * COLO background daemon
+ *
+ * Copyright (c) Lukas Straub <lukasstraub2@web.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <assert.h>
+#include <string.h>
+
+#include "store.h"
+#include "test_util.h"
+
+static int patch(ColodStore *store, const gchar *json, gint64 if_version) {
+    JsonNode *node = test_parse(json);
+    int ret = store_patch(store, node, if_version, NULL);
+    json_node_unref(node);
+    return ret;
+}
+
+static void test_patch() {
+    ColodStore *store = store_new(NULL);
+    JsonNode *node;
+
+    assert(store_version(store) == 0);
+    assert(!strcmp(store_serialized(store), "{}"));
+
+    node = test_parse("{\"a\": {\"b\": 1, \"c\": 2}, \"d\": [1]}");
+    assert(!store_set(store, node, -1, NULL));
+    json_node_unref(node);
+    assert(store_version(store) == 1);
+
+    assert(!patch(store, "{\"a\": {\"b\": null, \"e\": 3}, \"d\": null}", 1));
+    assert(store_version(store) == 2);
+    assert(!store_get(store, "d"));
+    node = store_get(store, "a");
+    assert(!json_object_has_member(json_node_get_object(node), "b"));
+    assert(json_object_get_int_member(json_node_get_object(node), "c") == 2);
+    assert(json_object_get_int_member(json_node_get_object(node), "e") == 3);
+
+    // Stale version
+    assert(patch(store, "{\"x\": 1}", 1) < 0);
+    assert(store_version(store) == 2);
+
+    node = test_parse("[1]");
+    assert(store_set(store, node, -1, NULL) < 0);
+    assert(store_patch(store, node, -1, NULL) < 0);
+    json_node_unref(node);
+
+    node = test_parse("\"value\"");
+    assert(!store_set_key(store, "f", node, 2, NULL));
+    json_node_unref(node);
+    assert(!strcmp(json_node_get_string(store_get(store, "f")), "value"));
+    assert(!store_set_key(store, "f", NULL, -1, NULL));
+    assert(!store_get(store, "f"));
+    assert(store_version(store) == 4);
+
+    store_free(store);
+}
+
+static void test_persist() {
+    TestTmpFile *tmp = test_tmpfile_new("store.json");
+    ColodStore *store;
+
+    store = store_new(tmp->path);
+    assert(!store_load(store, NULL));
+    assert(!patch(store, "{\"a\": 1}", 0));
+    assert(!patch(store, "{\"b\": 2}", 1));
+    store_free(store);
+
+    store = store_new(tmp->path);
+    assert(!store_load(store, NULL));
+    assert(store_version(store) == 2);
+    assert(json_node_get_int(store_get(store, "b")) == 2);
+    store_free(store);
+
+    g_file_set_contents(tmp->path, "{\"store\": []}", -1, NULL);
+    store = store_new(tmp->path);
+    assert(store_load(store, NULL) < 0);
+    assert(store_version(store) == 0);
+    store_free(store);
+
+    test_tmpfile_free(tmp);
+}
+
+int main(G_GNUC_UNUSED int argc, G_GNUC_UNUSED char **argv) {
+    test_patch();
+    test_persist();
+
+    return 0;
+}
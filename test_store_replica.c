@@ -0,0 +1,188 @@
+/*
+ * COLO background daemon replicated store test
+ *
+ * Copyright (c) Lukas Straub <lukasstraub2@web.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "store_replica.h"
+#include "daemon.h"
+
+void colod_syslog(G_GNUC_UNUSED int pri, const char *fmt, ...) {
+    va_list args;
+
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    fwrite("\n", 1, 1, stderr);
+    va_end(args);
+}
+
+static void deliver(Cpg *cpg, gboolean from_this_node, const gchar *json) {
+    colod_cpg_stub_notify_payload(cpg, MESSAGE_STORE, from_this_node, json,
+                                  strlen(json));
+}
+
+static gint64 get_int(ColodStoreReplica *replica, const gchar *key,
+                      const gchar *member) {
+    JsonObject *version;
+    JsonNode *value = store_replica_get(replica, key, &version);
+
+    assert(value);
+    if (!member) {
+        return json_node_get_int(value);
+    }
+    return json_object_get_int_member(json_node_get_object(value), member);
+}
+
+static gint64 get_version(ColodStoreReplica *replica, const gchar *key,
+                          const gchar *node) {
+    JsonObject *version;
+
+    store_replica_get(replica, key, &version);
+    assert(version);
+    if (!json_object_has_member(version, node)) {
+        return 0;
+    }
+    return json_object_get_int_member(version, node);
+}
+
+static void test_write(Cpg *cpg) {
+    ColodStoreReplica *replica = store_replica_new(cpg);
+    JsonObject *version;
+
+    assert(!strcmp(store_replica_serialized(replica), "{}"));
+
+    deliver(cpg, FALSE, "{\"node\": \"1\", \"ticket\": 1,"
+                        " \"set\": {\"a\": {\"x\": 1}}}");
+    assert(!strcmp(store_replica_serialized(replica), "{\"a\":{\"x\":1}}"));
+    assert(get_version(replica, "a", "1") == 1);
+
+    deliver(cpg, TRUE, "{\"node\": \"0\", \"ticket\": 1,"
+                       " \"patch\": {\"a\": {\"y\": 2}, \"b\": 3}}");
+    assert(get_int(replica, "a", "x") == 1);
+    assert(get_int(replica, "a", "y") == 2);
+    assert(get_int(replica, "b", NULL) == 3);
+    assert(get_version(replica, "a", "0") == 1);
+    assert(get_version(replica, "a", "1") == 1);
+
+    deliver(cpg, FALSE, "{\"node\": \"1\", \"ticket\": 2,"
+                        " \"set\": {\"b\": null}}");
+    assert(!store_replica_get(replica, "b", &version));
+    assert(get_version(replica, "b", "1") == 1);
+
+    // Garbage is ignored
+    deliver(cpg, FALSE, "{\"node\": \"1\", \"set\": 1}");
+    deliver(cpg, FALSE, "[]");
+    deliver(cpg, FALSE, "{");
+    assert(get_int(replica, "a", "x") == 1);
+
+    store_replica_free(replica);
+}
+
+static void test_sync(Cpg *cpg) {
+    ColodStoreReplica *replica = store_replica_new(cpg);
+
+    deliver(cpg, TRUE, "{\"node\": \"0\", \"ticket\": 1,"
+                       " \"set\": {\"a\": 1, \"c\": 1}}");
+
+    // Older and newer versions of a, concurrent version of c
+    deliver(cpg, FALSE, "{\"node\": \"1\", \"version\": {\"0\": 1, \"1\": 1},"
+                        " \"seen\": {\"0\": 1}, \"sync\": {"
+                        "\"a\": {\"value\": 5, \"version\": {}},"
+                        " \"c\": {\"value\": 2, \"version\": {\"1\": 1}},"
+                        " \"d\": {\"value\": null, \"version\": {\"1\": 1}}}}");
+    assert(get_int(replica, "a", NULL) == 1);
+    assert(get_int(replica, "c", NULL) == 2);
+    assert(get_version(replica, "c", "0") == 1);
+    assert(get_version(replica, "c", "1") == 1);
+    assert(!strstr(store_replica_serialized(replica), "\"d\""));
+
+    deliver(cpg, FALSE, "{\"node\": \"1\", \"version\": {\"0\": 2, \"1\": 1},"
+                        " \"seen\": {\"0\": 1}, \"sync\": {"
+                        "\"a\": {\"value\": 7, \"version\": {\"0\": 2}}}}");
+    assert(get_int(replica, "a", NULL) == 7);
+    assert(get_version(replica, "a", "0") == 2);
+
+    // Our own sync is not merged again
+    deliver(cpg, TRUE, "{\"node\": \"0\", \"version\": {\"0\": 3},"
+                       " \"seen\": {}, \"sync\": {"
+                       "\"a\": {\"value\": 9, \"version\": {\"0\": 3}}}}");
+    assert(get_int(replica, "a", NULL) == 7);
+
+    store_replica_free(replica);
+}
+
+static void test_stale_sync(Cpg *cpg) {
+    ColodStoreReplica *replica = store_replica_new(cpg);
+    CpgMembership *membership = (CpgMembership *) colod_cpg_membership(cpg);
+
+    deliver(cpg, FALSE, "{\"node\": \"1\", \"ticket\": 1,"
+                        " \"set\": {\"a\": 1}}");
+
+    // Composed by node 2 before the write above was delivered to it
+    deliver(cpg, FALSE, "{\"node\": \"2\", \"version\": {\"2\": 5},"
+                        " \"seen\": {}, \"sync\": {"
+                        "\"a\": {\"value\": 2, \"version\": {\"2\": 5}}}}");
+    assert(get_int(replica, "a", NULL) == 1);
+    assert(get_version(replica, "a", "1") == 1);
+    assert(get_version(replica, "a", "2") == 5);
+
+    // After a membership change the write may never have reached node 2
+    membership->member_count = 1;
+    membership->members[0].nodeid = 2;
+    deliver(cpg, FALSE, "{\"node\": \"2\", \"version\": {\"2\": 6},"
+                        " \"seen\": {}, \"sync\": {"
+                        "\"a\": {\"value\": 3, \"version\": {\"2\": 6}}}}");
+    assert(get_int(replica, "a", NULL) == 3);
+
+    membership->member_count = 0;
+    store_replica_free(replica);
+}
+
+static void test_hello(Cpg *cpg) {
+    ColodStoreReplica *replica = store_replica_new(cpg);
+    CpgMembership *membership = (CpgMembership *) colod_cpg_membership(cpg);
+    guint sent;
+
+    deliver(cpg, FALSE, "{\"node\": \"1\", \"ticket\": 1,"
+                        " \"set\": {\"a\": 1}}");
+    sent = colod_cpg_stub_payloads_sent(cpg);
+
+    // Retransmitted hellos get a single sync
+    colod_cpg_stub_notify(cpg, MESSAGE_HELLO, FALSE, FALSE);
+    colod_cpg_stub_notify(cpg, MESSAGE_HELLO, FALSE, FALSE);
+    while (g_main_context_iteration(NULL, FALSE));
+    assert(colod_cpg_stub_payloads_sent(cpg) == sent + 1);
+
+    colod_cpg_stub_notify(cpg, MESSAGE_HELLO, FALSE, FALSE);
+    while (g_main_context_iteration(NULL, FALSE));
+    assert(colod_cpg_stub_payloads_sent(cpg) == sent + 1);
+
+    // Restarted peer
+    membership->member_count = 1;
+    membership->members[0].pid = 2;
+    colod_cpg_stub_notify(cpg, MESSAGE_HELLO, FALSE, FALSE);
+    while (g_main_context_iteration(NULL, FALSE));
+    assert(colod_cpg_stub_payloads_sent(cpg) == sent + 2);
+
+    membership->member_count = 0;
+    store_replica_free(replica);
+}
+
+int main(G_GNUC_UNUSED int argc, G_GNUC_UNUSED char **argv) {
+    Cpg *cpg = colod_open_cpg(NULL, NULL);
+
+    test_write(cpg);
+    test_sync(cpg);
+    test_stale_sync(cpg);
+    test_hello(cpg);
+
+    cpg_free(cpg);
+    return 0;
+}
@@ -0,0 +1,36 @@
+/*
+ * COLO background daemon
+ *
+ * Copyright (c) Lukas Straub <lukasstraub2@web.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <assert.h>
+#include <unistd.h>
+
+#include "test_util.h"
+
+TestTmpFile *test_tmpfile_new(const gchar *name) {
+    TestTmpFile *tmp = g_new0(TestTmpFile, 1);
+
+    tmp->dir = g_dir_make_tmp("colod_test_XXXXXX", NULL);
+    assert(tmp->dir);
+    tmp->path = g_build_filename(tmp->dir, name, NULL);
+    return tmp;
+}
+
+void test_tmpfile_free(TestTmpFile *tmp) {
+    unlink(tmp->path);
+    rmdir(tmp->dir);
+    g_free(tmp->path);
+    g_free(tmp->dir);
+    g_free(tmp);
+}
+
+JsonNode *test_parse(const gchar *json) {
+    JsonNode *node = json_from_string(json, NULL);
+    assert(node);
+    return node;
+}
@@ -0,0 +1,29 @@
+/*
+ * COLO background daemon
+ *
+ * Copyright (c) Lukas Straub <lukasstraub2@web.de>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef TEST_UTIL_H
+#define TEST_UTIL_H
+
+#include <glib-2.0/glib.h>
+#include <json-glib-1.0/json-glib/json-glib.h>
+
+// A file named name in a fresh temporary directory
+typedef struct TestTmpFile {
+    gchar *dir;
+    gchar *path;
+} TestTmpFile;
+
+TestTmpFile *test_tmpfile_new(const gchar *name);
+// Removes the file and the directory
+void test_tmpfile_free(TestTmpFile *tmp);
+
+// Aborts if json is invalid
+JsonNode *test_parse(const gchar *json);
+
+#endif // TEST_UTIL_H
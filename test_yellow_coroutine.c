@@ -100,6 +100,41 @@ int _test_co(Coroutine *coroutine, TestCoroutine *this, ColodEvent event) {
     co_yield(0);
     assert(!event);
 
+    CO source_id = g_timeout_add(160, coroutine->cb.plain, this);
+    netlink_stub_notify("eth0", TRUE);
+
+    co_yield(0);
+    assert(event == EVENT_UNYELLOW);
+    g_source_remove(CO source_id);
+
+    CO source_id = g_idle_add(coroutine->cb.plain, this);
+    co_yield(0);
+    assert(!event);
+
+
+
+    CO source_id = g_timeout_add(160, coroutine->cb.plain, this);
+    netlink_stub_notify_stats("eth0", &(NetlinkLinkStats) { .errors = 11 });
+
+    co_yield(0);
+    assert(event == EVENT_YELLOW);
+    g_source_remove(CO source_id);
+
+    CO source_id = g_idle_add(coroutine->cb.plain, this);
+    co_yield(0);
+    assert(!event);
+
+    CO source_id = g_timeout_add(160, coroutine->cb.plain, this);
+    netlink_stub_notify_stats("eth0", &(NetlinkLinkStats) { .errors = 10 });
+
+    co_yield(0);
+    assert(event == EVENT_UNYELLOW);
+    g_source_remove(CO source_id);
+
+    CO source_id = g_idle_add(coroutine->cb.plain, this);
+    co_yield(0);
+    assert(!event);
+
 
 
     yellow_shutdown(this->yellow_co);
@@ -143,6 +178,122 @@ static void test_queue_event(gpointer data, ColodEvent event) {
     _test_queue_event(this, event);
 }
 
+static ColodEvent events[4];
+static guint event_count;
+
+static void record_event(G_GNUC_UNUSED gpointer data, ColodEvent event) {
+    assert(event_count < G_N_ELEMENTS(events));
+    events[event_count++] = event;
+}
+
+// Run the main loop for ms or until count events were seen
+static void run(guint ms, guint count) {
+    gint64 deadline = g_get_monotonic_time() + ms * 1000;
+
+    while (event_count < count && g_get_monotonic_time() < deadline) {
+        g_main_context_iteration(g_main_context_default(), FALSE);
+        g_usleep(1000);
+    }
+}
+
+static void test_damping(Cpg *cpg) {
+    ColodContext ctx = {0};
+    YellowCoroutine *yellow_co;
+    YellowStatus status;
+
+    ctx.monitor_interface = "eth0";
+    ctx.link_yellow_threshold = 100;
+    ctx.link_unyellow_threshold = 100;
+    ctx.flap_penalty = 1000;
+    ctx.flap_suppress = 2500;
+    ctx.flap_reuse = 1000;
+    ctx.flap_half_life = 200;
+    yellow_co = yellow_coroutine_new(cpg, &ctx, 50, 100, NULL);
+    assert(yellow_co);
+    yellow_add_notify(yellow_co, record_event, NULL);
+
+    // Below the suppress threshold changes pass as usual
+    netlink_stub_notify("eth0", FALSE);
+    netlink_stub_notify("eth0", TRUE);
+    yellow_query(yellow_co, &status);
+    assert(!status.suppressed && status.penalty >= 1000);
+
+    // Flapping past the threshold, the link counts as yellow even though
+    // it ends up being up
+    netlink_stub_notify("eth0", FALSE);
+    netlink_stub_notify("eth0", TRUE);
+    yellow_query(yellow_co, &status);
+    assert(status.suppressed && status.penalty >= 2500);
+
+    run(300, 2);
+    assert(event_count == 1 && events[0] == EVENT_YELLOW);
+    yellow_query(yellow_co, &status);
+    assert(status.suppressed);
+
+    // Reused once the penalty decayed, then the real state is reported
+    run(3000, 2);
+    assert(event_count == 2 && events[1] == EVENT_UNYELLOW);
+    yellow_query(yellow_co, &status);
+    assert(!status.suppressed && status.penalty < 1000);
+
+    yellow_coroutine_free(yellow_co);
+}
+
+static void test_weighted(Cpg *cpg) {
+    gchar *links[] = {"eth1:replication", "eth2:client", NULL};
+    ColodContext ctx = {0};
+    YellowCoroutine *yellow_co;
+    YellowStatus status;
+
+    // Weights 100 and 50, so the client link alone scores 33
+    ctx.monitor_links = links;
+    ctx.link_yellow_threshold = 50;
+    ctx.link_unyellow_threshold = 30;
+    ctx.link_max_errors = 10;
+    yellow_co = yellow_coroutine_new(cpg, &ctx, 50, 100, NULL);
+    assert(yellow_co);
+    event_count = 0;
+    yellow_add_notify(yellow_co, record_event, NULL);
+
+    netlink_stub_notify("eth2", FALSE);
+    yellow_query(yellow_co, &status);
+    assert(status.score == 33);
+    run(300, 1);
+    assert(!event_count);
+
+    netlink_stub_notify("eth1", FALSE);
+    yellow_query(yellow_co, &status);
+    assert(status.score == 100);
+    run(300, 1);
+    assert(event_count == 1 && events[0] == EVENT_YELLOW);
+
+    // Between the thresholds, stays yellow
+    netlink_stub_notify("eth1", TRUE);
+    yellow_query(yellow_co, &status);
+    assert(status.score == 33);
+    run(300, 2);
+    assert(event_count == 1);
+
+    netlink_stub_notify("eth2", TRUE);
+    run(300, 2);
+    assert(event_count == 2 && events[1] == EVENT_UNYELLOW);
+
+    // A degraded link counts as down
+    netlink_stub_notify_stats("eth1", &(NetlinkLinkStats) { .errors = 11 });
+    yellow_query(yellow_co, &status);
+    assert(status.score == 66);
+    run(300, 3);
+    assert(event_count == 3 && events[2] == EVENT_YELLOW);
+
+    netlink_stub_notify_stats("eth1", &(NetlinkLinkStats) { .errors = 0 });
+    yellow_query(yellow_co, &status);
+    assert(status.score == 0);
+    run(300, 4);
+    assert(event_count == 4 && events[3] == EVENT_UNYELLOW);
+
+    yellow_coroutine_free(yellow_co);
+}
+
 int main(G_GNUC_UNUSED int argc, G_GNUC_UNUSED char **argv) {
     GError *local_errp = NULL;
     TestCoroutine _this = {0};
@@ -155,6 +306,9 @@ int main(G_GNUC_UNUSED int argc, G_GNUC_UNUSED char **argv) {
 
     this->cpg = colod_open_cpg(NULL, NULL);
     this->ctx.monitor_interface = "eth0";
+    this->ctx.link_yellow_threshold = 100;
+    this->ctx.link_unyellow_threshold = 100;
+    this->ctx.link_max_errors = 10;
     this->yellow_co = yellow_coroutine_new(this->cpg, &this->ctx,
                                            50, 100, &local_errp);
     if (!this->yellow_co) {
@@ -171,6 +325,8 @@ int main(G_GNUC_UNUSED int argc, G_GNUC_UNUSED char **argv) {
     g_main_loop_unref(this->mainloop);
 
     yellow_coroutine_free(this->yellow_co);
+    test_damping(this->cpg);
+    test_weighted(this->cpg);
     cpg_free(this->cpg);
 
     return 0;
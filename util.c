@@ -199,6 +199,47 @@ guint queue_remove(ColodQueue *queue) {
     return ret;
 }
 
+void colod_spsc_init(ColodSpscQueue *queue, guint size) {
+    assert(size && !(size & (size - 1)));
+
+    queue->entries = g_new0(gpointer, size);
+    queue->size = size;
+    queue->head = 0;
+    queue->tail = 0;
+}
+
+void colod_spsc_destroy(ColodSpscQueue *queue) {
+    g_free(queue->entries);
+    queue->entries = NULL;
+}
+
+gboolean colod_spsc_push(ColodSpscQueue *queue, gpointer entry) {
+    guint tail = queue->tail;
+    guint head = g_atomic_int_get(&queue->head);
+
+    if (tail - head == queue->size) {
+        return FALSE;
+    }
+
+    queue->entries[tail & (queue->size - 1)] = entry;
+    g_atomic_int_set(&queue->tail, tail + 1);
+    return TRUE;
+}
+
+gpointer colod_spsc_pop(ColodSpscQueue *queue) {
+    guint head = queue->head;
+    guint tail = g_atomic_int_get(&queue->tail);
+    gpointer entry;
+
+    if (head == tail) {
+        return NULL;
+    }
+
+    entry = queue->entries[head & (queue->size - 1)];
+    g_atomic_int_set(&queue->head, head + 1);
+    return entry;
+}
+
 ColodCallback *colod_callback_find(ColodCallbackHead *head,
                                    ColodCallbackFunc func, gpointer user_data) {
     ColodCallback *entry;
@@ -53,6 +53,21 @@ void queue_add(ColodQueue *queue, guint entry);
 guint queue_peek(ColodQueue *queue);
 guint queue_remove(ColodQueue *queue);
 
+/*
+ * Lock-free queue for exactly one producer and one consumer thread. The
+ * size must be a power of two.
+ */
+typedef struct ColodSpscQueue {
+    gpointer *entries;
+    guint size;
+    guint head, tail;
+} ColodSpscQueue;
+
+void colod_spsc_init(ColodSpscQueue *queue, guint size);
+void colod_spsc_destroy(ColodSpscQueue *queue);
+gboolean colod_spsc_push(ColodSpscQueue *queue, gpointer entry);
+gpointer colod_spsc_pop(ColodSpscQueue *queue);
+
 typedef void (*ColodCallbackFunc)(void);
 typedef struct ColodCallback {
     QLIST_ENTRY(ColodCallback) next;
@@ -17,17 +17,17 @@ typedef struct ColodWatchdog {
     const ColodContext *ctx;
     guint interval;
     guint timer_id;
+    // Monotonic time of the last qmp activity or health check
+    gint64 last_activity;
     gboolean quit;
 } ColodWatchdog;
 
+/*
+ * Called for every qmp event and command, so only note the time. The
+ * timer is re-armed for the remaining time when it fires early.
+ */
 void colod_watchdog_refresh(ColodWatchdog *state) {
-    if (state->timer_id) {
-        g_source_remove(state->timer_id);
-        state->timer_id = g_timeout_add_full(G_PRIORITY_LOW,
-                                             state->interval,
-                                             state->coroutine.cb.plain,
-                                             &state->coroutine, NULL);
-    }
+    state->last_activity = g_get_monotonic_time();
 }
 
 static void colod_watchdog_event_cb(gpointer data,
@@ -62,21 +62,29 @@ static gboolean _colod_watchdog_co(Coroutine *coroutine) {
     ColodWatchdog *state = (ColodWatchdog *) coroutine;
     int ret;
     GError *local_errp = NULL;
+    gint64 remaining;
 
     co_begin(gboolean, G_SOURCE_CONTINUE);
 
+    state->last_activity = g_get_monotonic_time();
     while (!state->quit) {
-        state->timer_id = g_timeout_add_full(G_PRIORITY_LOW,
-                                             state->interval,
-                                             coroutine->cb.plain,
-                                             coroutine, NULL);
-        co_yield_int(G_SOURCE_REMOVE);
-        if (state->quit) {
-            break;
+        remaining = state->last_activity + (gint64) state->interval * 1000
+                    - g_get_monotonic_time();
+        if (remaining > 0) {
+            state->timer_id = g_timeout_add_full(G_PRIORITY_LOW,
+                                                 (remaining + 999) / 1000,
+                                                 coroutine->cb.plain,
+                                                 coroutine, NULL);
+            co_yield_int(G_SOURCE_REMOVE);
+            if (state->quit) {
+                break;
+            }
+            state->timer_id = 0;
+            continue;
         }
-        state->timer_id = 0;
 
-        co_recurse(ret = colod_check_health_co(coroutine, state->ctx->main_coroutine,
+        // Needs a round trip to notice a hung qemu
+        co_recurse(ret = colod_probe_health_co(coroutine, state->ctx->main_coroutine,
                                                &local_errp));
         if (ret < 0) {
             log_error_fmt("colod check health: %s", local_errp->message);
@@ -84,6 +92,7 @@ static gboolean _colod_watchdog_co(Coroutine *coroutine) {
             local_errp = NULL;
             return G_SOURCE_REMOVE;
         }
+        state->last_activity = g_get_monotonic_time();
     }
 
     co_end;
@@ -7,6 +7,9 @@
  * See the COPYING file in the top-level directory.
  */
 
+#include <math.h>
+#include <net/if.h>
+
 #include "yellow_coroutine.h"
 #include "coroutine_stack.h"
 #include "eventqueue.h"
@@ -21,6 +24,19 @@ struct YellowCoroutine {
     ColodNetlink *netlink;
     ColodCallbackHead callbacks;
     guint timeout1, timeout2;
+    GArray *links;
+
+    /*
+     * Flap damping: every change of the link state adds to a penalty that
+     * decays exponentially. Once the penalty is above --flap_suppress, the
+     * link counts as yellow whatever its state until the penalty decays
+     * below --flap_reuse.
+     */
+    ColodEvent link_event;
+    double penalty;
+    gint64 penalty_time;
+    gboolean suppressed;
+    guint reuse_source_id;
 };
 
 void yellow_add_notify(YellowCoroutine *this, YellowCallback _func,
@@ -153,10 +169,77 @@ static gboolean yellow_co_wrap(
     return yellow_co(data);
 }
 
+static double yellow_penalty(YellowCoroutine *this, gint64 now) {
+    double elapsed = (now - this->penalty_time) / 1000.0;
+    return this->penalty * exp2(-elapsed / this->ctx->flap_half_life);
+}
+
+static void yellow_queue_event(YellowCoroutine *this, ColodEvent event);
+
+static gboolean yellow_reuse_cb(gpointer data) {
+    YellowCoroutine *this = data;
+    const ColodContext *ctx = this->ctx;
+    double penalty = yellow_penalty(this, g_get_monotonic_time());
+
+    this->reuse_source_id = 0;
+
+    if (penalty >= ctx->flap_reuse) {
+        // The link flapped again meanwhile
+        guint delay = ctx->flap_half_life * log2(penalty / ctx->flap_reuse);
+        this->reuse_source_id = g_timeout_add(delay + 1, yellow_reuse_cb, this);
+        return G_SOURCE_REMOVE;
+    }
+
+    colod_syslog(LOG_INFO, "link flapping stopped, penalty %.0f", penalty);
+    this->suppressed = FALSE;
+    yellow_queue_event(this, this->link_event);
+    return G_SOURCE_REMOVE;
+}
+
+// Returns the event to pass on for a link state change
+static ColodEvent yellow_damp(YellowCoroutine *this, ColodEvent event) {
+    const ColodContext *ctx = this->ctx;
+    gint64 now = g_get_monotonic_time();
+
+    if (!ctx->flap_penalty || event == this->link_event) {
+        this->link_event = event;
+        return this->suppressed ? EVENT_YELLOW : event;
+    }
+    this->link_event = event;
+
+    this->penalty = MIN(yellow_penalty(this, now) + ctx->flap_penalty,
+                        4.0 * ctx->flap_suppress);
+    this->penalty_time = now;
+
+    if (!this->suppressed && this->penalty >= ctx->flap_suppress) {
+        colod_syslog(LOG_WARNING, "link is flapping, penalty %.0f, "
+                     "treating it as yellow", this->penalty);
+        this->suppressed = TRUE;
+        this->reuse_source_id = g_timeout_add(0, yellow_reuse_cb, this);
+    }
+
+    // A link that is flapping can't be trusted, err on the safe side
+    return this->suppressed ? EVENT_YELLOW : event;
+}
+
+static void yellow_query_damping(YellowCoroutine *this, guint *penalty,
+                                 gboolean *suppressed) {
+    if (!this->ctx->flap_penalty) {
+        *penalty = 0;
+    } else {
+        *penalty = yellow_penalty(this, g_get_monotonic_time());
+    }
+    *suppressed = this->suppressed;
+}
+
 static void yellow_queue_event(YellowCoroutine *this, ColodEvent event) {
     Coroutine *coroutine = &this->coroutine;
 
     assert(event == EVENT_QUIT || event == EVENT_YELLOW || event == EVENT_UNYELLOW);
+    if (event != EVENT_QUIT) {
+        event = yellow_damp(this, event);
+    }
+
     co_enter(coroutine, _yellow_co(coroutine, this, event));
     if (coroutine->yield) {
         return;
@@ -165,21 +248,157 @@ static void yellow_queue_event(YellowCoroutine *this, ColodEvent event) {
     this->quit = TRUE;
 }
 
+const gchar *yellow_link_role_str(YellowLinkRole role) {
+    switch (role) {
+        case LINK_ROLE_REPLICATION: return "replication";
+        case LINK_ROLE_CLIENT: return "client";
+    }
+
+    abort();
+}
+
+static YellowLink *yellow_link_by_name(YellowCoroutine *this,
+                                       const char *ifname) {
+    for (guint i = 0; i < this->links->len; i++) {
+        YellowLink *link = &g_array_index(this->links, YellowLink, i);
+        if (!strcmp(link->ifname, ifname)) {
+            return link;
+        }
+    }
+
+    return NULL;
+}
+
+static guint yellow_score(YellowCoroutine *this) {
+    guint total = 0, down = 0;
+
+    for (guint i = 0; i < this->links->len; i++) {
+        YellowLink *link = &g_array_index(this->links, YellowLink, i);
+        total += link->weight;
+        if (!link->up || link->degraded) {
+            down += link->weight;
+        }
+    }
+
+    if (!total) {
+        return 0;
+    }
+    return down * 100 / total;
+}
+
+void yellow_query(YellowCoroutine *this, YellowStatus *ret) {
+    ret->score = yellow_score(this);
+    ret->link_count = this->links->len;
+    ret->links = (const YellowLink *) this->links->data;
+    netlink_query(this->netlink, &ret->netlink);
+    yellow_query_damping(this, &ret->penalty, &ret->suppressed);
+}
+
+static void yellow_update(YellowCoroutine *this) {
+    guint score = yellow_score(this);
+
+    if (score >= this->ctx->link_yellow_threshold) {
+        yellow_queue_event(this, EVENT_YELLOW);
+    } else if (score < this->ctx->link_unyellow_threshold) {
+        yellow_queue_event(this, EVENT_UNYELLOW);
+    }
+}
+
 static void yellow_netlink_event_cb(gpointer data, const char *ifname,
                                     gboolean up) {
     YellowCoroutine *this = data;
+    YellowLink *link;
+
+    link = yellow_link_by_name(this, ifname);
+    if (!link) {
+        return;
+    }
+
+    if (link->up && !up) {
+        link->flaps++;
+    }
+    link->up = up;
+
+    yellow_update(this);
+}
+
+static gboolean yellow_exceeds(guint64 value, guint max) {
+    return max && value > max;
+}
+
+static void yellow_netlink_stats_cb(gpointer data, const char *ifname,
+                                    const NetlinkLinkStats *delta) {
+    YellowCoroutine *this = data;
+    const ColodContext *ctx = this->ctx;
+    YellowLink *link;
+    gboolean degraded;
 
-    if (!this->ctx->monitor_interface) {
+    link = yellow_link_by_name(this, ifname);
+    if (!link) {
         return;
     }
 
-    if (!strcmp(ifname, this->ctx->monitor_interface)) {
-        if (up) {
-            yellow_queue_event(this, EVENT_UNYELLOW);
-        } else {
-            yellow_queue_event(this, EVENT_YELLOW);
+    degraded = yellow_exceeds(delta->errors, ctx->link_max_errors)
+            || yellow_exceeds(delta->drops, ctx->link_max_drops)
+            || yellow_exceeds(delta->carrier_changes,
+                              ctx->link_max_carrier_changes);
+    if (degraded == link->degraded) {
+        return;
+    }
+
+    colod_syslog(LOG_WARNING, "link %s %s: %" G_GUINT64_FORMAT " errors, "
+                 "%" G_GUINT64_FORMAT " drops, %" G_GUINT64_FORMAT
+                 " carrier changes", ifname,
+                 degraded ? "degraded" : "recovered", delta->errors,
+                 delta->drops, delta->carrier_changes);
+    link->degraded = degraded;
+    yellow_update(this);
+}
+
+static int yellow_add_link(YellowCoroutine *this, const gchar *spec,
+                           GError **errp) {
+    gchar **parts = g_strsplit(spec, ":", 3);
+    YellowLink link = { .up = TRUE };
+    int ret = -1;
+
+    if (!parts[0] || !*parts[0] || strlen(parts[0]) >= IF_NAMESIZE) {
+        colod_error_set(errp, "Invalid interface name in \"%s\"", spec);
+        goto out;
+    }
+
+    if (yellow_link_by_name(this, parts[0])) {
+        colod_error_set(errp, "Interface %s is monitored twice", parts[0]);
+        goto out;
+    }
+
+    link.role = LINK_ROLE_REPLICATION;
+    link.weight = 100;
+    if (parts[1] && !strcmp(parts[1], "client")) {
+        link.role = LINK_ROLE_CLIENT;
+        link.weight = 50;
+    } else if (parts[1] && *parts[1] && strcmp(parts[1], "replication")) {
+        colod_error_set(errp, "Invalid link role in \"%s\"", spec);
+        goto out;
+    }
+
+    if (parts[1] && parts[2]) {
+        gchar *end;
+        guint64 weight = g_ascii_strtoull(parts[2], &end, 10);
+        if (!*parts[2] || *end || weight > G_MAXUINT16) {
+            colod_error_set(errp, "Invalid link weight in \"%s\"", spec);
+            goto out;
         }
+        link.weight = weight;
     }
+
+    link.ifname = g_strdup(parts[0]);
+    g_array_append_val(this->links, link);
+    netlink_watch(this->netlink, link.ifname);
+    ret = 0;
+
+out:
+    g_strfreev(parts);
+    return ret;
 }
 
 YellowCoroutine *yellow_coroutine_new(Cpg *cpg, const ColodContext *ctx,
@@ -197,20 +416,42 @@ YellowCoroutine *yellow_coroutine_new(Cpg *cpg, const ColodContext *ctx,
     this->ctx = ctx;
     this->timeout1 = timeout1;
     this->timeout2 = timeout2;
+    this->link_event = EVENT_UNYELLOW;
+
+    this->links = g_array_new(FALSE, FALSE, sizeof(YellowLink));
 
     this->netlink = netlink_new(errp);
     if (!this->netlink) {
+        g_array_free(this->links, TRUE);
         g_free(this);
         return NULL;
     }
-
     netlink_add_notify(this->netlink, yellow_netlink_event_cb, this);
+    netlink_add_stats_notify(this->netlink, yellow_netlink_stats_cb, this);
+
+    if (ctx->monitor_interface) {
+        ret = yellow_add_link(this, ctx->monitor_interface, errp);
+        if (ret < 0) {
+            yellow_coroutine_free(this);
+            return NULL;
+        }
+    }
+    for (guint i = 0; ctx->monitor_links && ctx->monitor_links[i]; i++) {
+        ret = yellow_add_link(this, ctx->monitor_links[i], errp);
+        if (ret < 0) {
+            yellow_coroutine_free(this);
+            return NULL;
+        }
+    }
+
     ret = netlink_request_status(this->netlink, errp);
     if (ret < 0) {
         yellow_coroutine_free(this);
         return NULL;
     }
 
+    netlink_poll_stats(this->netlink, ctx->link_stats_interval);
+
     return this;
 }
 
@@ -220,6 +461,12 @@ void yellow_shutdown(YellowCoroutine *this) {
     }
 
     netlink_del_notify(this->netlink, yellow_netlink_event_cb, this);
+    netlink_del_stats_notify(this->netlink, yellow_netlink_stats_cb, this);
+    netlink_poll_stats(this->netlink, 0);
+    if (this->reuse_source_id) {
+        g_source_remove(this->reuse_source_id);
+        this->reuse_source_id = 0;
+    }
     yellow_queue_event(this, EVENT_QUIT);
     assert(this->quit);
 }
@@ -230,5 +477,9 @@ void yellow_coroutine_free(YellowCoroutine *this) {
     colod_callback_clear(&this->callbacks);
 
     netlink_free(this->netlink);
+    for (guint i = 0; i < this->links->len; i++) {
+        g_free(g_array_index(this->links, YellowLink, i).ifname);
+    }
+    g_array_free(this->links, TRUE);
     g_free(this);
 }
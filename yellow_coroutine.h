@@ -10,15 +10,46 @@
 #ifndef YELLOW_COROUTINE_H
 #define YELLOW_COROUTINE_H
 
-#include "main_coroutine.h"
 #include "cpg.h"
 #include "daemon.h"
 #include "eventqueue.h"
+#include "netlink.h"
 
 typedef struct YellowCoroutine YellowCoroutine;
 
 typedef void (*YellowCallback)(gpointer data, ColodEvent event);
 
+typedef enum YellowLinkRole {
+    LINK_ROLE_REPLICATION,
+    LINK_ROLE_CLIENT
+} YellowLinkRole;
+
+typedef struct YellowLink {
+    gchar *ifname;
+    YellowLinkRole role;
+    guint weight;
+    gboolean up;
+    // Up, but errors, drops or carrier changes exceed the limits
+    gboolean degraded;
+    guint flaps;
+} YellowLink;
+
+/*
+ * The score is the weight of all links that are down or degraded in
+ * percent of the total weight.
+ */
+typedef struct YellowStatus {
+    guint score;
+    guint link_count;
+    const YellowLink *links;
+    NetlinkStats netlink;
+    guint penalty;
+    gboolean suppressed;
+} YellowStatus;
+
+const gchar *yellow_link_role_str(YellowLinkRole role);
+void yellow_query(YellowCoroutine *this, YellowStatus *ret);
+
 void yellow_add_notify(YellowCoroutine *this, YellowCallback _func,
                        gpointer user_data);
 void yellow_del_notify(YellowCoroutine *this, YellowCallback _func,